@@ -0,0 +1,609 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+
+/* acache.c - cache lstat results of walks and getattrs */
+
+/* Entries are keyed by path pool string and also indexed by (dev, ino) so
+ * an op on an open file can drop them.  A stat result is only returned to
+ * a user who has looked the path up successfully once before, so the
+ * cache never lets a walk skip a permission check it would have failed.
+ * Failed (ENOENT) lookups are cached too.  Entries expire after the TTL
+ * of the export that created them, and are dropped early by diod's own
+ * mutating ops and by inotify events on their parent directory.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "9p.h"
+#include "npfs.h"
+#include "list.h"
+#include "hash.h"
+#include "xpthread.h"
+
+#include "diod_log.h"
+
+#include "acache.h"
+
+#define AC_HASH_SIZE    4096
+#define AC_MAX_ENTRIES  65536
+#define AC_MAX_UIDS     4
+
+typedef struct awatch_struct AWatch;
+typedef struct aentry_struct AEntry;
+
+typedef struct {
+    dev_t           dev;
+    ino_t           ino;
+} AId;
+
+struct awatch_struct {
+    int             wd;
+    char            *dir;   /* prefix of entry paths, may be "" for "/" */
+    int             refs;
+};
+
+struct aentry_struct {
+    char            *path;
+    int             neg;    /* lookup failed with ENOENT */
+    struct stat     sb;
+    u64             expires;/* msec, CLOCK_MONOTONIC */
+    uid_t           uids[AC_MAX_UIDS]; /* users that have done the lookup */
+    int             nuids;
+    AWatch          *w;
+    AId             id;     /* key for ac_ino if !neg */
+    AEntry          *inonext; /* other paths with the same (dev, ino) */
+};
+
+static pthread_mutex_t  ac_lock = PTHREAD_MUTEX_INITIALIZER;
+static hash_t           ac_path = NULL; /* path -> AEntry */
+static hash_t           ac_ino = NULL;  /* (dev, ino) -> AEntry chain */
+static hash_t           ac_dir = NULL;  /* dir -> AWatch */
+static hash_t           ac_wd = NULL;   /* wd -> AWatch */
+static int              ac_active = 0;  /* an entry was ever inserted */
+static int              ac_ifd = -1;
+static pthread_t        ac_thread;
+static int              ac_thread_started = 0;
+
+static u64 ac_hit = 0;
+static u64 ac_neghit = 0;
+static u64 ac_miss = 0;
+static u64 ac_inval = 0;
+
+static u64
+_now_msec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int
+_id_key (const AId *id)
+{
+    return (unsigned int)(id->ino ^ (id->dev << 7));
+}
+
+static int
+_id_cmp (const AId *id1, const AId *id2)
+{
+    return (id1->dev != id2->dev || id1->ino != id2->ino);
+}
+
+static unsigned int
+_wd_key (const void *key)
+{
+    return *(const int *)key;
+}
+
+static int
+_wd_cmp (const void *key1, const void *key2)
+{
+    return *(const int *)key1 - *(const int *)key2;
+}
+
+static void
+_watch_put (AWatch *w)
+{
+    if (--w->refs > 0)
+        return;
+#if HAVE_SYS_INOTIFY_H
+    if (w->wd != -1) {
+        hash_remove (ac_wd, &w->wd);
+        (void)inotify_rm_watch (ac_ifd, w->wd);
+    }
+#endif
+    hash_remove (ac_dir, w->dir);
+    free (w->dir);
+    free (w);
+}
+
+/* Watch the directory holding 'path' for changes to its entries.
+ * Returns NULL if inotify is not available; entries then live out
+ * their TTL unless diod itself changes them.
+ */
+static AWatch *
+_watch_get (char *path)
+{
+    AWatch *w = NULL;
+#if HAVE_SYS_INOTIFY_H
+    char *p = strrchr (path, '/');
+    int len = p ? p - path : 0;
+    char *dir;
+    int wd;
+
+    if (ac_ifd == -1 || !p)
+        return NULL;
+    if (!(dir = malloc (len + 1)))
+        return NULL;
+    memcpy (dir, path, len);
+    dir[len] = '\0';
+    if ((w = hash_find (ac_dir, dir))) {
+        free (dir);
+        w->refs++;
+        return w;
+    }
+    wd = inotify_add_watch (ac_ifd, len > 0 ? dir : "/",
+                            IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE
+                          | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF
+                          | IN_MOVE_SELF | IN_ONLYDIR);
+    /* wd already in use means 'dir' aliases a watched directory */
+    if (wd < 0 || hash_find (ac_wd, &wd) || !(w = malloc (sizeof (*w)))) {
+        if (wd >= 0 && !hash_find (ac_wd, &wd))
+            (void)inotify_rm_watch (ac_ifd, wd);
+        free (dir);
+        return NULL;
+    }
+    w->wd = wd;
+    w->dir = dir;
+    w->refs = 1;
+    if (!hash_insert (ac_dir, w->dir, w)) {
+        (void)inotify_rm_watch (ac_ifd, wd);
+        free (dir);
+        free (w);
+        return NULL;
+    }
+    if (!hash_insert (ac_wd, &w->wd, w)) {
+        hash_remove (ac_dir, w->dir);
+        (void)inotify_rm_watch (ac_ifd, wd);
+        free (dir);
+        free (w);
+        return NULL;
+    }
+#endif
+    return w;
+}
+
+static void
+_ino_unlink (AEntry *e)
+{
+    AEntry *head, **pp;
+
+    if (e->neg || !(head = hash_find (ac_ino, &e->id)))
+        return;
+    if (head == e) {
+        hash_remove (ac_ino, &e->id);
+        if (e->inonext)
+            (void)hash_insert (ac_ino, &e->inonext->id, e->inonext);
+    } else {
+        for (pp = &head->inonext; *pp != NULL; pp = &(*pp)->inonext) {
+            if (*pp == e) {
+                *pp = e->inonext;
+                break;
+            }
+        }
+    }
+    e->inonext = NULL;
+}
+
+static void
+_ino_link (AEntry *e)
+{
+    AEntry *head;
+
+    e->inonext = NULL;
+    if (e->neg)
+        return;
+    e->id.dev = e->sb.st_dev;
+    e->id.ino = e->sb.st_ino;
+    if ((head = hash_find (ac_ino, &e->id))) {
+        e->inonext = head->inonext;
+        head->inonext = e;
+    } else
+        (void)hash_insert (ac_ino, &e->id, e);
+}
+
+/* Called by ac_path when an entry is removed with hash_delete_if ().
+ */
+static void
+_entry_destroy (AEntry *e)
+{
+    _ino_unlink (e);
+    if (e->w)
+        _watch_put (e->w);
+    free (e->path);
+    free (e);
+}
+
+static void
+_entry_remove (AEntry *e)
+{
+    hash_remove (ac_path, e->path);
+    _entry_destroy (e);
+    ac_inval++;
+}
+
+static void
+_inval_path (char *path)
+{
+    AEntry *e;
+
+    if ((e = hash_find (ac_path, path)))
+        _entry_remove (e);
+}
+
+static void
+_inval_parent (char *path)
+{
+    char *p = strrchr (path, '/');
+    AEntry *e;
+
+    if (!p)
+        return;
+    *p = '\0';
+    e = hash_find (ac_path, path);
+    *p = '/';
+    if (e)
+        _entry_remove (e);
+}
+
+static int
+_match_prefix (void *data, const void *key, void *arg)
+{
+    AEntry *e = data;
+    char *prefix = arg;
+    int len = strlen (prefix);
+
+    if (strncmp (e->path, prefix, len) != 0 || e->path[len] != '/')
+        return 0;
+    ac_inval++;
+    return 1;
+}
+
+static int
+_match_expired (void *data, const void *key, void *arg)
+{
+    AEntry *e = data;
+    u64 *now = arg;
+
+    return (e->expires <= *now);
+}
+
+static int
+_match_any (void *data, const void *key, void *arg)
+{
+    return 1;
+}
+
+int
+acache_lookup (char *path, uid_t uid, struct stat *sb)
+{
+    AEntry *e;
+    int i, ret = 0;
+
+    if (!ac_active)
+        return 0;
+    xpthread_mutex_lock (&ac_lock);
+    if ((e = hash_find (ac_path, path))) {
+        if (e->expires <= _now_msec ()) {
+            hash_remove (ac_path, e->path);
+            _entry_destroy (e);
+            e = NULL;
+        }
+    }
+    if (e) {
+        for (i = 0; i < e->nuids; i++) {
+            if (e->uids[i] == uid)
+                break;
+        }
+        if (i < e->nuids) {
+            if (e->neg) {
+                ac_neghit++;
+                ret = -1;
+            } else {
+                ac_hit++;
+                *sb = e->sb;
+                ret = 1;
+            }
+        }
+    }
+    if (ret == 0)
+        ac_miss++;
+    xpthread_mutex_unlock (&ac_lock);
+    if (ret == -1)
+        errno = ENOENT;
+    return ret;
+}
+
+void
+acache_insert (char *path, uid_t uid, int ttl, struct stat *sb)
+{
+    char *name = strrchr (path, '/');
+    AEntry *e;
+    u64 now;
+
+    name = name ? name + 1 : path;
+    if (ttl <= 0 || !strcmp (name, ".") || !strcmp (name, ".."))
+        return;
+    xpthread_mutex_lock (&ac_lock);
+    ac_active = 1;
+    now = _now_msec ();
+    if ((e = hash_find (ac_path, path))) {
+        /* Same answer: remember this user may see it */
+        if (e->expires > now && (sb ? (!e->neg
+                                       && e->sb.st_dev == sb->st_dev
+                                       && e->sb.st_ino == sb->st_ino)
+                                    : e->neg)) {
+            if (sb)
+                e->sb = *sb;
+            if (e->nuids < AC_MAX_UIDS)
+                e->uids[e->nuids++] = uid;
+            else
+                e->uids[uid % AC_MAX_UIDS] = uid;
+            goto done;
+        }
+        hash_remove (ac_path, e->path);
+        _entry_destroy (e);
+    }
+    if (hash_count (ac_path) >= AC_MAX_ENTRIES) {
+        (void)hash_delete_if (ac_path, _match_expired, &now);
+        if (hash_count (ac_path) >= AC_MAX_ENTRIES)
+            (void)hash_delete_if (ac_path, _match_any, NULL);
+    }
+    if (!(e = malloc (sizeof (*e))))
+        goto done;
+    if (!(e->path = strdup (path))) {
+        free (e);
+        goto done;
+    }
+    e->neg = sb ? 0 : 1;
+    if (sb)
+        e->sb = *sb;
+    e->expires = now + (u64)ttl * 1000;
+    e->uids[0] = uid;
+    e->nuids = 1;
+    e->w = _watch_get (path);
+    if (!hash_insert (ac_path, e->path, e)) {
+        if (e->w)
+            _watch_put (e->w);
+        free (e->path);
+        free (e);
+        goto done;
+    }
+    _ino_link (e);
+done:
+    xpthread_mutex_unlock (&ac_lock);
+}
+
+void
+acache_inval (char *path)
+{
+    if (!ac_active)
+        return;
+    xpthread_mutex_lock (&ac_lock);
+    _inval_path (path);
+    _inval_parent (path);
+    xpthread_mutex_unlock (&ac_lock);
+}
+
+void
+acache_inval_tree (char *path)
+{
+    if (!ac_active)
+        return;
+    xpthread_mutex_lock (&ac_lock);
+    _inval_path (path);
+    _inval_parent (path);
+    (void)hash_delete_if (ac_path, _match_prefix, path);
+    xpthread_mutex_unlock (&ac_lock);
+}
+
+void
+acache_inval_ino (dev_t dev, ino_t ino)
+{
+    AId id = { .dev = dev, .ino = ino };
+    AEntry *e;
+
+    if (!ac_active)
+        return;
+    xpthread_mutex_lock (&ac_lock);
+    while ((e = hash_find (ac_ino, &id)))
+        _entry_remove (e);
+    xpthread_mutex_unlock (&ac_lock);
+}
+
+#if HAVE_SYS_INOTIFY_H
+static void
+_inotify_event (struct inotify_event *ev)
+{
+    AWatch *w;
+    char *path = NULL;
+    int len = 0;
+
+    if ((ev->mask & IN_Q_OVERFLOW)) {
+        ac_inval += hash_delete_if (ac_path, _match_any, NULL);
+        return;
+    }
+    if (!(w = hash_find (ac_wd, &ev->wd)))
+        return;
+    /* Take a reference so the watch survives invalidating its entries.
+     */
+    w->refs++;
+    if (ev->len > 0 && aspf (&path, &len, "%s/%s", w->dir, ev->name) == 0) {
+        _inval_path (path);
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM
+                                                | IN_MOVED_TO)))
+            (void)hash_delete_if (ac_path, _match_prefix, path);
+        free (path);
+    }
+    _inval_path (w->dir);
+    if ((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)))
+        (void)hash_delete_if (ac_path, _match_prefix, w->dir);
+    if ((ev->mask & IN_IGNORED)) {
+        hash_remove (ac_wd, &w->wd);
+        w->wd = -1;
+    }
+    _watch_put (w);
+}
+
+static void *
+_inotify_proc (void *arg)
+{
+    char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    int oldstate;
+
+    for (;;) {
+        if ((n = read (ac_ifd, buf, sizeof (buf))) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &oldstate);
+        xpthread_mutex_lock (&ac_lock);
+        for (p = buf; p < buf + n; p += sizeof (*ev) + ev->len) {
+            ev = (struct inotify_event *)p;
+            _inotify_event (ev);
+        }
+        xpthread_mutex_unlock (&ac_lock);
+        pthread_setcancelstate (oldstate, NULL);
+    }
+    return NULL;
+}
+#endif
+
+static char *
+_acache_ctl (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    xpthread_mutex_lock (&ac_lock);
+    if (aspf (&s, &len, "hit %"PRIu64"\nneghit %"PRIu64"\nmiss %"PRIu64"\n"
+              "inval %"PRIu64"\nentries %d\nwatches %d\n",
+              ac_hit, ac_neghit, ac_miss, ac_inval,
+              hash_count (ac_path), hash_count (ac_wd)) < 0)
+        np_uerror (ENOMEM);
+    xpthread_mutex_unlock (&ac_lock);
+    return s;
+}
+
+int
+acache_init (Npsrv *srv)
+{
+    int err;
+
+    ac_path = hash_create (AC_HASH_SIZE, (hash_key_f)hash_key_string,
+                           (hash_cmp_f)strcmp, (hash_del_f)_entry_destroy);
+    ac_ino = hash_create (AC_HASH_SIZE, (hash_key_f)_id_key,
+                          (hash_cmp_f)_id_cmp, NULL);
+    ac_dir = hash_create (AC_HASH_SIZE, (hash_key_f)hash_key_string,
+                          (hash_cmp_f)strcmp, NULL);
+    ac_wd = hash_create (AC_HASH_SIZE, _wd_key, _wd_cmp, NULL);
+    if (!ac_path || !ac_ino || !ac_dir || !ac_wd) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+#if HAVE_SYS_INOTIFY_H
+    /* Not fatal: without inotify, entries just live out their TTL.
+     */
+    if ((ac_ifd = inotify_init1 (IN_CLOEXEC)) < 0)
+        msg ("attribute cache: inotify_init1: %s", strerror (errno));
+    else if ((err = pthread_create (&ac_thread, NULL, _inotify_proc, NULL))) {
+        np_uerror (err);
+        goto error;
+    } else
+        ac_thread_started = 1;
+#endif
+    if (!np_ctl_addfile (srv->ctlroot, "attrcache", _acache_ctl, srv, 0))
+        goto error;
+    return 0;
+error:
+    acache_fini (srv);
+    return -1;
+}
+
+void
+acache_fini (Npsrv *srv)
+{
+    if (ac_thread_started) {
+        pthread_cancel (ac_thread);
+        pthread_join (ac_thread, NULL);
+        ac_thread_started = 0;
+    }
+    if (ac_path) {
+        hash_destroy (ac_path); /* destroys entries and watches */
+        ac_path = NULL;
+    }
+    if (ac_ino) {
+        hash_destroy (ac_ino);
+        ac_ino = NULL;
+    }
+    if (ac_wd) {
+        hash_destroy (ac_wd);
+        ac_wd = NULL;
+    }
+    if (ac_dir) {
+        hash_destroy (ac_dir);
+        ac_dir = NULL;
+    }
+    if (ac_ifd != -1) {
+        (void)close (ac_ifd);
+        ac_ifd = -1;
+    }
+    ac_active = 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,12 @@
+int     acache_init (Npsrv *srv);
+void    acache_fini (Npsrv *srv);
+
+int     acache_lookup (char *path, uid_t uid, struct stat *sb);
+void    acache_insert (char *path, uid_t uid, int ttl, struct stat *sb);
+void    acache_inval (char *path);
+void    acache_inval_tree (char *path);
+void    acache_inval_ino (dev_t dev, ino_t ino);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
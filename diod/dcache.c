@@ -0,0 +1,459 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+
+/* dcache.c - share directory listings among readers */
+
+/* When a whole cluster lists the same large directory, each client would
+ * otherwise make the server enumerate it again.  With the 'dircache'
+ * export option, a reader starting at offset 0 gets a snapshot: the
+ * complete listing already serialized as 9P dirents, which is shared by
+ * later readers until the directory's mtime or ctime changes.  Continuing
+ * reads are served from the same snapshot with a memcpy, and since each
+ * entry carries the real directory cookie, a reader can fall back to the
+ * live directory at any point.  Concurrent readers of a directory whose
+ * snapshot is being built wait for it.  Unused snapshots are evicted,
+ * least recently used first, beyond DC_MAX_BYTES or twice the largest
+ * snapshot allowed by an export, whichever is more.
+ * A snapshot that could not be built, e.g. because the listing is larger
+ * than the export allows, is remembered (up to DC_MAX_FAILED of them) so
+ * readers go straight to the live directory until it changes.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+
+#include "diod_log.h"
+
+#include "dcache.h"
+
+#define DC_HASH_SIZE    256
+#define DC_MAX_BYTES    (64*1024*1024)
+#define DC_MAX_FAILED   1024
+#define DC_RECENT_SECS  2
+
+typedef enum { DC_BUILDING, DC_VALID, DC_FAILED } DState;
+
+struct dsnap_struct {
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    DState          state;
+    int             refs;
+    int             cached; /* in hash and LRU list */
+    u8              *data;  /* serialized dirents */
+    size_t          len;
+    size_t          size;
+    size_t          limit;  /* largest _snap_bytes () allowed */
+    u32             *pos;   /* offset of each entry in data */
+    u64             *cookie;/* directory offset following each entry */
+    int             count;
+    int             max;
+    DSnap           next;   /* hash chain */
+    DSnap           lnext;  /* LRU or failed list, head is oldest */
+    DSnap           lprev;
+};
+
+static pthread_mutex_t  dc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   dc_cond = PTHREAD_COND_INITIALIZER;
+static DSnap            dc_hash[DC_HASH_SIZE];
+static DSnap            dc_head = NULL;
+static DSnap            dc_tail = NULL;
+static DSnap            dc_fhead = NULL;
+static DSnap            dc_ftail = NULL;
+static size_t           dc_budget = DC_MAX_BYTES;
+static size_t           dc_bytes = 0;
+static int              dc_count = 0;
+static int              dc_nfailed = 0;
+static u64              dc_hit = 0;
+static u64              dc_build = 0;
+static u64              dc_wait = 0;
+static u64              dc_evict = 0;
+static u64              dc_skip = 0;
+
+static unsigned int
+_hash (dev_t dev, ino_t ino)
+{
+    return (unsigned int)((dev * 31 + ino) % DC_HASH_SIZE);
+}
+
+static size_t
+_snap_bytes (DSnap s)
+{
+    return s->size + s->max * (sizeof (s->pos[0]) + sizeof (s->cookie[0]));
+}
+
+static void
+_snap_free_data (DSnap s)
+{
+    if (s->data)
+        free (s->data);
+    if (s->pos)
+        free (s->pos);
+    if (s->cookie)
+        free (s->cookie);
+    s->data = NULL;
+    s->pos = NULL;
+    s->cookie = NULL;
+    s->len = s->size = 0;
+    s->count = s->max = 0;
+}
+
+static void
+_snap_free (DSnap s)
+{
+    _snap_free_data (s);
+    free (s);
+}
+
+static void
+_list_unlink (DSnap s, DSnap *head, DSnap *tail)
+{
+    if (s->lprev)
+        s->lprev->lnext = s->lnext;
+    else
+        *head = s->lnext;
+    if (s->lnext)
+        s->lnext->lprev = s->lprev;
+    else
+        *tail = s->lprev;
+}
+
+static void
+_list_append (DSnap s, DSnap *head, DSnap *tail)
+{
+    s->lnext = NULL;
+    s->lprev = *tail;
+    if (*tail)
+        (*tail)->lnext = s;
+    else
+        *head = s;
+    *tail = s;
+}
+
+/* Take a snapshot out of the cache.  It is freed now, or by the last
+ * reader still holding a reference.
+ */
+static void
+_snap_remove (DSnap s)
+{
+    DSnap *sp;
+
+    for (sp = &dc_hash[_hash (s->dev, s->ino)]; *sp; sp = &(*sp)->next) {
+        if (*sp == s) {
+            *sp = s->next;
+            break;
+        }
+    }
+    if (s->state == DC_VALID) {
+        _list_unlink (s, &dc_head, &dc_tail);
+        dc_bytes -= _snap_bytes (s);
+        dc_count--;
+    } else if (s->state == DC_FAILED) {
+        _list_unlink (s, &dc_fhead, &dc_ftail);
+        dc_nfailed--;
+    }
+    s->cached = 0;
+    if (s->refs == 0)
+        _snap_free (s);
+}
+
+static void
+_evict (void)
+{
+    DSnap s = dc_head, next;
+
+    while (s && dc_bytes > dc_budget) {
+        next = s->lnext;
+        if (s->refs == 0) {
+            _snap_remove (s);
+            dc_evict++;
+        }
+        s = next;
+    }
+}
+
+static int
+_same_version (DSnap s, struct stat *sb)
+{
+    return (s->mtime.tv_sec == sb->st_mtim.tv_sec
+         && s->mtime.tv_nsec == sb->st_mtim.tv_nsec
+         && s->ctime.tv_sec == sb->st_ctim.tv_sec
+         && s->ctime.tv_nsec == sb->st_ctim.tv_nsec);
+}
+
+/* Get a reference to the snapshot of directory 'sb'.  If there is none,
+ * one is created in building state, *buildp is set, and the caller must
+ * fill it with dcache_append () and call dcache_done ().  The snapshot
+ * may take up to 'max' bytes.
+ * Returns NULL if the directory changed too recently to be snapshot, or
+ * building it failed, now or earlier with no larger 'max'.
+ */
+DSnap
+dcache_lookup (struct stat *sb, size_t max, int *buildp)
+{
+    DSnap s;
+    time_t now = time (NULL);
+    unsigned int h = _hash (sb->st_dev, sb->st_ino);
+
+    *buildp = 0;
+    if (now - sb->st_mtime < DC_RECENT_SECS
+                        || now - sb->st_ctime < DC_RECENT_SECS)
+        return NULL;
+    xpthread_mutex_lock (&dc_lock);
+    for (s = dc_hash[h]; s; s = s->next) {
+        if (s->dev == sb->st_dev && s->ino == sb->st_ino)
+            break;
+    }
+    if (s && (!_same_version (s, sb) || (s->state == DC_FAILED
+                                         && s->limit < max))) {
+        _snap_remove (s);
+        s = NULL;
+    }
+    if (s && s->state == DC_FAILED) {
+        dc_skip++;
+        s = NULL;
+        goto done;
+    }
+    if (s) {
+        s->refs++;
+        if (s->state == DC_BUILDING) {
+            dc_wait++;
+            while (s->state == DC_BUILDING)
+                xpthread_cond_wait (&dc_cond, &dc_lock);
+        }
+        if (s->state != DC_VALID) {
+            if (--s->refs == 0 && !s->cached)
+                _snap_free (s);
+            s = NULL;
+            goto done;
+        }
+        dc_hit++;
+        if (s->cached && s != dc_tail) {
+            _list_unlink (s, &dc_head, &dc_tail);
+            _list_append (s, &dc_head, &dc_tail);
+        }
+        goto done;
+    }
+    if (!(s = calloc (1, sizeof (*s))))
+        goto done;
+    s->dev = sb->st_dev;
+    s->ino = sb->st_ino;
+    s->mtime = sb->st_mtim;
+    s->ctime = sb->st_ctim;
+    s->limit = max;
+    s->state = DC_BUILDING;
+    s->refs = 1;
+    s->cached = 1;
+    s->next = dc_hash[h];
+    dc_hash[h] = s;
+    dc_build++;
+    if (dc_budget < 2 * max)
+        dc_budget = 2 * max;
+    *buildp = 1;
+done:
+    xpthread_mutex_unlock (&dc_lock);
+    return s;
+}
+
+/* Add a serialized dirent 'rec', followed by directory offset 'cookie',
+ * to a snapshot being built.  No lock is needed as other readers wait
+ * for the build to finish.
+ */
+int
+dcache_append (DSnap s, u8 *rec, u32 len, u64 cookie)
+{
+    if (s->count == s->max) {
+        int max = s->max ? s->max * 2 : 256;
+        u32 *pos;
+        u64 *c;
+
+        if (!(pos = realloc (s->pos, max * sizeof (*pos))))
+            goto nomem;
+        s->pos = pos;
+        if (!(c = realloc (s->cookie, max * sizeof (*c))))
+            goto nomem;
+        s->cookie = c;
+        s->max = max;
+    }
+    if (s->len + len > s->size) {
+        size_t size = s->size ? s->size * 2 : 16384;
+        u8 *data;
+
+        while (s->len + len > size)
+            size *= 2;
+        if (!(data = realloc (s->data, size)))
+            goto nomem;
+        s->data = data;
+        s->size = size;
+    }
+    if (_snap_bytes (s) > s->limit) {
+        errno = EFBIG;
+        return -1;
+    }
+    memcpy (s->data + s->len, rec, len);
+    s->pos[s->count] = s->len;
+    s->cookie[s->count] = cookie;
+    s->count++;
+    s->len += len;
+    return 0;
+nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Finish building a snapshot, waking readers waiting for it.
+ * A failed snapshot's data is dropped and its waiters read the directory.
+ * It stays in the hash as a record of the failure.
+ */
+void
+dcache_done (DSnap s, int ok)
+{
+    xpthread_mutex_lock (&dc_lock);
+    if (ok && s->cached) {
+        s->state = DC_VALID;
+        _list_append (s, &dc_head, &dc_tail);
+        dc_bytes += _snap_bytes (s);
+        dc_count++;
+        _evict ();
+    } else {
+        _snap_free_data (s);
+        s->state = DC_FAILED;
+        if (s->cached) {
+            _list_append (s, &dc_fhead, &dc_ftail);
+            if (++dc_nfailed > DC_MAX_FAILED)
+                _snap_remove (dc_fhead);
+        }
+    }
+    xpthread_cond_broadcast (&dc_cond);
+    xpthread_mutex_unlock (&dc_lock);
+}
+
+void
+dcache_put (DSnap s)
+{
+    xpthread_mutex_lock (&dc_lock);
+    if (--s->refs == 0 && !s->cached)
+        _snap_free (s);
+    xpthread_mutex_unlock (&dc_lock);
+}
+
+/* Copy whole serialized entries following directory offset 'offset' into
+ * 'buf'.  '*cursor' remembers where the previous read stopped so the
+ * common sequential case needs no search.  A snapshot is immutable once
+ * valid, so no lock is needed.  Returns the number of bytes copied, or -1
+ * if 'offset' is not a cookie in the snapshot.
+ */
+int
+dcache_read (DSnap s, u64 offset, int *cursor, u8 *buf, u32 count)
+{
+    int i, j;
+    size_t start, end;
+
+    if (offset == 0)
+        i = 0;
+    else if (*cursor > 0 && *cursor <= s->count
+                         && s->cookie[*cursor - 1] == offset)
+        i = *cursor;
+    else {
+        for (i = 0; i < s->count; i++) {
+            if (s->cookie[i] == offset)
+                break;
+        }
+        if (i == s->count)
+            return -1;
+        i++;
+    }
+    start = i < s->count ? s->pos[i] : s->len;
+    for (j = i; j < s->count; j++) {
+        end = j + 1 < s->count ? s->pos[j + 1] : s->len;
+        if (end - start > count)
+            break;
+    }
+    end = j < s->count ? s->pos[j] : s->len;
+    memcpy (buf, s->data + start, end - start);
+    *cursor = j;
+    return end - start;
+}
+
+static char *
+_dcache_ctl (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    xpthread_mutex_lock (&dc_lock);
+    if (aspf (&s, &len, "hit %"PRIu64"\nbuild %"PRIu64"\nwait %"PRIu64"\n"
+              "evict %"PRIu64"\nskip %"PRIu64"\nsnapshots %d\nbytes %zu\n"
+              "budget %zu\nfailed %d\n",
+              dc_hit, dc_build, dc_wait, dc_evict, dc_skip, dc_count,
+              dc_bytes, dc_budget, dc_nfailed) < 0)
+        np_uerror (ENOMEM);
+    xpthread_mutex_unlock (&dc_lock);
+    return s;
+}
+
+int
+dcache_init (Npsrv *srv)
+{
+    if (!np_ctl_addfile (srv->ctlroot, "dircache", _dcache_ctl, srv, 0))
+        return -1;
+    return 0;
+}
+
+/* Called after all requests have completed, so no snapshot is referenced.
+ */
+void
+dcache_fini (Npsrv *srv)
+{
+    int i;
+
+    xpthread_mutex_lock (&dc_lock);
+    for (i = 0; i < DC_HASH_SIZE; i++) {
+        while (dc_hash[i])
+            _snap_remove (dc_hash[i]);
+    }
+    xpthread_mutex_unlock (&dc_lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
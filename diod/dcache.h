@@ -0,0 +1,14 @@
+typedef struct dsnap_struct *DSnap;
+
+int     dcache_init (Npsrv *srv);
+void    dcache_fini (Npsrv *srv);
+
+DSnap   dcache_lookup (struct stat *sb, size_t max, int *buildp);
+int     dcache_append (DSnap s, u8 *rec, u32 len, u64 cookie);
+void    dcache_done (DSnap s, int ok);
+void    dcache_put (DSnap s);
+int     dcache_read (DSnap s, u64 offset, int *cursor, u8 *buf, u32 count);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
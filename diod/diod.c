@@ -83,7 +83,7 @@ static void          _service_run (srvmode_t mode, int rfdno, int wfdno);
 #define NR_OPEN         1048576 /* works on RHEL 5 x86_64 arch */
 #endif
 
-#define OPTIONS "fr:w:d:l:t:e:Eo:u:SL:nHpc:NU:s"
+#define OPTIONS "fr:w:d:l:t:e:Eo:u:SL:nHpc:NU:sM:O:"
 
 #if HAVE_GETOPT_LONG
 #define GETOPT(ac,av,opt,lopt) getopt_long (ac,av,opt,lopt,NULL)
@@ -107,6 +107,8 @@ static const struct option longopts[] = {
     {"logdest",            required_argument,  0, 'L'},
     {"config-file",        required_argument,  0, 'c'},
     {"socktest",           no_argument,        0, 's'},
+    {"maxmmap",            required_argument,  0, 'M'},
+    {"opencache",          required_argument,  0, 'O'},
     {0, 0, 0, 0},
 };
 #else
@@ -137,6 +139,8 @@ usage()
 "   -d,--debug MASK         set debugging mask\n"
 "   -c,--config-file FILE   set config file path\n"
 "   -s,--socktest           run in test mode where server exits early\n"
+"   -M,--maxmmap MB         cache up to MB megabytes of hot file data\n"
+"   -O,--opencache INT      keep up to INT closed read-only files open\n"
     );
     exit (1);
 }
@@ -214,6 +218,12 @@ main(int argc, char **argv)
             case 'o':   /* --export-ops opt,[opt,...] */
                 diod_conf_set_exportopts (optarg);
                 break;
+            case 'M':   /* --maxmmap MB */
+                diod_conf_set_maxmmap (strtoul (optarg, NULL, 10));
+                break;
+            case 'O':   /* --opencache INT */
+                diod_conf_set_opencache (strtoul (optarg, NULL, 10));
+                break;
             case 'n':   /* --no-auth */
                 diod_conf_set_auth_required (0);
                 break;
@@ -523,6 +533,7 @@ _service_loop_rdma (void *arg)
  * Threads will inherit this signal mask; _service_loop () will unblock.
  * Install handler for SIGUSR2 and don't block - this signal is used to
  * interrupt I/O operations when handling a 9p flush.
+ * Ignore SIGPIPE so a reply to a client that hung up fails with EPIPE.
  */
 static void
 _service_sigsetup (void)
@@ -541,6 +552,9 @@ _service_sigsetup (void)
         err_exit ("sigaction");
     if (sigaction (SIGUSR2, &sa, NULL) < 0)
         err_exit ("sigaction");
+    sa.sa_handler = SIG_IGN;
+    if (sigaction (SIGPIPE, &sa, NULL) < 0)
+        err_exit ("sigaction");
 
     sigemptyset (&sigs);
     sigaddset (&sigs, SIGHUP);
@@ -700,6 +714,8 @@ _service_run (srvmode_t mode, int rfdno, int wfdno)
         flags |= SRV_FLAGS_NOUSERDB;
     if (!(ss.srv = np_srv_create (nwthreads, flags))) /* starts threads */
         errn_exit (np_rerror (), "np_srv_create");
+    ss.srv->sendqmax = diod_conf_get_sendq_limit ();
+    ss.srv->affinitymax = diod_conf_get_user_affinity ();
     if (diod_init (ss.srv) < 0)
         errn_exit (np_rerror (), "diod_init");
 
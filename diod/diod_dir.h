@@ -1,12 +1,18 @@
 #ifndef INC_DIOD_DIRENT
 #define INC_DIOD_DIRENT
 
+#include <stdint.h>
 #include <dirent.h>
 
+/* A directory entry as returned by ioctx_getdents ().  The layout is that
+ * of Linux struct linux_dirent64, so getdents64 output is used as is.
+ */
 struct diod_dirent
 {
-  struct dirent dir_entry;
-  /* for when ! _DIRENT_HAVE_D_OFF */
-  off_t d_off;
+  uint64_t       d_ino;
+  int64_t        d_off;     /* cookie of the next entry */
+  unsigned short d_reclen;  /* length of this record */
+  unsigned char  d_type;
+  char           d_name[];
 };
 #endif
@@ -200,16 +200,18 @@ done:
     return res;
 }
 
-/* Retrieve export flags for the given aname.
- * Don't set np_uerror() here, just return 1 on match, 0 otherwise.
+/* Copy the export matching aname to *xp (only its integer members are
+ * valid afterwards).  Mounts exported with -E use the global export options.
+ * Returns 1 on success, 0 if not found.
  */
-int diod_fetch_xflags (Npstr *aname, int *xfp)
+static int
+_fetch_export (Npstr *aname, Export *xp)
 {
     List exports = diod_conf_get_exports ();
+    List mounts = NULL;
     ListIterator itr = NULL;
-    Export *x;
+    Export *x = NULL;
     char *path = NULL;
-    int res = 0;
 
     if (!(path = np_strdup (aname)))
         goto done;
@@ -219,19 +221,87 @@ int diod_fetch_xflags (Npstr *aname, int *xfp)
     if (!(itr = list_iterator_create (exports)))
         goto done;
     while ((x = list_next (itr))) {
-        if (_match_export_path (x, path)) {
-            if (xfp)
-                *xfp = x->oflags;
-            res = 1;
+        if (_match_export_path (x, path))
             break;
+    }
+    list_iterator_destroy (itr);
+    itr = NULL;
+    if (!x && (mounts = diod_conf_get_mounts ())) {
+        if (!(itr = list_iterator_create (mounts)))
+            goto done;
+        while ((x = list_next (itr))) {
+            if (_match_export_path (x, path))
+                break;
         }
     }
+    if (x)
+        *xp = *x;
 done:
     if (itr)
         list_iterator_destroy (itr);
+    if (mounts)
+        list_destroy (mounts);
     if (path)
         free (path);
-    return res;
+    return x ? 1 : 0;
+}
+
+/* Retrieve export flags for the given aname.
+ * Don't set np_uerror() here, just return 1 on match, 0 otherwise.
+ */
+int diod_fetch_xflags (Npstr *aname, int *xfp)
+{
+    Export x;
+
+    if (!_fetch_export (aname, &x))
+        return 0;
+    if (xfp)
+        *xfp = x.oflags;
+    return 1;
+}
+
+/* Retrieve the attribute cache TTL (seconds) for the given aname.
+ */
+int diod_fetch_attrttl (Npstr *aname)
+{
+    Export x;
+
+    if (!_fetch_export (aname, &x))
+        return 0;
+    return x.attrttl;
+}
+
+/* Retrieve the largest directory snapshot (bytes) for the given aname.
+ */
+int diod_fetch_dircache (Npstr *aname)
+{
+    Export x;
+
+    if (!_fetch_export (aname, &x))
+        return 0;
+    return x.dircache * 1024 * 1024;
+}
+
+/* Retrieve the readahead window (bytes) for the given aname.
+ */
+int diod_fetch_readahead (Npstr *aname)
+{
+    Export x;
+
+    if (!_fetch_export (aname, &x))
+        return 0;
+    return x.readahead * 1024;
+}
+
+/* Retrieve the write coalescing buffer size (bytes) for the given aname.
+ */
+int diod_fetch_writebehind (Npstr *aname)
+{
+    Export x;
+
+    if (!_fetch_export (aname, &x))
+        return 0;
+    return x.writebehind * 1024;
 }
 
 /**
@@ -1,3 +1,7 @@
 int diod_fetch_xflags (Npstr *aname, int *xfp);
+int diod_fetch_attrttl (Npstr *aname);
+int diod_fetch_dircache (Npstr *aname);
+int diod_fetch_readahead (Npstr *aname);
+int diod_fetch_writebehind (Npstr *aname);
 int diod_match_exports (char *path, Npconn *conn, Npuser *user, int *xfp);
 char *diod_get_exports (char *name, void *a);
@@ -0,0 +1,649 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+
+/* fcache.c - cache contents of files read by many clients at once */
+
+/* When a job starts on a cluster, every node reads the same executables
+ * and shared libraries at about the same time.  Rather than pread them
+ * once per request, ranges of files open read-only are cached in fixed
+ * size chunks, each in its own anonymous mapping, up to 'maxmmap'
+ * megabytes.  A chunk is only filled the second time it is missed, so a
+ * lone streaming reader passes through leaving nothing but a "ghost"
+ * entry behind, and does not evict hot data.  While a chunk is being
+ * filled, other readers of it wait for it rather than reading the file.
+ * Chunks belong to a (dev, ino) and are dropped if its mtime or size
+ * changes.  Files changed in the last few seconds are not cached, since
+ * a change within the granularity of mtime could go unnoticed.
+ * Where the transport allows, Rread payload is vmspliced from the chunks
+ * so it is not copied again on its way to the socket.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "list.h"
+#include "xpthread.h"
+
+#include "diod_conf.h"
+#include "diod_log.h"
+
+#include "fcache.h"
+
+#define FC_CHUNK        (128*1024)
+#define FC_HASH_SIZE    4096
+#define FC_MAXIOV       64
+#define FC_MIN_GHOSTS   1024
+#define FC_RECENT_SECS  2
+
+typedef struct ffile_struct FFile;
+typedef struct fchunk_struct FChunk;
+
+typedef enum { FC_GHOST, FC_FILLING, FC_VALID } FState;
+
+struct ffile_struct {
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;  /* version of the cached chunks */
+    off_t           size;
+    int             busy;   /* readers using this struct */
+    FChunk          *chunks;
+    FFile           *next;  /* hash chain */
+};
+
+struct fchunk_struct {
+    FFile           *file;  /* NULL once removed from the cache */
+    off_t           idx;
+    FState          state;
+    int             refs;
+    u8              *data;
+    size_t          len;
+    FChunk          *next;  /* hash chain */
+    FChunk          *fnext; /* chunks of file */
+    FChunk          *fprev;
+    FChunk          *lnext; /* LRU or ghost list */
+    FChunk          *lprev;
+};
+
+typedef struct {
+    FChunk          *head;  /* least recently used */
+    FChunk          *tail;
+    int             count;
+} FList;
+
+static pthread_mutex_t  fc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   fc_cond = PTHREAD_COND_INITIALIZER;
+static FFile            **fc_files = NULL;
+static FChunk           **fc_chunks = NULL;
+static FList            fc_lru = { NULL, NULL, 0 };
+static FList            fc_ghosts = { NULL, NULL, 0 };
+static size_t           fc_budget = 0;
+static size_t           fc_bytes = 0;   /* includes chunks being filled */
+static int              fc_maxghosts = 0;
+static u64              fc_hit = 0;
+static u64              fc_miss = 0;
+static u64              fc_fill = 0;
+static u64              fc_wait = 0;
+static u64              fc_evict = 0;
+
+static unsigned int
+_file_hash (dev_t dev, ino_t ino)
+{
+    return (unsigned int)((dev * 31 + ino) % FC_HASH_SIZE);
+}
+
+static unsigned int
+_chunk_hash (FFile *file, off_t idx)
+{
+    return (unsigned int)((((uintptr_t)file >> 4) + idx) % FC_HASH_SIZE);
+}
+
+static void
+_list_append (FList *l, FChunk *c)
+{
+    c->lnext = NULL;
+    c->lprev = l->tail;
+    if (l->tail)
+        l->tail->lnext = c;
+    else
+        l->head = c;
+    l->tail = c;
+    l->count++;
+}
+
+static void
+_list_remove (FList *l, FChunk *c)
+{
+    if (c->lprev)
+        c->lprev->lnext = c->lnext;
+    else
+        l->head = c->lnext;
+    if (c->lnext)
+        c->lnext->lprev = c->lprev;
+    else
+        l->tail = c->lprev;
+    c->lnext = c->lprev = NULL;
+    l->count--;
+}
+
+static void
+_chunk_free (FChunk *c)
+{
+    if (c->data)
+        (void)munmap (c->data, c->len);
+    free (c);
+}
+
+static void
+_chunk_put (FChunk *c)
+{
+    if (--c->refs == 0 && !c->file)
+        _chunk_free (c);
+}
+
+/* Take a chunk out of the cache.  It is freed now, or by the last
+ * reader still holding a reference.
+ */
+static void
+_chunk_remove (FChunk *c)
+{
+    FFile *file = c->file;
+    FChunk **cp;
+
+    for (cp = &fc_chunks[_chunk_hash (file, c->idx)]; *cp; cp = &(*cp)->next) {
+        if (*cp == c) {
+            *cp = c->next;
+            break;
+        }
+    }
+    if (c->fprev)
+        c->fprev->fnext = c->fnext;
+    else
+        file->chunks = c->fnext;
+    if (c->fnext)
+        c->fnext->fprev = c->fprev;
+    switch (c->state) {
+        case FC_GHOST:
+            _list_remove (&fc_ghosts, c);
+            break;
+        case FC_VALID:
+            _list_remove (&fc_lru, c);
+            /* fall through */
+        case FC_FILLING:
+            fc_bytes -= c->len;
+            break;
+    }
+    c->file = NULL;
+    if (c->refs == 0)
+        _chunk_free (c);
+}
+
+static void
+_file_purge (FFile *file)
+{
+    while (file->chunks)
+        _chunk_remove (file->chunks);
+}
+
+static void
+_file_maybe_free (FFile *file)
+{
+    FFile **fp;
+
+    if (file->chunks || file->busy > 0)
+        return;
+    for (fp = &fc_files[_file_hash (file->dev, file->ino)]; *fp;
+                                                        fp = &(*fp)->next) {
+        if (*fp == file) {
+            *fp = file->next;
+            break;
+        }
+    }
+    free (file);
+}
+
+static FFile *
+_file_find (dev_t dev, ino_t ino)
+{
+    FFile *file;
+
+    for (file = fc_files[_file_hash (dev, ino)]; file; file = file->next) {
+        if (file->dev == dev && file->ino == ino)
+            break;
+    }
+    return file;
+}
+
+/* Find or create the file for 'sb', dropping chunks of any other version.
+ */
+static FFile *
+_file_get (struct stat *sb)
+{
+    FFile *file;
+    unsigned int h;
+
+    if ((file = _file_find (sb->st_dev, sb->st_ino))) {
+        if (file->size != sb->st_size
+                || file->mtime.tv_sec != sb->st_mtim.tv_sec
+                || file->mtime.tv_nsec != sb->st_mtim.tv_nsec) {
+            _file_purge (file);
+            file->mtime = sb->st_mtim;
+            file->size = sb->st_size;
+        }
+        return file;
+    }
+    if (!(file = malloc (sizeof (*file))))
+        return NULL;
+    file->dev = sb->st_dev;
+    file->ino = sb->st_ino;
+    file->mtime = sb->st_mtim;
+    file->size = sb->st_size;
+    file->busy = 0;
+    file->chunks = NULL;
+    h = _file_hash (file->dev, file->ino);
+    file->next = fc_files[h];
+    fc_files[h] = file;
+    return file;
+}
+
+static FChunk *
+_chunk_find (FFile *file, off_t idx)
+{
+    FChunk *c;
+
+    for (c = fc_chunks[_chunk_hash (file, idx)]; c; c = c->next) {
+        if (c->file == file && c->idx == idx)
+            break;
+    }
+    return c;
+}
+
+static void
+_ghost_create (FFile *file, off_t idx)
+{
+    FChunk *c;
+    unsigned int h;
+
+    if (!(c = malloc (sizeof (*c))))
+        return;
+    c->file = file;
+    c->idx = idx;
+    c->state = FC_GHOST;
+    c->refs = 0;
+    c->data = NULL;
+    c->len = 0;
+    h = _chunk_hash (file, idx);
+    c->next = fc_chunks[h];
+    fc_chunks[h] = c;
+    c->fprev = NULL;
+    c->fnext = file->chunks;
+    if (file->chunks)
+        file->chunks->fprev = c;
+    file->chunks = c;
+    _list_append (&fc_ghosts, c);
+    while (fc_ghosts.count > fc_maxghosts) {
+        FFile *gfile = fc_ghosts.head->file;
+
+        _chunk_remove (fc_ghosts.head);
+        _file_maybe_free (gfile);
+    }
+}
+
+/* Make room for 'len' more bytes by evicting idle chunks, least recently
+ * used first.
+ */
+static int
+_evict (size_t len)
+{
+    FChunk *c = fc_lru.head;
+
+    while (fc_bytes + len > fc_budget) {
+        FFile *file;
+        FChunk *next;
+
+        while (c && c->refs > 0)
+            c = c->lnext;
+        if (!c)
+            return -1;
+        next = c->lnext;
+        file = c->file;
+        _chunk_remove (c);
+        _file_maybe_free (file);
+        fc_evict++;
+        c = next;
+    }
+    return 0;
+}
+
+/* Read a chunk's data from 'fd'.  Called without fc_lock held.
+ * A short read means the file changed under us, so it is a failure too.
+ */
+static int
+_chunk_fill (FChunk *c, int fd, off_t idx)
+{
+    size_t done = 0;
+    ssize_t n;
+    u8 *p;
+
+    p = mmap (NULL, c->len, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    while (done < c->len) {
+        n = pread (fd, p + done, c->len - done, idx * FC_CHUNK + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done < c->len) {
+        (void)munmap (p, c->len);
+        return -1;
+    }
+    (void)mprotect (p, c->len, PROT_READ);
+    c->data = p;
+    return 0;
+}
+
+/* Return chunk 'idx' of 'file' with a reference held, filling it from
+ * 'fd' if it has been missed before, or NULL if the caller must read the
+ * file itself.  fc_lock is dropped while filling.
+ */
+static FChunk *
+_chunk_get (FFile *file, off_t idx, int fd)
+{
+    FChunk *c;
+    int rc;
+
+    if (!(c = _chunk_find (file, idx))) {
+        _ghost_create (file, idx);
+        fc_miss++;
+        return NULL;
+    }
+    switch (c->state) {
+        case FC_VALID:
+            _list_remove (&fc_lru, c);
+            _list_append (&fc_lru, c);
+            c->refs++;
+            fc_hit++;
+            return c;
+        case FC_FILLING:
+            c->refs++;
+            fc_wait++;
+            while (c->state == FC_FILLING)
+                xpthread_cond_wait (&fc_cond, &fc_lock);
+            if (c->state != FC_VALID) {
+                _chunk_put (c);
+                fc_miss++;
+                return NULL;
+            }
+            fc_hit++;
+            return c;
+        case FC_GHOST:
+            break;
+    }
+    fc_miss++;
+    c->len = file->size - idx * FC_CHUNK;
+    if (c->len > FC_CHUNK)
+        c->len = FC_CHUNK;
+    if (c->len > fc_budget || _evict (c->len) < 0) {
+        c->len = 0;
+        _list_remove (&fc_ghosts, c);
+        _list_append (&fc_ghosts, c);
+        return NULL;
+    }
+    _list_remove (&fc_ghosts, c);
+    c->state = FC_FILLING;
+    c->refs++;
+    fc_bytes += c->len;
+
+    xpthread_mutex_unlock (&fc_lock);
+    rc = _chunk_fill (c, fd, idx);
+    xpthread_mutex_lock (&fc_lock);
+
+    fc_fill++;
+    if (rc == 0) {
+        c->state = FC_VALID;
+        if (c->file)
+            _list_append (&fc_lru, c);
+    } else {
+        if (c->file)
+            _chunk_remove (c);
+        c->state = FC_GHOST;
+    }
+    xpthread_cond_broadcast (&fc_cond);
+    if (rc < 0) {
+        _chunk_put (c);
+        return NULL;
+    }
+    return c;
+}
+
+static int
+_recently_changed (struct stat *sb)
+{
+    time_t now = time (NULL);
+
+    return (now - sb->st_mtime < FC_RECENT_SECS
+         || now - sb->st_ctime < FC_RECENT_SECS);
+}
+
+int
+fcache_enabled (void)
+{
+    return (fc_budget > 0);
+}
+
+/* Build an Rread for up to 'count' bytes of 'fd' (described by 'sb') at
+ * 'offset' from cached chunks.  As with pread, fewer bytes than requested
+ * may be returned.  Fails with EOPNOTSUPP if the caller should read the
+ * file itself.
+ */
+Npfcall *
+fcache_rread (int fd, struct stat *sb, Npconn *conn, u32 count, off_t offset)
+{
+    FChunk *c[FC_MAXIOV];
+    struct iovec iov[FC_MAXIOV], viov[FC_MAXIOV];
+    Npfcall *rc = NULL;
+    FFile *file;
+    off_t end, first, idx;
+    int i, n, miss = 0;
+    u32 len = 0;
+
+    if (!fc_budget || !S_ISREG (sb->st_mode) || offset >= sb->st_size
+                   || count == 0 || _recently_changed (sb)) {
+        np_uerror (EOPNOTSUPP);
+        return NULL;
+    }
+    end = offset + count;
+    if (end > sb->st_size)
+        end = sb->st_size;
+    first = offset / FC_CHUNK;
+    n = (end - 1) / FC_CHUNK - first + 1;
+    if (n > FC_MAXIOV) {
+        n = FC_MAXIOV;
+        end = (first + n) * FC_CHUNK;
+    }
+
+    xpthread_mutex_lock (&fc_lock);
+    if (!(file = _file_get (sb))) {
+        xpthread_mutex_unlock (&fc_lock);
+        np_uerror (EOPNOTSUPP);
+        return NULL;
+    }
+    file->busy++;
+    for (i = 0; i < n; i++) {
+        if (!(c[i] = _chunk_get (file, first + i, fd)))
+            miss = 1;
+    }
+    file->busy--;
+    _file_maybe_free (file);
+    xpthread_mutex_unlock (&fc_lock);
+
+    if (miss) {
+        np_uerror (EOPNOTSUPP);
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        off_t cstart = 0, cend = c[i]->len;
+
+        idx = first + i;
+        if (i == 0)
+            cstart = offset - idx * FC_CHUNK;
+        if (i == n - 1 && end - idx * FC_CHUNK < cend)
+            cend = end - idx * FC_CHUNK;
+        iov[i].iov_base = c[i]->data + cstart;
+        iov[i].iov_len = cend - cstart;
+        len += iov[i].iov_len;
+    }
+    memcpy (viov, iov, sizeof (iov[0]) * n); /* vmsplice advances viov */
+    if ((rc = np_vmsplice_rread (conn, viov, n)))
+        goto done;
+    np_uerror (0);
+    if (!(rc = np_alloc_rread (len))) {
+        np_uerror (ENOMEM);
+        goto done;
+    }
+    len = 0;
+    for (i = 0; i < n; i++) {
+        memcpy (rc->u.rread.data + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    np_set_rread_count (rc, len);
+done:
+    xpthread_mutex_lock (&fc_lock);
+    for (i = 0; i < n; i++) {
+        if (c[i])
+            _chunk_put (c[i]);
+    }
+    xpthread_mutex_unlock (&fc_lock);
+    return rc;
+}
+
+/* Drop cached data of a file modified through diod, in case its mtime
+ * did not change.
+ */
+void
+fcache_inval_ino (dev_t dev, ino_t ino)
+{
+    FFile *file;
+
+    if (!fc_budget)
+        return;
+    xpthread_mutex_lock (&fc_lock);
+    if ((file = _file_find (dev, ino))) {
+        _file_purge (file);
+        _file_maybe_free (file);
+    }
+    xpthread_mutex_unlock (&fc_lock);
+}
+
+static char *
+_fcache_ctl (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    xpthread_mutex_lock (&fc_lock);
+    if (aspf (&s, &len, "hit %"PRIu64"\nmiss %"PRIu64"\nfill %"PRIu64"\n"
+              "wait %"PRIu64"\nevict %"PRIu64"\nbytes %zu\nbudget %zu\n"
+              "chunks %d\nghosts %d\n",
+              fc_hit, fc_miss, fc_fill, fc_wait, fc_evict,
+              fc_bytes, fc_budget, fc_lru.count, fc_ghosts.count) < 0)
+        np_uerror (ENOMEM);
+    xpthread_mutex_unlock (&fc_lock);
+    return s;
+}
+
+int
+fcache_init (Npsrv *srv)
+{
+    int mb = diod_conf_get_maxmmap ();
+
+    if (mb <= 0)
+        return 0;
+    fc_files = calloc (FC_HASH_SIZE, sizeof (fc_files[0]));
+    fc_chunks = calloc (FC_HASH_SIZE, sizeof (fc_chunks[0]));
+    if (!fc_files || !fc_chunks) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    fc_budget = (size_t)mb * 1024 * 1024;
+    fc_maxghosts = fc_budget / FC_CHUNK;
+    if (fc_maxghosts < FC_MIN_GHOSTS)
+        fc_maxghosts = FC_MIN_GHOSTS;
+    if (!np_ctl_addfile (srv->ctlroot, "filecache", _fcache_ctl, srv, 0))
+        goto error;
+    return 0;
+error:
+    fcache_fini (srv);
+    return -1;
+}
+
+/* Called after all requests have completed, so no chunk is referenced.
+ */
+void
+fcache_fini (Npsrv *srv)
+{
+    int i;
+
+    if (fc_files) {
+        for (i = 0; i < FC_HASH_SIZE; i++) {
+            while (fc_files[i]) {
+                FFile *file = fc_files[i];
+
+                _file_purge (file);
+                _file_maybe_free (file);
+            }
+        }
+        free (fc_files);
+        fc_files = NULL;
+    }
+    if (fc_chunks) {
+        free (fc_chunks);
+        fc_chunks = NULL;
+    }
+    fc_budget = 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
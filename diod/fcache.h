@@ -0,0 +1,11 @@
+int     fcache_init (Npsrv *srv);
+void    fcache_fini (Npsrv *srv);
+
+int     fcache_enabled (void);
+Npfcall *fcache_rread (int fd, struct stat *sb, Npconn *conn, u32 count,
+                       off_t offset);
+void    fcache_inval_ino (dev_t dev, ino_t ino);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -58,6 +58,7 @@
 
 #include "ioctx.h"
 #include "xattr.h"
+#include "dcache.h"
 #include "fid.h"
 
 /* Allocate local fid struct and attach to fid->aux.
@@ -70,6 +71,12 @@ diod_fidalloc (Npfid *fid, Npstr *ns)
     NP_ASSERT (fid->aux == NULL);
     if (f) {
         f->flags = 0;
+        f->attrttl = 0;
+        f->dircache = 0;
+        f->readahead = 0;
+        f->writebehind = 0;
+        f->dsnap = NULL;
+        f->dsnapcur = 0;
         f->ioctx = NULL;
         f->xattr = NULL;
         f->path = path_create (fid->conn->srv, ns);
@@ -94,6 +101,12 @@ diod_fidclone (Npfid *newfid, Npfid *fid)
     NP_ASSERT (newfid->aux == NULL);
     if (nf) {
         nf->flags = f->flags;
+        nf->attrttl = f->attrttl;
+        nf->dircache = f->dircache;
+        nf->readahead = f->readahead;
+        nf->writebehind = f->writebehind;
+        nf->dsnap = NULL;
+        nf->dsnapcur = 0;
         nf->ioctx = NULL;
         nf->xattr = NULL;
         nf->path = path_incref (f->path);
@@ -116,6 +129,8 @@ diod_fiddestroy (Npfid *fid)
             ioctx_close (fid, 0);
         if (f->xattr)
             xattr_close (fid);
+        if (f->dsnap)
+            dcache_put (f->dsnap);
         if (f->path)
             path_decref (fid->conn->srv, f->path);
         free(f);
@@ -2,12 +2,22 @@
 #define DIOD_FID_FLAGS_MOUNTPT    0x02
 #define DIOD_FID_FLAGS_SHAREFD    0x04
 #define DIOD_FID_FLAGS_XATTR      0x08
+#define DIOD_FID_FLAGS_DIRCACHE   0x10
+#define DIOD_FID_FLAGS_ATTRSYNC   0x20
+#define DIOD_FID_FLAGS_ATTRNOSYNC 0x40
+#define DIOD_FID_FLAGS_DROPBEHIND 0x80
 
 typedef struct {
     Path            path;
     IOCtx           ioctx;
     Xattr           xattr;
     int             flags;
+    int             attrttl;    /* export's attribute cache TTL, 0=off */
+    int             dircache;   /* export's largest directory snapshot */
+    int             readahead;  /* export's readahead window, 0=off */
+    int             writebehind;/* export's write coalescing size, 0=off */
+    struct dsnap_struct *dsnap; /* shared directory listing being read */
+    int             dsnapcur;   /* entry following last dsnap read */
 } Fid;
 
 Fid *diod_fidalloc (Npfid *fid, Npstr *ns);
@@ -38,6 +38,8 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <pwd.h>
 #include <grp.h>
 #include <dirent.h>
@@ -59,9 +61,27 @@
 #include "xattr.h"
 #include "fid.h"
 #include "ops.h"
+#include "fcache.h"
 
 typedef struct pathpool_struct *PathPool;
 
+/* State for detecting a sequential or constant stride read pattern.
+ */
+typedef struct {
+    off_t           off;    /* last read */
+    off_t           end;    /* furthest end of a read in the run */
+    off_t           stride; /* distance between the last two reads */
+    off_t           start;  /* where the run started */
+    off_t           ra;     /* prefetched up to here */
+    off_t           drop;   /* dropped from the page cache up to here */
+    int             run;    /* reads that fit the pattern */
+    int             seq;    /* FADV_SEQUENTIAL is in effect */
+} Stream;
+
+#define RA_MIN_RUN      2   /* reads fitting a pattern before prefetching */
+#define RA_MAX_STRIDES  8   /* strided blocks prefetched at once */
+#define RA_DROP_MIN     (64*1024*1024) /* sequential bytes before drop-behind */
+
 struct ioctx_struct {
     pthread_mutex_t lock;
     int             refcount;
@@ -69,11 +89,101 @@ struct ioctx_struct {
     DIR             *dir;
     int             lock_type;
     Npqid           qid;
-    u32             iounit;
+    dev_t           dev;
+    u32             dio_align;  /* O_DIRECT offset alignment, 0=buffered */
+    size_t          dio_memalign; /* O_DIRECT buffer alignment */
+    int             dio_fd; /* O_DSYNC twin of fd for unaligned writes,
+                               -1=not yet opened, -2=unavailable */
     u32             open_flags;
+    int             nosplice;
+    struct timespec ctime;  /* at open, to revalidate when parked */
+    int             ra_window; /* readahead bytes, 0=off */
+    int             dropbehind; /* drop long scans from the page cache */
+    Stream          stream; /* read pattern, protected by lock */
+    size_t          wb_max; /* write-behind buffer size, 0=off */
+    char            *wb_buf;/* write-behind buffer, protected by lock */
+    off_t           wb_off; /* file offset of wb_buf[0] */
+    size_t          wb_len; /* bytes buffered */
+    int             wb_err; /* deferred write error (errno) */
     Npuser          *user;
     IOCtx           next;
     IOCtx           prev;
+    Path            path;   /* set while parked (holds a reference) */
+    int             parked; /* on the LRU, protected by oc_lock */
+    int             nocache;/* don't park on last close */
+    IOCtx           lnext;  /* LRU of parked IOCtx */
+    IOCtx           lprev;
+};
+
+/* Direct I/O.  An O_DIRECT file needs buffers, offsets and lengths
+ * aligned to what the backing file system asks for (STATX_DIOALIGN,
+ * else the page size), but Tread/Twrite payloads sit at arbitrary
+ * addresses in the fcall.  So I/O goes through buffers from a pool of
+ * page-aligned ones big enough for an msize request.  Reads at unaligned
+ * offsets or lengths are widened to the enclosing aligned range.  Writes
+ * that are not aligned cannot be widened without racing other writers of
+ * the same blocks, so they go to a second descriptor opened without
+ * O_DIRECT but with O_DSYNC, which still leaves no dirty data behind.
+ * That descriptor is opened on the first unaligned write by reopening
+ * fd through /proc, and must turn out to be the same inode; if it
+ * cannot be had, unaligned writes fail with EINVAL as O_DIRECT would.
+ * Rlopen advertises an iounit that is a multiple of the alignment so
+ * clients splitting large I/O stay aligned.
+ */
+#define DIO_POOL_MAX    16  /* free buffers kept */
+
+static pthread_mutex_t  dio_lock = PTHREAD_MUTEX_INITIALIZER;
+static void             *dio_free[DIO_POOL_MAX];
+static int              dio_nfree = 0;
+static size_t           dio_bufsize = 0;
+static size_t           dio_pagesize = 4096;
+
+/* Open file cache.  When the last fid using an IOCtx opened read-only is
+ * clunked, the IOCtx is parked on its path instead of being closed, and
+ * a later open of the same path with the same flags by the same user
+ * takes it back, saving an open(2) that on network file systems costs a
+ * round trip.  Before reuse the name is looked up again and the IOCtx is
+ * discarded unless it still names the same inode with unchanged ctime,
+ * so permission changes, renames and replacement by any means are caught.
+ * Unlink, rename and setattr through diod drop parked files at once.
+ * The number parked is bounded by 'opencache' and by RLIMIT_NOFILE, with
+ * the least recently parked closed first.
+ */
+static pthread_mutex_t  oc_lock = PTHREAD_MUTEX_INITIALIZER;
+static IOCtx            oc_head = NULL;     /* least recently parked */
+static IOCtx            oc_tail = NULL;
+static int              oc_count = 0;
+static int              oc_max = 0;
+static u64              oc_hit = 0;
+static u64              oc_miss = 0;
+
+static pthread_mutex_t  wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              wb_count = 0;       /* IOCtx doing write-behind */
+static u64              oc_stale = 0;
+static u64              oc_evict = 0;
+
+/* A walked directory keeps an fd open so operations on its children can
+ * be done with *at() calls relative to it rather than looking up the full
+ * path from '/' each time.  The path string is kept for the hash key and
+ * for logging, or as a fallback if the fd cannot be opened.
+ */
+#if defined(O_PATH)
+#define PATH_DIRFD_FLAGS    (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#elif defined(O_SEARCH)
+#define PATH_DIRFD_FLAGS    (O_SEARCH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define PATH_DIRFD_FLAGS    (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+/* When a path is renamed, its old string and parent may still be in use
+ * by another thread, so they are kept until the path is freed.
+ */
+typedef struct path_old_struct *PathOld;
+
+struct path_old_struct {
+    char            *s;
+    Path            parent;
+    PathOld         next;
 };
 
 struct path_struct {
@@ -81,7 +191,18 @@ struct path_struct {
     int             refcount;
     char            *s;
     int             len;
+    char            *name;  /* last component of s */
+    Path            parent; /* NULL for an attach point */
+    int             fd;     /* dir fd opened on demand, or -1 */
+    dev_t           dev;    /* identity of fd for revalidation */
+    ino_t           ino;
+    int             *stale; /* replaced fds, may still be in use */
+    int             nstale;
+    PathOld         old;    /* replaced names and parents */
+    Path            next;   /* temporary list used by path_rename */
     IOCtx           ioctx;  /* double-linked list of IOCtx opening this path */
+    IOCtx           parked; /* double-linked list of IOCtx parked on it */
+    int             nwb;    /* IOCtx on ioctx list doing write-behind */
 };
 
 struct pathpool_struct {
@@ -111,6 +232,8 @@ _link_ioctx (IOCtx *head, IOCtx i)
     *head = i;
 }
 
+static int _path_at (Path path, char **namep);
+
 static void
 _count_ioctx (IOCtx i, int *shared, int *unique)
 {
@@ -160,17 +283,158 @@ _ioctx_close_destroy (IOCtx ioctx, int seterrno)
     }
     if (ioctx->user)
         np_user_decref (ioctx->user);
+    if (ioctx->wb_buf)
+        free (ioctx->wb_buf);
+    if (ioctx->dio_fd >= 0)
+        (void)close (ioctx->dio_fd);
     pthread_mutex_destroy (&ioctx->lock);
     free (ioctx);
 
     return rc;
 }
 
+/* Set the alignment O_DIRECT I/O on ioctx->fd needs.
+ */
+static void
+_dio_align (IOCtx ioctx)
+{
+#if HAVE_STATX && defined(STATX_DIOALIGN)
+    struct statx stx;
+
+    if (statx (ioctx->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+                && (stx.stx_mask & STATX_DIOALIGN)
+                && stx.stx_dio_offset_align > 0) {
+        ioctx->dio_align = stx.stx_dio_offset_align;
+        ioctx->dio_memalign = stx.stx_dio_mem_align;
+        if (ioctx->dio_memalign < sizeof (void *))
+            ioctx->dio_memalign = sizeof (void *);
+        return;
+    }
+#endif
+    ioctx->dio_align = dio_pagesize;
+    ioctx->dio_memalign = dio_pagesize;
+}
+
+/* Get a buffer of at least len bytes aligned for direct I/O.  Buffers
+ * that fit the pool's size and alignment come from it.
+ */
+static void *
+_dio_get (size_t len, size_t align)
+{
+    void *buf = NULL;
+
+    if (len <= dio_bufsize && align <= dio_pagesize) {
+        xpthread_mutex_lock (&dio_lock);
+        if (dio_nfree > 0)
+            buf = dio_free[--dio_nfree];
+        xpthread_mutex_unlock (&dio_lock);
+        if (buf)
+            return buf;
+        len = dio_bufsize;
+        align = dio_pagesize;
+    }
+    if ((errno = posix_memalign (&buf, align, len)) != 0)
+        return NULL;
+    return buf;
+}
+
+static void
+_dio_put (void *buf, size_t len, size_t align)
+{
+    if (len <= dio_bufsize && align <= dio_pagesize) {
+        xpthread_mutex_lock (&dio_lock);
+        if (dio_nfree < DIO_POOL_MAX) {
+            dio_free[dio_nfree++] = buf;
+            buf = NULL;
+        }
+        xpthread_mutex_unlock (&dio_lock);
+    }
+    if (buf)
+        free (buf);
+}
+
+static int
+_dio_pread (IOCtx ioctx, void *buf, size_t count, off_t offset)
+{
+    off_t start = offset - offset % ioctx->dio_align;
+    off_t end = offset + count;
+    size_t len;
+    ssize_t n;
+    void *b;
+
+    if (end % ioctx->dio_align)
+        end += ioctx->dio_align - end % ioctx->dio_align;
+    len = end - start;
+    if (!(b = _dio_get (len, ioctx->dio_memalign)))
+        return -1;
+    n = pread (ioctx->fd, b, len, start);
+    if (n >= 0) {
+        n -= offset - start;
+        if (n < 0)
+            n = 0;
+        if ((size_t)n > count)
+            n = count;
+        memcpy (buf, (char *)b + (offset - start), n);
+    }
+    _dio_put (b, len, ioctx->dio_memalign);
+    return n;
+}
+
+/* Return the O_DSYNC twin of ioctx->fd, opening it if need be.
+ */
+static int
+_dio_twin (IOCtx ioctx)
+{
+    char p[32];
+    struct stat sb, tsb;
+    int fd;
+
+    xpthread_mutex_lock (&ioctx->lock);
+    if (ioctx->dio_fd == -1) {
+        snprintf (p, sizeof (p), "/proc/self/fd/%d", ioctx->fd);
+        fd = open (p, (ioctx->open_flags | O_DSYNC)
+                      & ~(O_DIRECT | O_CREAT | O_EXCL | O_TRUNC));
+        if (fd >= 0 && (fstat (ioctx->fd, &sb) < 0 || fstat (fd, &tsb) < 0
+                        || sb.st_dev != tsb.st_dev || sb.st_ino != tsb.st_ino)) {
+            (void)close (fd);
+            fd = -1;
+        }
+        ioctx->dio_fd = fd >= 0 ? fd : -2;
+    }
+    fd = ioctx->dio_fd;
+    xpthread_mutex_unlock (&ioctx->lock);
+    return fd;
+}
+
+static int
+_dio_pwrite (IOCtx ioctx, const void *buf, size_t count, off_t offset)
+{
+    ssize_t n;
+    void *b;
+    int fd;
+
+    if (offset % ioctx->dio_align || count % ioctx->dio_align) {
+        if ((fd = _dio_twin (ioctx)) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        return pwrite (fd, buf, count, offset);
+    }
+    if (!(b = _dio_get (count, ioctx->dio_memalign)))
+        return -1;
+    memcpy (b, buf, count);
+    n = pwrite (ioctx->fd, b, count, offset);
+    _dio_put (b, count, ioctx->dio_memalign);
+    return n;
+}
+
 static IOCtx
 _ioctx_create_open (Npuser *user, Path path, int flags, u32 mode)
 {
     IOCtx ioctx;
     struct stat sb;
+    char *name;
+    int dirfd;
 
     ioctx = malloc (sizeof (*ioctx));
     if (!ioctx) {
@@ -185,7 +449,23 @@ _ioctx_create_open (Npuser *user, Path path, int flags, u32 mode)
     ioctx->user = user;
     np_user_incref (user);
     ioctx->prev = ioctx->next = NULL;
-    ioctx->fd = open (path->s, flags, mode);
+    ioctx->path = NULL;
+    ioctx->parked = 0;
+    ioctx->nocache = 0;
+    ioctx->ra_window = 0;
+    ioctx->dropbehind = 0;
+    memset (&ioctx->stream, 0, sizeof (ioctx->stream));
+    ioctx->wb_max = 0;
+    ioctx->wb_buf = NULL;
+    ioctx->wb_off = 0;
+    ioctx->wb_len = 0;
+    ioctx->wb_err = 0;
+    ioctx->lprev = ioctx->lnext = NULL;
+    ioctx->dio_align = 0;
+    ioctx->dio_memalign = 0;
+    ioctx->dio_fd = -1;
+    dirfd = _path_at (path, &name); /* path->lock is held */
+    ioctx->fd = openat (dirfd, name, flags, mode);
     if (ioctx->fd < 0) {
         np_uerror (errno);
         goto error;
@@ -194,12 +474,22 @@ _ioctx_create_open (Npuser *user, Path path, int flags, u32 mode)
         np_uerror (errno);
         goto error;
     }
-    ioctx->iounit = 0; /* if iounit=0, v9fs will use msize-P9_IOHDRSZ */
+    ioctx->nosplice = !S_ISREG(sb.st_mode);
+#ifdef O_DIRECT
+    if ((flags & O_DIRECT) && S_ISREG(sb.st_mode)) {
+        _dio_align (ioctx);
+        ioctx->nosplice = 1;
+    }
+#endif
+#if !defined(SYS_getdents64)
     if (S_ISDIR(sb.st_mode) && !(ioctx->dir = fdopendir (ioctx->fd))) {
         np_uerror (errno);
         goto error;
     }
+#endif
     diod_ustat2qid (&sb, &ioctx->qid);
+    ioctx->dev = sb.st_dev;
+    ioctx->ctime = sb.st_ctim;
     return ioctx;
 error:
     if (ioctx)
@@ -207,23 +497,366 @@ error:
     return NULL;
 }
 
+/* Write-behind.  With the writebehind export option, small writes to a
+ * file opened for writing, each continuing where the last left off, are
+ * gathered in a per-IOCtx buffer and reach the file as one pwrite(2)
+ * when the buffer fills at a file offset that is a multiple of its size,
+ * so the backing file system sees a few large aligned writes instead of
+ * many small ones.  Opens with O_SYNC, O_DSYNC, O_DIRECT or O_APPEND
+ * write through.  Anything that must see the data first flushes the
+ * buffer: a write elsewhere in the file, fsync, lock, clunk, and read,
+ * getattr or setattr through any fid of the same path.
+ * An error writing out data that was already acknowledged is returned
+ * by the next write, fsync, lock or clunk of the IOCtx.
+ */
+static int
+_flags_writebehind (u32 flags)
+{
+    u32 wt = O_SYNC | O_DSYNC | O_APPEND;
+#ifdef O_DIRECT
+    wt |= O_DIRECT;
+#endif
+    return ((flags & O_ACCMODE) != O_RDONLY && !(flags & wt));
+}
+
+/* Write out the buffer.  On failure the data is dropped and -1 is
+ * returned with errno set.  The ioctx->lock is held.
+ */
+static int
+_wb_flush (IOCtx ioctx)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < ioctx->wb_len) {
+        n = pwrite (ioctx->fd, ioctx->wb_buf + done, ioctx->wb_len - done,
+                    ioctx->wb_off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ENOSPC;
+            ioctx->wb_len = 0;
+            return -1;
+        }
+        done += n;
+    }
+    ioctx->wb_len = 0;
+    return 0;
+}
+
+/* Report any deferred error, then flush.  The ioctx->lock is held.
+ */
+static int
+_wb_barrier (IOCtx ioctx)
+{
+    if (ioctx->wb_err) {
+        errno = ioctx->wb_err;
+        ioctx->wb_err = 0;
+        return -1;
+    }
+    return _wb_flush (ioctx);
+}
+
+/* Flush buffered writes of this IOCtx, returning -1 with errno set
+ * if they, or earlier ones flushed by another fid, could not be written.
+ */
+int
+ioctx_flush (IOCtx ioctx)
+{
+    int rc;
+
+    if (ioctx->wb_max == 0)
+        return 0;
+    xpthread_mutex_lock (&ioctx->lock);
+    rc = _wb_barrier (ioctx);
+    xpthread_mutex_unlock (&ioctx->lock);
+
+    return rc;
+}
+
+/* Flush buffered writes of all IOCtx open on path.  Errors are kept
+ * for the writer.  The unlocked test of path->nwb is just to skip taking
+ * the lock in the common case: it only changes on open and clunk, which
+ * are ordered before any write they would matter to.
+ */
+void
+ioctx_flush_path (Path path)
+{
+    IOCtx i;
+
+    if (path->nwb == 0)
+        return;
+    xpthread_mutex_lock (&path->lock);
+    for (i = path->ioctx; i != NULL; i = i->next) {
+        if (i->wb_max == 0)
+            continue;
+        xpthread_mutex_lock (&i->lock);
+        if (_wb_flush (i) < 0 && !i->wb_err)
+            i->wb_err = errno;
+        xpthread_mutex_unlock (&i->lock);
+    }
+    xpthread_mutex_unlock (&path->lock);
+}
+
+/* Flush buffered writes to 'name' in directory 'dir', if it is open,
+ * before its attributes are read by name.  The unlocked test of
+ * wb_count skips the lookup while no file is doing write-behind.
+ */
+void
+ioctx_flush_child (Npsrv *srv, Path dir, const char *name)
+{
+    PathPool pp = srv->srvaux;
+    Path path = NULL;
+    int len, nlen = strlen (name);
+    char *s;
+
+    if (wb_count == 0)
+        return;
+    xpthread_mutex_lock (&dir->lock);
+    len = dir->len;
+    if ((s = malloc (len + 1 + nlen + 1)))
+        memcpy (s, dir->s, len);
+    xpthread_mutex_unlock (&dir->lock);
+    if (!s)
+        return;
+    s[len] = '/';
+    memcpy (s + len + 1, name, nlen + 1);
+    xpthread_mutex_lock (&pp->lock);
+    if ((path = hash_find (pp->hash, s)))
+        path_incref (path);
+    xpthread_mutex_unlock (&pp->lock);
+    free (s);
+    if (path) {
+        ioctx_flush_path (path);
+        path_decref (srv, path);
+    }
+}
+
+/* Only plain read-only opens are cached, so there is no state to carry
+ * over and no error from close(2) to lose.  Without getdents64, a
+ * directory has a DIR stream whose position would carry over.
+ */
+static int
+_flags_cacheable (u32 flags)
+{
+    return (oc_max > 0 && (flags & O_ACCMODE) == O_RDONLY
+                       && !(flags & (O_CREAT | O_EXCL | O_TRUNC)));
+}
+
+static int
+_ioctx_parkable (IOCtx ioctx)
+{
+    return (_flags_cacheable (ioctx->open_flags) && ioctx->dir == NULL
+                    && ioctx->lock_type == LOCK_UN && !ioctx->nocache);
+}
+
+/* LRU operations - caller holds oc_lock.
+ */
+static void
+_lru_append (IOCtx i)
+{
+    i->lnext = NULL;
+    i->lprev = oc_tail;
+    if (oc_tail)
+        oc_tail->lnext = i;
+    else
+        oc_head = i;
+    oc_tail = i;
+    i->parked = 1;
+    oc_count++;
+}
+
+static void
+_lru_remove (IOCtx i)
+{
+    if (i->lprev)
+        i->lprev->lnext = i->lnext;
+    else
+        oc_head = i->lnext;
+    if (i->lnext)
+        i->lnext->lprev = i->lprev;
+    else
+        oc_tail = i->lprev;
+    i->lnext = i->lprev = NULL;
+    i->parked = 0;
+    oc_count--;
+}
+
+/* Take 'i' off the LRU unless another thread got to it first.
+ * Caller holds the lock of the path it is parked on.
+ */
+static int
+_claim (IOCtx i)
+{
+    int claimed = 0;
+
+    xpthread_mutex_lock (&oc_lock);
+    if (i->parked) {
+        _lru_remove (i);
+        claimed = 1;
+    }
+    xpthread_mutex_unlock (&oc_lock);
+    return claimed;
+}
+
+/* Take up to 'n' of the least recently parked off the LRU (all if n < 0)
+ * and return them as a list linked through lnext.
+ */
+static IOCtx
+_lru_pop (int n)
+{
+    IOCtx i, list = NULL;
+
+    xpthread_mutex_lock (&oc_lock);
+    while ((i = oc_head) && n-- != 0) {
+        _lru_remove (i);
+        i->lnext = list;
+        list = i;
+        oc_evict++;
+    }
+    xpthread_mutex_unlock (&oc_lock);
+    return list;
+}
+
+/* Close a list of claimed IOCtx still linked to the paths they are parked
+ * on.  Caller holds no path lock.
+ */
+static void
+_discard (Npsrv *srv, IOCtx list)
+{
+    IOCtx i;
+    Path path;
+
+    while ((i = list)) {
+        list = i->lnext;
+        path = i->path;
+        xpthread_mutex_lock (&path->lock);
+        _unlink_ioctx (&path->parked, i);
+        xpthread_mutex_unlock (&path->lock);
+        (void)_ioctx_close_destroy (i, 0);
+        path_decref (srv, path);
+    }
+}
+
+/* Find an IOCtx parked on 'path' for 'flags' and 'user' that is still
+ * valid, and take it back.  Stale ones found on the way are closed.
+ * Caller holds path->lock and a reference on path other than the ones
+ * held by parked IOCtx, so dropping those cannot free it.
+ */
+static IOCtx
+_unpark (Path path, Npuser *user, u32 flags)
+{
+    IOCtx i, next;
+    struct stat sb;
+    char *name;
+    int dirfd, valid;
+
+    for (i = path->parked; i != NULL; i = next) {
+        next = i->next;
+        if (i->open_flags != flags || i->user->uid != user->uid)
+            continue;
+        if (!_claim (i))
+            continue;
+        _unlink_ioctx (&path->parked, i);
+        i->path = NULL;
+        path->refcount--;
+        dirfd = _path_at (path, &name);
+        valid = (fstatat (dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+                    && sb.st_dev == i->dev && sb.st_ino == i->qid.path
+                    && sb.st_ctim.tv_sec == i->ctime.tv_sec
+                    && sb.st_ctim.tv_nsec == i->ctime.tv_nsec);
+        xpthread_mutex_lock (&oc_lock);
+        if (valid)
+            oc_hit++;
+        else
+            oc_stale++;
+        xpthread_mutex_unlock (&oc_lock);
+        if (valid) {
+            i->refcount = 1;
+            diod_ustat2qid (&sb, &i->qid);
+            memset (&i->stream, 0, sizeof (i->stream));
+            return i;
+        }
+        (void)_ioctx_close_destroy (i, 0);
+    }
+    xpthread_mutex_lock (&oc_lock);
+    oc_miss++;
+    xpthread_mutex_unlock (&oc_lock);
+    return NULL;
+}
+
+/* Drop IOCtx parked on 'path' after it was changed through diod.
+ * If it was unlinked, also keep those still open on it from being parked,
+ * lest the space of a removed file be held.
+ */
+void
+ioctx_cache_inval (Npsrv *srv, Path path, int unlinked)
+{
+    IOCtx i, list = NULL;
+
+    if (oc_max == 0)
+        return;
+    xpthread_mutex_lock (&path->lock);
+    if (unlinked) {
+        for (i = path->ioctx; i != NULL; i = i->next)
+            i->nocache = 1;
+    }
+    for (i = path->parked; i != NULL; i = i->next) {
+        if (_claim (i)) {
+            i->lnext = list;
+            list = i;
+        }
+    }
+    xpthread_mutex_unlock (&path->lock);
+    _discard (srv, list);
+}
+
 int
 ioctx_close (Npfid *fid, int seterrno)
 {
     Fid *f = fid->aux;
-    int n;
+    IOCtx evict = NULL;
+    int n, over, parked = 0;
     int rc = 0;
 
     NP_ASSERT (f->ioctx != NULL);
 
+    if (ioctx_flush (f->ioctx) < 0) {
+        if (seterrno)
+            np_uerror (errno);
+        rc = -1;
+    }
     xpthread_mutex_lock (&f->path->lock);
     n = _ioctx_decref (f->ioctx);
-    if (n == 0)
+    if (n == 0) {
         _unlink_ioctx (&f->path->ioctx, f->ioctx);
+        if (f->ioctx->wb_max > 0) {
+            f->path->nwb--;
+            xpthread_mutex_lock (&wb_lock);
+            wb_count--;
+            xpthread_mutex_unlock (&wb_lock);
+        }
+        if (_ioctx_parkable (f->ioctx)) {
+            f->path->refcount++; /* path_incref () with path->lock held */
+            f->ioctx->path = f->path;
+            _link_ioctx (&f->path->parked, f->ioctx);
+            xpthread_mutex_lock (&oc_lock);
+            _lru_append (f->ioctx);
+            over = oc_count - oc_max;
+            xpthread_mutex_unlock (&oc_lock);
+            if (over > 0)
+                evict = _lru_pop (over);
+            parked = 1;
+        }
+    }
     xpthread_mutex_unlock (&f->path->lock);
-    if (n == 0)
-        rc = _ioctx_close_destroy (f->ioctx, seterrno);
+    if (n == 0 && !parked) {
+        if (_ioctx_close_destroy (f->ioctx, rc == 0 && seterrno) < 0)
+            rc = -1;
+    }
     f->ioctx = NULL;
+    _discard (fid->conn->srv, evict);
 
     return rc;
 }
@@ -233,9 +866,12 @@ ioctx_open (Npfid *fid, u32 flags, u32 mode)
 {
     Fid *f = fid->aux;
     IOCtx ip = NULL;
+    struct stat sb;
+    int retry = 1;
 
     NP_ASSERT (f->ioctx == NULL);
 
+again:
     xpthread_mutex_lock (&f->path->lock);
     if ((f->flags & DIOD_FID_FLAGS_SHAREFD) && (flags & 3) == O_RDONLY) {
         for (ip = f->path->ioctx; ip != NULL; ip = ip->next) {
@@ -245,34 +881,392 @@ ioctx_open (Npfid *fid, u32 flags, u32 mode)
                 continue;
             if (ip->user->uid != fid->user->uid)
                 continue;
-            /* NOTE: we could do a stat and check qid? */
+            /* refresh qid.version, the file may have changed since */
+            if (fstat (ip->fd, &sb) < 0)
+                continue;
+            diod_ustat2qid (&sb, &ip->qid);
             _ioctx_incref (ip);
             break;
         }
     }
+    if (!ip && _flags_cacheable (flags)) {
+        if ((ip = _unpark (f->path, fid->user, flags)))
+            _link_ioctx (&f->path->ioctx, ip);
+    }
     if (!ip) {
-        if ((ip = _ioctx_create_open (fid->user, f->path, flags, mode)))
+        if ((ip = _ioctx_create_open (fid->user, f->path, flags, mode))) {
+            ip->ra_window = f->readahead;
+            if ((f->flags & DIOD_FID_FLAGS_DROPBEHIND))
+                ip->dropbehind = 1;
+            if (f->writebehind > 0 && _flags_writebehind (flags)
+                                   && ip->qid.type == P9_QTFILE) {
+                ip->wb_max = f->writebehind;
+                f->path->nwb++;
+                xpthread_mutex_lock (&wb_lock);
+                wb_count++;
+                xpthread_mutex_unlock (&wb_lock);
+            }
             _link_ioctx (&f->path->ioctx, ip);
+        }
     }
     xpthread_mutex_unlock (&f->path->lock);
-    if (!ip)
+    if (!ip) {
+        /* parked files may be what is using up our descriptors */
+        if ((np_rerror () == EMFILE || np_rerror () == ENFILE)
+                                    && oc_count > 0 && retry--) {
+            _discard (fid->conn->srv, _lru_pop (-1));
+            np_uerror (0);
+            goto again;
+        }
         goto error;
+    }
     f->ioctx = ip;
     return 0;
 error:
     return -1;
 }
 
+/* Called before a read of the file so reads following a sequential or
+ * constant stride pattern can be anticipated.  v9fs sends large reads as
+ * a series of msize requests, so after a few that fit a pattern, data
+ * up to ra_window bytes ahead is requested from the backing file system
+ * (asynchronously, via POSIX_FADV_WILLNEED) before the client asks.
+ * Sequential streams also get POSIX_FADV_SEQUENTIAL.  If the export asks
+ * for drop-behind, once a stream is long enough to look like a scan, what
+ * lies well behind it is dropped from the page cache so a one-pass read
+ * does not evict everything else.  That also drops pages other readers
+ * of the file may be using, hence it is not the default.
+ * Reads arriving slightly out of order, up to one request apart, still
+ * count as sequential.
+ */
+void
+ioctx_stream (IOCtx ioctx, off_t offset, u32 count)
+{
+    Stream *s = &ioctx->stream;
+    off_t end = offset + count;
+    off_t w = ioctx->ra_window;
+    off_t ra[RA_MAX_STRIDES], ralen = count;
+    off_t drop = 0, droplen = 0;
+    int i, nra = 0, seq = 0, normal = 0;
+
+    if (w == 0 || count == 0 || ioctx->qid.type != P9_QTFILE
+               || ioctx->dio_align > 0)
+        return;
+    xpthread_mutex_lock (&ioctx->lock);
+    if (s->run >= 0 && offset >= s->end - (off_t)count
+                    && offset <= s->end + (off_t)count) {
+        s->run++;                                       /* sequential */
+        s->stride = 0;
+        if (end > s->end)
+            s->end = end;
+        if (s->run >= RA_MIN_RUN) {
+            if (!s->seq)
+                seq = s->seq = 1;
+            if (s->ra < s->end + w / 2) {
+                ra[nra++] = s->ra > s->end ? s->ra : s->end;
+                ralen = s->end + w - ra[0];
+                s->ra = s->end + w;
+            }
+            if (ioctx->dropbehind && s->end - s->start >= RA_DROP_MIN
+                                  && offset - w > s->drop + w) {
+                drop = s->drop;
+                droplen = offset - w - s->drop;
+                s->drop = offset - w;
+            }
+        }
+    } else if (offset - s->off == s->stride && s->stride > (off_t)count) {
+        s->run++;                                       /* strided */
+        s->end = end;
+        if (s->run >= RA_MIN_RUN) {
+            off_t next = s->ra > offset ? s->ra : offset + s->stride;
+
+            while (nra < RA_MAX_STRIDES && next <= offset + s->stride + w) {
+                ra[nra++] = next;
+                next += s->stride;
+            }
+            s->ra = next;
+        }
+    } else {
+        s->stride = offset - s->off;
+        s->start = s->drop = offset;
+        s->end = end;
+        s->ra = 0;
+        s->run = 0;
+        if (s->seq) {
+            normal = 1;
+            s->seq = 0;
+        }
+    }
+    s->off = offset;
+    xpthread_mutex_unlock (&ioctx->lock);
+
+    if (seq)
+        (void)posix_fadvise (ioctx->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    else if (normal)
+        (void)posix_fadvise (ioctx->fd, 0, 0, POSIX_FADV_NORMAL);
+    for (i = 0; i < nra; i++)
+        (void)posix_fadvise (ioctx->fd, ra[i], ralen, POSIX_FADV_WILLNEED);
+    if (droplen > 0)
+        (void)posix_fadvise (ioctx->fd, drop, droplen, POSIX_FADV_DONTNEED);
+}
+
 int
 ioctx_pread (IOCtx ioctx, void *buf, size_t count, off_t offset)
 {
+    if (ioctx->dio_align > 0)
+        return _dio_pread (ioctx, buf, count, offset);
     return pread (ioctx->fd, buf, count, offset);
 }
 
+/* Build an Rread from the server's cache of hot file contents.
+ * Fails with EOPNOTSUPP if the file is not open read-only or cannot be
+ * cached, so the caller can read it directly.
+ */
+Npfcall *
+ioctx_cached_rread (IOCtx ioctx, Npconn *conn, u32 count, off_t offset)
+{
+    struct stat sb;
+
+    if (!fcache_enabled () || (ioctx->open_flags & O_ACCMODE) != O_RDONLY
+                           || ioctx->dio_align > 0) {
+        np_uerror (EOPNOTSUPP);
+        return NULL;
+    }
+    if (fstat (ioctx->fd, &sb) < 0) {
+        np_uerror (errno);
+        return NULL;
+    }
+    return fcache_rread (ioctx->fd, &sb, conn, count, offset);
+}
+
+/* Build an Rread with the payload spliced from the file rather than copied
+ * through a buffer.  If the transport or file system cannot do it,
+ * fail with EOPNOTSUPP so the caller can fall back to ioctx_pread ().
+ * An fs without splice support is remembered so we don't keep trying.
+ */
+Npfcall *
+ioctx_splice_rread (IOCtx ioctx, Npconn *conn, u32 count, off_t offset)
+{
+    Npfcall *rc;
+
+    if (ioctx->nosplice) {
+        np_uerror (EOPNOTSUPP);
+        return NULL;
+    }
+    if (!(rc = np_splice_rread (conn, ioctx->fd, offset, count))) {
+        if (np_rerror () == EINVAL) {
+            ioctx->nosplice = 1;
+            np_uerror (EOPNOTSUPP);
+        }
+    }
+    return rc;
+}
+
+/* Write Twrite payload held in a pipe (tc->pipe) by splicing it to the
+ * file.  Fails with EOPNOTSUPP, leaving the payload in place, if the
+ * file system cannot do it.
+ */
+int
+ioctx_splice_write (IOCtx ioctx, Npfcall *tc, off_t offset)
+{
+    int n;
+
+    if (ioctx->nosplice) {
+        np_uerror (EOPNOTSUPP);
+        return -1;
+    }
+    if (ioctx->wb_max > 0)
+        xpthread_mutex_lock (&ioctx->lock);
+    if (ioctx->wb_max > 0 && _wb_barrier (ioctx) < 0) {
+        np_uerror (errno);
+        n = -1;
+    } else if ((n = np_splice_twrite (tc, ioctx->fd, offset)) < 0) {
+        if (np_rerror () == EINVAL) {
+            ioctx->nosplice = 1;
+            np_uerror (EOPNOTSUPP);
+        }
+    }
+    if (ioctx->wb_max > 0)
+        xpthread_mutex_unlock (&ioctx->lock);
+    return n;
+}
+
+/* With write-behind, a write at least half the buffer size, or not
+ * continuing the buffered one, first flushes what is buffered.  Large
+ * writes then go straight to the file, small ones are buffered.
+ */
 int
 ioctx_pwrite (IOCtx ioctx, const void *buf, size_t count, off_t offset)
 {
-    return pwrite (ioctx->fd, buf, count, offset);
+    size_t n, limit, done = 0;
+    int rc = count;
+
+    if (ioctx->dio_align > 0)
+        return _dio_pwrite (ioctx, buf, count, offset);
+    if (ioctx->wb_max == 0)
+        return pwrite (ioctx->fd, buf, count, offset);
+
+    xpthread_mutex_lock (&ioctx->lock);
+    if (ioctx->wb_err) {
+        rc = _wb_barrier (ioctx);
+        goto done;
+    }
+    if (ioctx->wb_len > 0 && (count >= ioctx->wb_max / 2
+                        || offset != ioctx->wb_off + ioctx->wb_len)) {
+        if (_wb_flush (ioctx) < 0) {
+            rc = -1;
+            goto done;
+        }
+    }
+    if (count >= ioctx->wb_max / 2) {
+        rc = pwrite (ioctx->fd, buf, count, offset);
+        goto done;
+    }
+    if (!ioctx->wb_buf && !(ioctx->wb_buf = malloc (ioctx->wb_max))) {
+        rc = pwrite (ioctx->fd, buf, count, offset);
+        goto done;
+    }
+    while (done < count) {
+        if (ioctx->wb_len == 0)
+            ioctx->wb_off = offset + done;
+        limit = ioctx->wb_max - ioctx->wb_off % ioctx->wb_max;
+        n = limit - ioctx->wb_len;
+        if (n > count - done)
+            n = count - done;
+        memcpy (ioctx->wb_buf + ioctx->wb_len, (char *)buf + done, n);
+        ioctx->wb_len += n;
+        done += n;
+        if (ioctx->wb_len == limit && _wb_flush (ioctx) < 0) {
+            rc = -1;
+            goto done;
+        }
+    }
+done:
+    xpthread_mutex_unlock (&ioctx->lock);
+    return rc;
+}
+
+#define COPY_MAX        (64*1024*1024)  /* bytes per ioctx_copy_range () */
+#define COPY_CHUNK      (64*1024)       /* pipe capacity, buffer size */
+
+#if HAVE_SPLICE
+/* Copy through a pipe so the data stays in the kernel.
+ */
+static ssize_t
+_copy_splice (IOCtx src, off_t soff, IOCtx dst, off_t doff, size_t count)
+{
+    size_t done = 0;
+    ssize_t n = 0, m;
+    int p[2];
+
+    if (pipe (p) < 0)
+        return -1;
+    while (done < count) {
+        n = splice (src->fd, &soff, p[1], NULL,
+                    count - done > COPY_CHUNK ? COPY_CHUNK : count - done,
+                    SPLICE_F_MOVE);
+        if (n <= 0)
+            break;
+        while (n > 0) {
+            if ((m = splice (p[0], NULL, dst->fd, &doff, n,
+                             SPLICE_F_MOVE)) <= 0) {
+                if (m == 0)
+                    errno = EIO;
+                n = -1;
+                break;
+            }
+            n -= m;
+            done += m;
+        }
+        if (n < 0)
+            break;
+    }
+    (void)close (p[0]);
+    (void)close (p[1]);
+    if (n < 0 && done == 0)
+        return -1;
+    return done;
+}
+#endif
+
+/* Copy through a buffer, e.g. if either file is O_DIRECT.
+ */
+static ssize_t
+_copy_rw (IOCtx src, off_t soff, IOCtx dst, off_t doff, size_t count)
+{
+    size_t done = 0;
+    ssize_t n = 0, m, w;
+    char *buf;
+
+    if (!(buf = malloc (COPY_CHUNK))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while (done < count) {
+        n = ioctx_pread (src, buf, count - done > COPY_CHUNK ? COPY_CHUNK
+                                                             : count - done,
+                         soff + done);
+        if (n <= 0)
+            break;
+        for (w = 0; w < n; w += m) {
+            if ((m = ioctx_pwrite (dst, buf + w, n - w, doff + done + w)) <= 0)
+                break;
+        }
+        if (w < n) {
+            n = -1;
+            break;
+        }
+        done += n;
+    }
+    free (buf);
+    if (n < 0 && done == 0)
+        return -1;
+    return done;
+}
+
+/* Copy up to count bytes from src at soff to dst at doff, all on the
+ * server.  copy_file_range(2) lets the file system copy, or even share,
+ * the blocks itself.  Where it cannot, e.g. between file systems, the
+ * data goes through a pipe with splice(2), or failing that a buffer.
+ * At most COPY_MAX bytes are copied per call so a worker thread is not
+ * tied up indefinitely.  Returns the number of bytes copied, 0 at end
+ * of file, or -1 with errno set.
+ */
+ssize_t
+ioctx_copy_range (IOCtx src, off_t soff, IOCtx dst, off_t doff, size_t count)
+{
+    ssize_t n;
+
+    if (src->qid.type != P9_QTFILE || dst->qid.type != P9_QTFILE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (src->dev == dst->dev && src->qid.path == dst->qid.path
+                             && soff < doff + (off_t)count
+                             && doff < soff + (off_t)count) {
+        errno = EINVAL; /* overlapping ranges of one file */
+        return -1;
+    }
+    if (count > COPY_MAX)
+        count = COPY_MAX;
+    if (ioctx_flush (src) < 0 || ioctx_flush (dst) < 0)
+        return -1;
+#if HAVE_COPY_FILE_RANGE
+    if (src->dio_align == 0 && dst->dio_align == 0) {
+        n = copy_file_range (src->fd, &soff, dst->fd, &doff, count, 0);
+        if (n >= 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+                                      && errno != EOPNOTSUPP))
+            return n;
+    }
+#endif
+#if HAVE_SPLICE
+    if (!src->nosplice && !dst->nosplice) {
+        n = _copy_splice (src, soff, dst, doff, count);
+        if (n >= 0 || errno != EINVAL)
+            return n;
+    }
+#endif
+    return _copy_rw (src, soff, dst, doff, count);
 }
 
 int
@@ -281,6 +1275,14 @@ ioctx_stat (IOCtx ioctx, struct stat *sb)
     return fstat (ioctx->fd, sb);
 }
 
+#if HAVE_STATX
+int
+ioctx_statx (IOCtx ioctx, int flags, unsigned int mask, struct statx *stx)
+{
+    return statx (ioctx->fd, "", flags | AT_EMPTY_PATH, mask, stx);
+}
+#endif
+
 int
 ioctx_chmod (IOCtx ioctx, u32 mode)
 {
@@ -314,47 +1316,86 @@ ioctx_utimes (IOCtx ioctx, const utimbuf *times)
 }
 #endif
 
-void
-ioctx_rewinddir (IOCtx ioctx)
-{
-    if (ioctx->dir)
-        rewinddir (ioctx->dir);
-}
-
-void
-ioctx_seekdir (IOCtx ioctx, long offset)
+/* Fill 'buf' with whole directory entries starting at cookie 'offset'
+ * (0 for the beginning).  Returns the number of bytes used, 0 at the end
+ * of the directory, or -1 with errno set, e.g. EINVAL if 'len' cannot
+ * hold the next entry.  On Linux this is one getdents64 call, elsewhere
+ * the same records are built with readdir.
+ */
+int
+ioctx_getdents (IOCtx ioctx, u64 offset, void *buf, int len)
 {
-    if (ioctx->dir)
-        seekdir (ioctx->dir, offset);
-}
+    int n = 0;
+#if defined(SYS_getdents64)
+    xpthread_mutex_lock (&ioctx->lock);
+    if (lseek (ioctx->fd, offset, SEEK_SET) < 0)
+        n = -1;
+    else
+        n = syscall (SYS_getdents64, ioctx->fd, buf, len);
+    xpthread_mutex_unlock (&ioctx->lock);
+#else
+    struct diod_dirent *dp;
+    struct dirent *d;
+    int reclen;
 
-int
-ioctx_readdir_r(IOCtx ioctx, struct diod_dirent *entry, struct diod_dirent **result)
-{
-  int r;
-  struct dirent* rd_result;
-  if (!ioctx->dir)
-    return EINVAL;
-
-  r = readdir_r (ioctx->dir, &entry->dir_entry, &rd_result);
-  if (r==0) {  /* success */
-    /* Does the same to diod_dirent as readdir_r() does to dirent */
-    if (rd_result == NULL)
-      *result = NULL;
+    if (!ioctx->dir) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    xpthread_mutex_lock (&ioctx->lock);
+    if (offset == 0)
+        rewinddir (ioctx->dir);
     else
-      *result = entry;
+        seekdir (ioctx->dir, offset);
+    for (;;) {
+        errno = 0;
+        if (!(d = readdir (ioctx->dir))) {
+            if (errno != 0 && n == 0)
+                n = -1;
+            break;
+        }
+        reclen = (sizeof (*dp) + strlen (d->d_name) + 1 + 7) & ~7;
+        if (n + reclen > len) {
+            if (n == 0) {
+                errno = EINVAL;
+                n = -1;
+            }
+            break;
+        }
+        dp = (struct diod_dirent *)((char *)buf + n);
+        dp->d_ino = d->d_ino;
 #ifdef _DIRENT_HAVE_D_OFF
-    entry->d_off = entry->dir_entry.d_off;
+        dp->d_off = d->d_off;
+#else
+        dp->d_off = telldir (ioctx->dir);
+#endif
+        dp->d_reclen = reclen;
+#ifdef _DIRENT_HAVE_D_TYPE
+        dp->d_type = d->d_type;
 #else
-    entry->d_off = telldir (ioctx->dir);
+        dp->d_type = DT_UNKNOWN;
+#endif
+        strcpy (dp->d_name, d->d_name);
+        n += reclen;
+    }
+    xpthread_mutex_unlock (&ioctx->lock);
 #endif
-  }
-  return r;
+    return n;
+}
+
+/* Stat an entry of an open directory without following symlinks.
+ */
+int
+ioctx_fstatat (IOCtx ioctx, const char *name, struct stat *sb)
+{
+    return fstatat (ioctx->fd, name, sb, AT_SYMLINK_NOFOLLOW);
 }
 
 int
 ioctx_fsync(IOCtx ioctx)
 {
+    if (ioctx_flush (ioctx) < 0)
+        return -1;
     return fsync (ioctx->fd);
 }
 
@@ -412,10 +1453,17 @@ ioctx_testlock (IOCtx ioctx, int type)
     return ret;
 }
 
+/* For O_DIRECT, the largest multiple of the alignment that fits in
+ * msize, else 0 so v9fs uses msize-P9_IOHDRSZ.
+ */
 u32
-ioctx_iounit (IOCtx ioctx)
+ioctx_iounit (IOCtx ioctx, u32 msize)
 {
-    return ioctx->iounit;
+    u32 max = msize - P9_IOHDRSZ;
+
+    if (ioctx->dio_align == 0 || max < ioctx->dio_align)
+        return 0;
+    return max - max % ioctx->dio_align;
 }
 
 Npqid *
@@ -424,15 +1472,40 @@ ioctx_qid (IOCtx ioctx)
     return &ioctx->qid;
 }
 
+dev_t
+ioctx_dev (IOCtx ioctx)
+{
+    return ioctx->dev;
+}
+
 /* N.B. When diod_fidclone() calls path_incref(), the path will not be
  * removed from the pool even though the ppool lock is not held,
  * because the fid being cloned holds a reference on the path.
  */
 
 static void
-_path_free (Path path)
+_path_free (Npsrv *srv, Path path)
 {
+    PathOld o;
+    int i;
+
     NP_ASSERT (path->ioctx == NULL);
+    NP_ASSERT (path->parked == NULL);
+    if (path->fd != -1)
+        (void)close (path->fd);
+    for (i = 0; i < path->nstale; i++)
+        (void)close (path->stale[i]);
+    if (path->stale)
+        free (path->stale);
+    while ((o = path->old)) {
+        path->old = o->next;
+        if (o->parent)
+            path_decref (srv, o->parent);
+        free (o->s);
+        free (o);
+    }
+    if (path->parent)
+        path_decref (srv, path->parent);
     if (path->s)
         free (path->s);
     pthread_mutex_destroy (&path->lock);
@@ -459,15 +1532,16 @@ path_decref (Npsrv *srv, Path path)
     xpthread_mutex_lock (&path->lock);
     n = --path->refcount;
     xpthread_mutex_unlock (&path->lock);
-    if (n == 0)
+    /* a path displaced by path_rename () is no longer in the hash */
+    if (n == 0 && hash_find (pp->hash, path->s) == path)
         hash_remove (pp->hash, path->s);
     xpthread_mutex_unlock (&pp->lock);
     if (n == 0)
-        _path_free (path);
+        _path_free (srv, path);
 }
 
 static Path
-_path_alloc (Npsrv *srv, char *s, int len)
+_path_alloc (Npsrv *srv, char *s, int len, Path parent, int nameoff)
 {
     PathPool pp = srv->srvaux;
     Path path;
@@ -487,7 +1561,16 @@ _path_alloc (Npsrv *srv, char *s, int len)
         pthread_mutex_init (&path->lock, NULL);
         path->s = s;
         path->len = len;
+        path->name = s + nameoff;
+        path->parent = parent ? path_incref (parent) : NULL;
+        path->fd = -1;
+        path->stale = NULL;
+        path->nstale = 0;
+        path->old = NULL;
+        path->next = NULL;
         path->ioctx = NULL;
+        path->parked = NULL;
+        path->nwb = 0;
         if (!hash_insert (pp->hash, path->s, path)) {
             NP_ASSERT (errno == ENOMEM);
             goto error;
@@ -498,7 +1581,7 @@ _path_alloc (Npsrv *srv, char *s, int len)
 error:
     xpthread_mutex_unlock (&pp->lock);
     if (path)
-        _path_free (path);
+        _path_free (srv, path);
     return NULL;
 }
 
@@ -509,22 +1592,240 @@ path_create (Npsrv *srv, Npstr *ns)
 
     if (!(s = np_strdup (ns)))
         return NULL;
-    return _path_alloc (srv, s, ns->len);
+    return _path_alloc (srv, s, ns->len, NULL, 0);
 }
 
 Path
 path_append (Npsrv *srv, Path opath, Npstr *ns)
 {
     char *s;
-    int len = opath->len + 1 + ns->len;
-
-    if (!(s = malloc (len + 1)))
+    int len, olen;
+
+    xpthread_mutex_lock (&opath->lock);
+    olen = opath->len;
+    len = olen + 1 + ns->len;
+    if ((s = malloc (len + 1)))
+        memcpy (s, opath->s, olen);
+    xpthread_mutex_unlock (&opath->lock);
+    if (!s)
         return NULL;
-    memcpy (s, opath->s, opath->len);
-    s[opath->len] = '/';
-    memcpy (s + opath->len + 1, ns->str, ns->len);
+    s[olen] = '/';
+    memcpy (s + olen + 1, ns->str, ns->len);
     s[len] = '\0';
-    return _path_alloc (srv, s, len);
+    return _path_alloc (srv, s, len, opath, olen + 1);
+}
+
+typedef struct {
+    char *s;
+    int len;
+    Path list;
+} PathTree;
+
+/* hash_delete_if () callback: unhash 'path' if it is pt->s or lies
+ * beneath it, and put it on pt->list.
+ */
+static int
+_unhash_tree (Path path, char *key, PathTree *pt)
+{
+    if (strncmp (key, pt->s, pt->len) != 0)
+        return 0;
+    if (key[pt->len] != '\0' && key[pt->len] != '/')
+        return 0;
+    path->next = pt->list;
+    pt->list = path;
+    return 1;
+}
+
+/* Give 'path' the name 'ns' and, if 'parent' is non-NULL, a new parent.
+ * The hash key is not touched.  Caller holds the ppool lock.
+ */
+static int
+_path_setname (Path path, char *ns, int len, int nameoff, Path parent)
+{
+    PathOld o;
+
+    if (!(o = malloc (sizeof (*o))))
+        return -1;
+    xpthread_mutex_lock (&path->lock);
+    o->s = path->s;
+    o->parent = NULL;
+    path->s = ns;
+    path->len = len;
+    path->name = ns + nameoff;
+    if (parent) {
+        o->parent = path->parent;
+        path->parent = parent;
+    }
+    o->next = path->old;
+    path->old = o;
+    xpthread_mutex_unlock (&path->lock);
+    return 0;
+}
+
+/* Called after 'opath' has been renamed to 'npath'.  Everything in the pool
+ * at or beneath 'npath' was replaced by the rename, so take it out of the
+ * hash (fids holding it keep what they have).  Then move 'opath' and its
+ * descendants to the new name in place so fids referring to them, which
+ * the client believes were moved too, continue to work.  The descendants
+ * keep their parent pointers, and their dir fds are unaffected.  If memory
+ * runs out, a path is left unhashed with its old name, as before.
+ */
+void
+path_rename (Npsrv *srv, Path opath, Path npath)
+{
+    PathPool pp = srv->srvaux;
+    PathTree ot = { .list = NULL }, nt = { .list = NULL };
+    Path path, nparent;
+    char *s;
+    int len;
+
+    if (opath == npath || !npath->parent)
+        return;
+    nparent = path_incref (npath->parent);
+    xpthread_mutex_lock (&pp->lock);
+    nt.s = npath->s;
+    nt.len = npath->len;
+    if (strncmp (opath->s, nt.s, nt.len) == 0 && (opath->s[nt.len] == '\0'
+                                              || opath->s[nt.len] == '/'))
+        goto done; /* a rename onto an ancestor can't have succeeded */
+    (void)hash_delete_if (pp->hash, (hash_arg_f)_unhash_tree, &nt);
+    if (!(ot.s = strdup (opath->s)))
+        goto done;
+    ot.len = opath->len;
+    (void)hash_delete_if (pp->hash, (hash_arg_f)_unhash_tree, &ot);
+    while ((path = ot.list)) {
+        ot.list = path->next;
+        path->next = NULL;
+        len = nt.len + path->len - ot.len;
+        if (!(s = malloc (len + 1)))
+            continue;
+        memcpy (s, nt.s, nt.len);
+        strcpy (s + nt.len, path->s + ot.len);
+        if (path == opath) {
+            if (_path_setname (path, s, len, npath->name - npath->s,
+                               nparent) < 0) {
+                free (s);
+                continue;
+            }
+            nparent = NULL;
+        } else if (_path_setname (path, s, len,
+                                  path->name - path->s + nt.len - ot.len,
+                                  NULL) < 0) {
+            free (s);
+            continue;
+        }
+        (void)hash_insert (pp->hash, path->s, path);
+    }
+    while ((path = nt.list)) {
+        nt.list = path->next;
+        path->next = NULL;
+    }
+    free (ot.s);
+done:
+    xpthread_mutex_unlock (&pp->lock);
+    if (nparent)
+        path_decref (srv, nparent);
+}
+
+/* Return an fd for directory 'path', opening it relative to its parent
+ * the first time.  The fd stays valid until the path is freed.
+ * On failure return -1 with errno set.
+ */
+int
+path_dirfd (Path path)
+{
+    struct stat sb;
+    char *name;
+    int fd, dirfd;
+
+    xpthread_mutex_lock (&path->lock);
+    if ((fd = path->fd) == -1) {
+        dirfd = _path_at (path, &name);
+        if ((fd = openat (dirfd, name, PATH_DIRFD_FLAGS)) >= 0) {
+            if (fstat (fd, &sb) < 0) {
+                (void)close (fd);
+                fd = -1;
+            } else {
+                path->fd = fd;
+                path->dev = sb.st_dev;
+                path->ino = sb.st_ino;
+            }
+        }
+    }
+    xpthread_mutex_unlock (&path->lock);
+    return fd;
+}
+
+/* Get st_dev of directory 'path', from its fd if it can be opened.
+ */
+int
+path_dirdev (Path path, dev_t *devp)
+{
+    struct stat sb;
+
+    if (path_dirfd (path) >= 0) {
+        xpthread_mutex_lock (&path->lock);
+        *devp = path->dev;
+        xpthread_mutex_unlock (&path->lock);
+        return 0;
+    }
+    if (stat (path->s, &sb) < 0)
+        return -1;
+    *devp = sb.st_dev;
+    return 0;
+}
+
+/* Return a directory fd and name such that (fd, name) refers to 'path'
+ * in *at() calls.  If the parent fd cannot be opened, fall back to
+ * AT_FDCWD and the full path so the caller gets the errno it would have.
+ */
+static int
+_path_at (Path path, char **namep)
+{
+    int fd;
+
+    if (path->parent && (fd = path_dirfd (path->parent)) >= 0) {
+        *namep = path->name;
+        return fd;
+    }
+    *namep = path->s;
+    return AT_FDCWD;
+}
+
+int
+path_at (Path path, char **namep)
+{
+    int fd;
+
+    xpthread_mutex_lock (&path->lock);
+    fd = _path_at (path, namep);
+    xpthread_mutex_unlock (&path->lock);
+    return fd;
+}
+
+/* Called after a walk has looked up 'path' anew.  If 'sb' shows the name
+ * now refers to something other than the directory our fd was opened on,
+ * open it again on next use.  The old fd may be in use by another thread
+ * so it is closed only when the path is freed.
+ */
+void
+path_revalidate (Path path, struct stat *sb)
+{
+    int *stale;
+
+    if (S_ISLNK (sb->st_mode))
+        return;
+    xpthread_mutex_lock (&path->lock);
+    if (path->fd != -1 && (!S_ISDIR (sb->st_mode) || sb->st_dev != path->dev
+                                                  || sb->st_ino != path->ino)) {
+        stale = realloc (path->stale, sizeof (int) * (path->nstale + 1));
+        if (stale) {
+            path->stale = stale;
+            path->stale[path->nstale++] = path->fd;
+            path->fd = -1;
+        }
+    }
+    xpthread_mutex_unlock (&path->lock);
 }
 
 char *
@@ -564,6 +1865,37 @@ _ppool_dump (char *name, void *a)
     return ds.s;
 }
 
+static char *
+_ocache_ctl (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    xpthread_mutex_lock (&oc_lock);
+    if (aspf (&s, &len, "hit %"PRIu64"\nmiss %"PRIu64"\nstale %"PRIu64"\n"
+              "evict %"PRIu64"\nfiles %d\nmax %d\n",
+              oc_hit, oc_miss, oc_stale, oc_evict, oc_count, oc_max) < 0)
+        np_uerror (ENOMEM);
+    xpthread_mutex_unlock (&oc_lock);
+    return s;
+}
+
+/* Bound the open file cache by the configured size, leaving at least half
+ * of the descriptor limit for files actually open and connections.
+ */
+static void
+_ocache_init (void)
+{
+    struct rlimit r;
+
+    oc_max = diod_conf_get_opencache ();
+    if (oc_max > 0 && getrlimit (RLIMIT_NOFILE, &r) == 0
+                   && r.rlim_cur != RLIM_INFINITY && oc_max > r.rlim_cur / 2)
+        oc_max = r.rlim_cur / 2;
+    if (oc_max < 0)
+        oc_max = 0;
+}
+
 void
 ppool_fini (Npsrv *srv)
 {
@@ -571,6 +1903,7 @@ ppool_fini (Npsrv *srv)
 
     if (pp) {
         if (pp->hash) {
+            _discard (srv, _lru_pop (-1));
             /* issue 99: this triggers when shutting down with active clients */
             /*NP_ASSERT (hash_is_empty (pp->hash));*/
             hash_destroy (pp->hash);
@@ -579,6 +1912,10 @@ ppool_fini (Npsrv *srv)
         free (pp);
     }
     srv->srvaux = NULL;
+    xpthread_mutex_lock (&dio_lock);
+    while (dio_nfree > 0)
+        free (dio_free[--dio_nfree]);
+    xpthread_mutex_unlock (&dio_lock);
 }
 
 int
@@ -600,6 +1937,16 @@ ppool_init (Npsrv *srv)
     srv->srvaux = pp;
     if (!np_ctl_addfile (srv->ctlroot, "files", _ppool_dump, srv, 0))
         goto error;
+    _ocache_init ();
+    if (sysconf (_SC_PAGESIZE) > 0)
+        dio_pagesize = sysconf (_SC_PAGESIZE);
+    /* an msize request widened by an alignment unit at each end */
+    dio_bufsize = srv->msize + 2 * dio_pagesize;
+    dio_bufsize = (dio_bufsize + dio_pagesize - 1) / dio_pagesize * dio_pagesize;
+    if (oc_max > 0) {
+        if (!np_ctl_addfile (srv->ctlroot, "opencache", _ocache_ctl, srv, 0))
+            goto error;
+    }
     return 0;
 error:
     ppool_fini (srv);
@@ -8,23 +8,42 @@ void    ppool_fini (Npsrv *srv);
 
 Path    path_create (Npsrv *srv, Npstr *ns);
 Path    path_append (Npsrv *srv, Path opath, Npstr *ns);
+void    path_rename (Npsrv *srv, Path opath, Path npath);
 Path    path_incref (Path path);
 void    path_decref (Npsrv *srv, Path path);
 char    *path_s (Path path);
+int     path_dirfd (Path path);
+int     path_at (Path path, char **namep);
+int     path_dirdev (Path path, dev_t *devp);
+void    path_revalidate (Path path, struct stat *sb);
 
 int     ioctx_open (Npfid *fid, u32 flags, u32 mode);
 int     ioctx_close (Npfid *fid, int seterrno);
+void    ioctx_cache_inval (Npsrv *srv, Path path, int unlinked);
+void    ioctx_stream (IOCtx ioctx, off_t offset, u32 count);
+int     ioctx_flush (IOCtx ioctx);
+void    ioctx_flush_path (Path path);
+void    ioctx_flush_child (Npsrv *srv, Path dir, const char *name);
 int     ioctx_pread (IOCtx ioctx, void *buf, size_t count, off_t offset);
 int     ioctx_pwrite (IOCtx ioctx, const void *buf, size_t count, off_t offset);
-int     ioctx_readdir_r(IOCtx ioctx, struct diod_dirent *entry,
-                        struct diod_dirent **result);
-void    ioctx_rewinddir (IOCtx ioctx);
-void    ioctx_seekdir (IOCtx ioctx, long offset);
+int     ioctx_splice_write (IOCtx ioctx, Npfcall *tc, off_t offset);
+ssize_t ioctx_copy_range (IOCtx src, off_t soff, IOCtx dst, off_t doff,
+                          size_t count);
+Npfcall *ioctx_splice_rread (IOCtx ioctx, Npconn *conn, u32 count,
+                            off_t offset);
+Npfcall *ioctx_cached_rread (IOCtx ioctx, Npconn *conn, u32 count,
+                            off_t offset);
+int     ioctx_getdents (IOCtx ioctx, u64 offset, void *buf, int len);
+int     ioctx_fstatat (IOCtx ioctx, const char *name, struct stat *sb);
 int     ioctx_fsync (IOCtx ioctx);
 int     ioctx_flock (IOCtx ioctx, int operation);
 int     ioctx_testlock (IOCtx ioctx, int operation);
 
 int     ioctx_stat (IOCtx ioctx, struct stat *sb);
+#if HAVE_STATX
+int     ioctx_statx (IOCtx ioctx, int flags, unsigned int mask,
+                     struct statx *stx);
+#endif
 int     ioctx_chmod (IOCtx ioctx, u32 mode);
 int     ioctx_chown (IOCtx ioctx, u32 uid, u32 gid);
 int     ioctx_truncate (IOCtx ioctx, u64 size);
@@ -35,8 +54,9 @@ int     ioctx_utimes (IOCtx ioctx, const utimbuf *times);
 #endif
 
 
-u32     ioctx_iounit (IOCtx ioctx);
+u32     ioctx_iounit (IOCtx ioctx, u32 msize);
 Npqid   *ioctx_qid (IOCtx ioctx);
+dev_t   ioctx_dev (IOCtx ioctx);
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
@@ -0,0 +1,299 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+
+/* mnt.c - cache what lies underneath mount points crossed by walks */
+
+/* A fid that walks onto a mount point reports the st_dev and st_ino of the
+ * directory the mount covers, which can only be found by scanning the
+ * parent directory for the name.  Results are cached keyed by mount id
+ * (from statx where available, else st_dev) and mount point path, and the
+ * cache is flushed whenever /proc/self/mountinfo reports a change.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "list.h"
+#include "hash.h"
+#include "xpthread.h"
+
+#include "diod_log.h"
+
+#include "mnt.h"
+
+#define MNT_HASH_SIZE   64
+#define PATH_MOUNTINFO  "/proc/self/mountinfo"
+
+typedef struct {
+    char            *key;
+    dev_t           dev;
+    ino_t           ino;
+} Mnt;
+
+static pthread_mutex_t  mnt_lock = PTHREAD_MUTEX_INITIALIZER;
+static hash_t           mnt_hash = NULL;
+static int              mnt_fd = -1;
+static u64              mnt_hit = 0;
+static u64              mnt_miss = 0;
+
+static void
+_mnt_free (Mnt *m)
+{
+    free (m->key);
+    free (m);
+}
+
+static int
+_mnt_any (void *data, const void *key, void *arg)
+{
+    return 1;
+}
+
+/* Drop everything if the mount table changed since we last looked.
+ * The change is acknowledged by reading the file again.
+ */
+static void
+_mnt_check (void)
+{
+    struct pollfd pfd;
+    char buf[4096];
+
+    if (mnt_fd == -1)
+        return;
+    pfd.fd = mnt_fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLERR | POLLPRI)))
+        return;
+    if (lseek (mnt_fd, 0, SEEK_SET) == 0) {
+        while (read (mnt_fd, buf, sizeof (buf)) > 0)
+            ;
+    }
+    (void)hash_delete_if (mnt_hash, _mnt_any, NULL);
+}
+
+/* Identify the mount rooted at (dirfd, name), which 'sb' describes.
+ */
+static u64
+_mnt_id (int dirfd, char *name, struct stat *sb)
+{
+#if HAVE_STATX && defined(STATX_MNT_ID)
+    struct statx stx;
+
+    if (statx (dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+               STATX_MNT_ID, &stx) == 0 && (stx.stx_mask & STATX_MNT_ID))
+        return stx.stx_mnt_id;
+#endif
+    return sb->st_dev;
+}
+
+/* Scan the directory containing mount point (dirfd, name) for the name
+ * to learn the inode the mount covers.
+ */
+static int
+_mnt_scan (int dirfd, char *name, dev_t *devp, ino_t *inop)
+{
+    char *ppath = NULL;
+    int plen = strlen (name) + 4;
+    char *base;
+    struct stat sbp;
+    struct dirent *dp;
+    DIR *dir = NULL;
+    int fd = -1;
+
+    if (!(ppath = malloc (plen))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    snprintf (ppath, plen, "%s/..", name);
+    if ((fd = openat (dirfd, ppath, O_RDONLY | O_DIRECTORY)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (fstat (fd, &sbp) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (!(dir = fdopendir (fd))) {
+        np_uerror (errno);
+        goto error;
+    }
+    fd = -1;
+    base = strrchr (name, '/');
+    base = base ? base + 1 : name;
+    errno = 0;
+    while ((dp = readdir (dir)) && strcmp (base, dp->d_name) != 0)
+        ;
+    if (!dp) {
+        np_uerror (errno ? errno : ENOENT);
+        goto error;
+    }
+    *devp = sbp.st_dev;
+    *inop = dp->d_ino;
+    (void)closedir (dir);
+    free (ppath);
+    return 0;
+error:
+    if (dir)
+        (void)closedir (dir);
+    if (fd != -1)
+        (void)close (fd);
+    if (ppath)
+        free (ppath);
+    return -1;
+}
+
+int
+mnt_covered (int dirfd, char *name, char *path, struct stat *sb)
+{
+    char *key = NULL;
+    int keylen = 0;
+    Mnt *m = NULL;
+    dev_t dev;
+    ino_t ino;
+
+    if (aspf (&key, &keylen, "%"PRIu64" %s",
+              _mnt_id (dirfd, name, sb), path) < 0) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    xpthread_mutex_lock (&mnt_lock);
+    _mnt_check ();
+    if ((m = hash_find (mnt_hash, key))) {
+        sb->st_dev = m->dev;
+        sb->st_ino = m->ino;
+        mnt_hit++;
+    }
+    xpthread_mutex_unlock (&mnt_lock);
+    if (m) {
+        free (key);
+        return 0;
+    }
+
+    if (_mnt_scan (dirfd, name, &dev, &ino) < 0)
+        goto error;
+    sb->st_dev = dev;
+    sb->st_ino = ino;
+
+    if (!(m = malloc (sizeof (*m))))
+        goto done;
+    m->key = key;
+    m->dev = dev;
+    m->ino = ino;
+    key = NULL;
+    xpthread_mutex_lock (&mnt_lock);
+    mnt_miss++;
+    if (hash_find (mnt_hash, m->key) || !hash_insert (mnt_hash, m->key, m))
+        _mnt_free (m);
+    xpthread_mutex_unlock (&mnt_lock);
+done:
+    if (key)
+        free (key);
+    return 0;
+error:
+    if (key)
+        free (key);
+    return -1;
+}
+
+static char *
+_mnt_ctl (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+    u64 hit, miss;
+    int n;
+
+    xpthread_mutex_lock (&mnt_lock);
+    hit = mnt_hit;
+    miss = mnt_miss;
+    n = hash_count (mnt_hash);
+    xpthread_mutex_unlock (&mnt_lock);
+    if (aspf (&s, &len, "hit %"PRIu64"\nmiss %"PRIu64"\nentries %d\n",
+              hit, miss, n) < 0) {
+        np_uerror (ENOMEM);
+        return NULL;
+    }
+    return s;
+}
+
+int
+mnt_init (Npsrv *srv)
+{
+    char buf[4096];
+
+    mnt_hash = hash_create (MNT_HASH_SIZE, (hash_key_f)hash_key_string,
+                            (hash_cmp_f)strcmp, (hash_del_f)_mnt_free);
+    if (!mnt_hash) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    /* Not fatal: without it, cached entries are only dropped if the
+     * mount id or path changes.
+     */
+    if ((mnt_fd = open (PATH_MOUNTINFO, O_RDONLY | O_CLOEXEC)) >= 0) {
+        while (read (mnt_fd, buf, sizeof (buf)) > 0)
+            ;
+    }
+    if (!np_ctl_addfile (srv->ctlroot, "mounts", _mnt_ctl, srv, 0))
+        goto error;
+    return 0;
+error:
+    mnt_fini (srv);
+    return -1;
+}
+
+void
+mnt_fini (Npsrv *srv)
+{
+    if (mnt_hash) {
+        hash_destroy (mnt_hash);
+        mnt_hash = NULL;
+    }
+    if (mnt_fd != -1) {
+        (void)close (mnt_fd);
+        mnt_fd = -1;
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
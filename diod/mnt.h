@@ -0,0 +1,8 @@
+int     mnt_init (Npsrv *srv);
+void    mnt_fini (Npsrv *srv);
+
+int     mnt_covered (int dirfd, char *name, char *path, struct stat *sb);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
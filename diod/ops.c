@@ -121,11 +121,23 @@
 #include "ops.h"
 #include "exp.h"
 #include "ioctx.h"
+#include "mnt.h"
+#include "acache.h"
+#include "fcache.h"
+#include "dcache.h"
 #include "xattr.h"
 #include "fid.h"
 
 #define DIOD_SRV_MAX_MSIZE 1048576
 
+/* Reads at least this large are spliced from file to socket when possible.
+ */
+#define DIOD_SPLICE_MIN 16384
+
+#define DIOD_DIRBUF_MIN     4096    /* getdents buffer for readdir */
+#define DIOD_DIRBUF_SNAP    65536   /* getdents buffer for a snapshot */
+#define DIOD_DIRENT_MAX     (13 + 8 + 1 + 2 + NAME_MAX) /* qid offset type name */
+
 Npfcall     *diod_attach (Npfid *fid, Npfid *afid, Npstr *aname);
 int          diod_clone  (Npfid *fid, Npfid *newfid);
 int          diod_walk   (Npfid *fid, Npstr *wname, Npqid *wqid);
@@ -148,6 +160,8 @@ Npfcall     *diod_getattr(Npfid *fid, u64 request_mask);
 Npfcall     *diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
                         u64 atime_sec, u64 atime_nsec, u64 mtime_sec, u64 mtime_nsec);
 Npfcall     *diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req);
+Npfcall     *diod_readdirplus(Npfid *fid, u64 offset, u32 count,
+                              u64 request_mask, Npreq *req);
 Npfcall     *diod_fsync (Npfid *fid);
 Npfcall     *diod_lock (Npfid *fid, u8 type, u32 flags, u64 start, u64 length,
                         u32 proc_id, Npstr *client_id);
@@ -155,6 +169,11 @@ Npfcall     *diod_getlock (Npfid *fid, u8 type, u64 start, u64 length,
                         u32 proc_id, Npstr *client_id);
 Npfcall     *diod_link (Npfid *dfid, Npfid *fid, Npstr *name);
 Npfcall     *diod_mkdir (Npfid *fid, Npstr *name, u32 mode, u32 gid);
+Npfcall     *diod_renameat (Npfid *olddirfid, Npstr *oldname,
+                            Npfid *newdirfid, Npstr *newname);
+Npfcall     *diod_unlinkat (Npfid *dirfid, Npstr *name, u32 flags);
+Npfcall     *diod_copyrange (Npfid *srcfid, u64 srcoff, Npfid *dstfid,
+                             u64 dstoff, u64 count);
 Npfcall     *diod_xattrwalk (Npfid *fid, Npfid *attrfid, Npstr *name);
 Npfcall     *diod_xattrcreate (Npfid *fid, Npstr *name, u64 attr_size,
                                u32 flags);
@@ -175,6 +194,7 @@ diod_init (Npsrv *srv)
     srv->auth_required = diod_auth_required;
     srv->auth = diod_auth_functions;
     srv->get_path = diod_get_path;
+    srv->flags |= SRV_FLAGS_SPLICEWRITE;
 
     srv->attach = diod_attach;
     srv->clone = diod_clone;
@@ -195,18 +215,28 @@ diod_init (Npsrv *srv)
     srv->xattrwalk = diod_xattrwalk;
     srv->xattrcreate = diod_xattrcreate;
     srv->readdir = diod_readdir;
+    srv->readdirplus = diod_readdirplus;
     srv->fsync = diod_fsync;
     srv->llock = diod_lock;
     srv->getlock = diod_getlock;
     srv->link = diod_link;
     srv->mkdir = diod_mkdir;
-    //srv->renameat = diod_renameat;
-    //srv->unlinkat = diod_unlinkat;
+    srv->renameat = diod_renameat;
+    srv->unlinkat = diod_unlinkat;
+    srv->copyrange = diod_copyrange;
 
     if (!np_ctl_addfile (srv->ctlroot, "exports", diod_get_exports, srv, 0))
         goto error;
     if (ppool_init (srv) < 0)
         goto error;
+    if (mnt_init (srv) < 0)
+        goto error;
+    if (acache_init (srv) < 0)
+        goto error;
+    if (fcache_init (srv) < 0)
+        goto error;
+    if (dcache_init (srv) < 0)
+        goto error;
     return 0;
 error:
     diod_fini (srv);
@@ -216,9 +246,37 @@ error:
 void
 diod_fini (Npsrv *srv)
 {
+    dcache_fini (srv);
+    fcache_fini (srv);
+    acache_fini (srv);
+    mnt_fini (srv);
     ppool_fini (srv);
 }
 
+/* Derive qid.version from modification time and size, so it changes
+ * whenever file contents do and clients can tell cached data is stale.
+ * The kernel's change cookie is not visible to user space, and ctime
+ * would also change on chmod and the like.  All 64 bits of the time
+ * in nanoseconds are mixed in so that updates within a second count.
+ */
+static u32
+_ustat2version (struct stat *st)
+{
+    u64 v;
+
+#ifdef __APPLE__
+    v = (u64)st->st_mtimespec.tv_sec * 1000000000ULL
+      + st->st_mtimespec.tv_nsec;
+#else
+    v = (u64)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+#endif
+    v ^= (u64)st->st_size * 0x9e3779b97f4a7c15ULL;
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    return (u32)v;
+}
+
 /* Create a 9P qid from a file's stat info.
  * N.B. v9fs maps st_ino = qid->path + 2
  */
@@ -226,8 +284,7 @@ void
 diod_ustat2qid (struct stat *st, Npqid *qid)
 {
     qid->path = st->st_ino;
-    //qid->version = st->st_mtime ^ (st->st_size << 8);
-    qid->version = 0;
+    qid->version = _ustat2version (st);
     qid->type = 0;
     if (S_ISDIR(st->st_mode))
         qid->type |= P9_QTDIR;
@@ -236,10 +293,8 @@ diod_ustat2qid (struct stat *st, Npqid *qid)
 }
 
 static void
-_dirent2qid (struct diod_dirent *d1, Npqid *qid)
+_dirent2qid (struct diod_dirent *d, Npqid *qid)
 {
-    struct dirent* d = &(d1->dir_entry);
-
     NP_ASSERT (d->d_type != DT_UNKNOWN);
     qid->path = d->d_ino;
     qid->version = 0;
@@ -326,7 +381,19 @@ diod_attach (Npfid *fid, Npfid *afid, Npstr *aname)
     if (diod_fetch_xflags (aname, &xflags)) {
         if ((xflags & XFLAGS_SHAREFD))
             f->flags |= DIOD_FID_FLAGS_SHAREFD;
-    }
+        if ((xflags & XFLAGS_DIRCACHE))
+            f->flags |= DIOD_FID_FLAGS_DIRCACHE;
+        if ((xflags & XFLAGS_ATTRSYNC))
+            f->flags |= DIOD_FID_FLAGS_ATTRSYNC;
+        if ((xflags & XFLAGS_ATTRNOSYNC))
+            f->flags |= DIOD_FID_FLAGS_ATTRNOSYNC;
+        if ((xflags & XFLAGS_DROPBEHIND))
+            f->flags |= DIOD_FID_FLAGS_DROPBEHIND;
+    }
+    f->attrttl = diod_fetch_attrttl (aname);
+    f->dircache = diod_fetch_dircache (aname);
+    f->readahead = diod_fetch_readahead (aname);
+    f->writebehind = diod_fetch_writebehind (aname);
     if (stat (path_s (f->path), &sb) < 0) { /* OK to follow symbolic links */
         np_uerror (errno);
         goto error;
@@ -373,61 +440,30 @@ error:
     return 0;
 }
 
-/* Special stat for a mount point that fixes up st_dev and st_ino
- * to be what should be "underneath" the mount.
+/* lstat 'path' through the attribute cache, if enabled for the export.
  */
 static int
-_statmnt (char *path, struct stat *sb)
+_lstat_cached (Npfid *fid, Path path, struct stat *sb)
 {
-    DIR *dir = NULL;
-    struct stat sbp;
-    struct dirent dbuf, *dp;
-    char *ppath = NULL;
-    int plen = strlen (path) + 4;
+    Fid *f = fid->aux;
     char *name;
-    int err;
-
-    if (stat (path, sb) < 0) {
-        np_uerror (errno);
-        goto error;
-    }
-    if (!(ppath = malloc (plen))) {
-        np_uerror (ENOMEM);
-        goto error;
-    }
-    snprintf (ppath, plen, "%s/..", path);
-    if (stat (ppath, &sbp) < 0) {
-        np_uerror (errno);
-        goto error;
-    }
-    if (!(dir = opendir (ppath))) {
-        np_uerror (errno);
-        goto error;
-    }
-    name = strrchr (path, '/');
-    name = name ? name + 1 : path;
-    do {
-        err = readdir_r (dir, &dbuf, &dp);
-        if (err > 0) {
-            np_uerror (err);
-            goto error;
-        }
-    } while (dp != NULL && strcmp (name, dp->d_name) != 0);
-    if (!dp) {
-        np_uerror (ENOENT);
-        goto error;
-    }
-    sb->st_dev = sbp.st_dev;
-    sb->st_ino = dp->d_ino;
-    (void)closedir (dir);
-    free (ppath);
+    int n, dirfd, saved_errno;
+
+    if (f->attrttl > 0) {
+        n = acache_lookup (path_s (path), fid->user->uid, sb);
+        if (n != 0)
+            return n > 0 ? 0 : -1;
+    }
+    dirfd = path_at (path, &name);
+    if (fstatat (dirfd, name, sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        saved_errno = errno;
+        if (errno == ENOENT)
+            acache_insert (path_s (path), fid->user->uid, f->attrttl, NULL);
+        errno = saved_errno;
+        return -1;
+    }
+    acache_insert (path_s (path), fid->user->uid, f->attrttl, sb);
     return 0;
-error:
-    if (ppath)
-        free (ppath);
-    if (dir)
-        (void)closedir (dir);
-    return -1;
 }
 
 /* Twalk - walk a file path
@@ -439,8 +475,11 @@ diod_walk (Npfid *fid, Npstr* wname, Npqid *wqid)
 {
     Npsrv *srv = fid->conn->srv;
     Fid *f = fid->aux;
-    struct stat sb, sb2;
+    struct stat sb;
     Path npath = NULL;
+    char *name;
+    dev_t pdev;
+    int dirfd;
 
     if (f->ioctx != NULL) {
         np_uerror (EBADF);
@@ -454,19 +493,21 @@ diod_walk (Npfid *fid, Npstr* wname, Npqid *wqid)
         np_uerror (ENOMEM);
         goto error;
     }
-    if (lstat (path_s (npath), &sb) < 0) {
+    if (_lstat_cached (fid, npath, &sb) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
-    if (stat (path_s (f->path), &sb2) < 0) {
+    if (path_dirdev (f->path, &pdev) < 0) {
         np_uerror (errno);
         goto error;
     }
-    if (sb.st_dev != sb2.st_dev) {
-        if (_statmnt (path_s (npath), &sb) < 0)
+    if (sb.st_dev != pdev) {
+        dirfd = path_at (npath, &name);
+        if (mnt_covered (dirfd, name, path_s (npath), &sb) < 0)
             goto error;
         f->flags |= DIOD_FID_FLAGS_MOUNTPT;
     }
+    path_revalidate (npath, &sb);
     path_decref (srv, f->path);
     f->path = npath;
     diod_ustat2qid (&sb, wqid);
@@ -495,6 +536,22 @@ diod_read (Npfid *fid, u64 offset, u32 count, Npreq *req)
         np_uerror (EBADF);
         goto error;
     }
+    if (!(f->flags & DIOD_FID_FLAGS_XATTR)) {
+        ioctx_flush_path (f->path);
+        if ((ret = ioctx_cached_rread (f->ioctx, fid->conn, count, offset)))
+            return ret;
+        if (np_rerror () != EOPNOTSUPP)
+            goto error_quiet;
+        np_uerror (0);
+        ioctx_stream (f->ioctx, offset, count);
+    }
+    if (!(f->flags & DIOD_FID_FLAGS_XATTR) && count >= DIOD_SPLICE_MIN) {
+        if ((ret = ioctx_splice_rread (f->ioctx, fid->conn, count, offset)))
+            return ret;
+        if (np_rerror () != EOPNOTSUPP)
+            goto error_quiet;
+        np_uerror (0);
+    }
     if (!(ret = np_alloc_rread (count))) {
         np_uerror (ENOMEM);
         goto error;
@@ -527,12 +584,33 @@ diod_write (Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
     Fid *f = fid->aux;
     Npfcall *ret;
     ssize_t n;
+    u8 *buf = NULL;
 
     if (!f->ioctx && !(f->flags & DIOD_FID_FLAGS_XATTR)) {
         msg ("diod_write: fid is not open");
         np_uerror (EBADF);
         goto error;
     }
+    /* Payload may have been left in a pipe by the transport
+     * (SRV_FLAGS_SPLICEWRITE).  Splice it to the file, or copy it out.
+     */
+    if (req->tcall->pipe) {
+        if (!(f->flags & DIOD_FID_FLAGS_XATTR)) {
+            n = ioctx_splice_write (f->ioctx, req->tcall, offset);
+            if (n >= 0)
+                goto done;
+            if (np_rerror () != EOPNOTSUPP)
+                goto error_quiet;
+            np_uerror (0);
+        }
+        if (!(buf = malloc (count))) {
+            np_uerror (ENOMEM);
+            goto error;
+        }
+        if (np_twrite_copyout (req->tcall, buf) < 0)
+            goto error;
+        data = buf;
+    }
     if (f->flags & DIOD_FID_FLAGS_XATTR)
         n = xattr_pwrite (f->xattr, data, count, offset);
     else
@@ -541,16 +619,25 @@ diod_write (Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
         np_uerror (errno);
         goto error_quiet;
     }
+done:
+    if (f->ioctx) {
+        acache_inval_ino (ioctx_dev (f->ioctx), ioctx_qid (f->ioctx)->path);
+        fcache_inval_ino (ioctx_dev (f->ioctx), ioctx_qid (f->ioctx)->path);
+    }
     if (!(ret = np_create_rwrite (n))) {
         np_uerror (ENOMEM);
         goto error;
     }
+    if (buf)
+        free (buf);
     return ret;
 error:
     errn (np_rerror (), "diod_write %s@%s:%s",
           fid->user->uname, np_conn_get_client_id (fid->conn),
           path_s (f->path));
 error_quiet:
+    if (buf)
+        free (buf);
     return NULL;
 }
 
@@ -589,11 +676,17 @@ diod_remove (Npfid *fid)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
+    char *name;
+    int dirfd = path_at (f->path, &name);
 
-    if (remove (path_s (f->path)) < 0) {
-        np_uerror (errno);
-        goto error_quiet;
+    if (unlinkat (dirfd, name, 0) < 0) {
+        if (errno != EISDIR || unlinkat (dirfd, name, AT_REMOVEDIR) < 0) {
+            np_uerror (errno);
+            goto error_quiet;
+        }
     }
+    ioctx_cache_inval (fid->conn->srv, f->path, 1);
+    acache_inval (path_s (f->path));
     if (!(ret = np_create_rremove ())) {
         np_uerror (ENOMEM);
         goto error;
@@ -719,10 +812,6 @@ diod_lopen (Npfid *fid, u32 flags)
 
     flags = _remap_oflags (flags);
 
-    if (flags & O_DIRECT) {
-        np_uerror (EINVAL); /* O_DIRECT not allowed - see issue 110 */
-        goto error_quiet;
-    }
     if ((flags & O_CREAT)) /* can't happen? */
         flags &= ~O_CREAT; /* clear and allow to fail with ENOENT */
 
@@ -736,8 +825,10 @@ diod_lopen (Npfid *fid, u32 flags)
             goto error;
         goto error_quiet;
     }
+    if ((flags & O_TRUNC))
+        acache_inval (path_s (f->path));
     if (!(res = np_create_rlopen (ioctx_qid (f->ioctx),
-                                  ioctx_iounit (f->ioctx)))) {
+                                  ioctx_iounit (f->ioctx, fid->conn->msize)))) {
         (void)ioctx_close (fid, 0);
         np_uerror (ENOMEM);
         goto error;
@@ -758,13 +849,11 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
     Fid *f = fid->aux;
     Npfcall *ret;
     Path opath = NULL;
+    char *cname;
+    int dirfd;
 
     flags = _remap_oflags (flags);
 
-    if (flags & O_DIRECT) {
-        np_uerror (EINVAL); /* O_DIRECT not allowed - see issue 110 */
-        goto error_quiet;
-    }
     if (!(flags & O_CREAT)) /* can't happen? */
         flags |= O_CREAT;
 
@@ -783,10 +872,12 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
             goto error;
         goto error_quiet;
     }
+    acache_inval (path_s (f->path));
     if (!((ret = np_create_rlcreate (ioctx_qid (f->ioctx),
-                                     ioctx_iounit (f->ioctx))))) {
+                                     ioctx_iounit (f->ioctx, fid->conn->msize))))) {
         (void)ioctx_close (fid, 0);
-        (void)unlink (path_s (f->path));
+        dirfd = path_at (f->path, &cname);
+        (void)unlinkat (dirfd, cname, 0);
         np_uerror (ENOMEM);
         goto error;
     }
@@ -815,6 +906,8 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
     Path npath = NULL;
     Npqid qid;
     struct stat sb;
+    char *cname;
+    int dirfd;
 
     if (!(npath = path_append (srv, f->path, name))) {
         np_uerror (ENOMEM);
@@ -824,14 +917,16 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
         np_uerror (ENOMEM);
         goto error;
     }
-    if (symlink (target, path_s (npath)) < 0 || lstat (path_s (npath),
-                                                       &sb) < 0) {
+    dirfd = path_at (npath, &cname);
+    if (symlinkat (target, dirfd, cname) < 0
+            || fstatat (dirfd, cname, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    acache_inval (path_s (npath));
     diod_ustat2qid (&sb, &qid);
     if (!((ret = np_create_rsymlink (&qid)))) {
-        (void)unlink (path_s (npath));
+        (void)unlinkat (dirfd, cname, 0);
         np_uerror (ENOMEM);
         goto error;
     }
@@ -859,19 +954,23 @@ diod_mknod(Npfid *fid, Npstr *name, u32 mode, u32 major, u32 minor, u32 gid)
     Path npath = NULL;
     Npqid qid;
     struct stat sb;
+    char *cname;
+    int dirfd;
 
     if (!(npath = path_append (srv, f->path, name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (mknod (path_s (npath), mode, makedev (major, minor)) < 0
-                                        || lstat (path_s (npath), &sb) < 0) {
+    dirfd = path_at (npath, &cname);
+    if (mknodat (dirfd, cname, mode, makedev (major, minor)) < 0
+            || fstatat (dirfd, cname, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    acache_inval (path_s (npath));
     diod_ustat2qid (&sb, &qid);
     if (!((ret = np_create_rmknod (&qid)))) {
-        (void)unlink (path_s (npath));
+        (void)unlinkat (dirfd, cname, 0);
         np_uerror (ENOMEM);
         goto error;
     }
@@ -887,6 +986,20 @@ error_quiet:
     return NULL;
 }
 
+/* After (odirfd, oname) was renamed, carry pool entries for 'opath' and
+ * its descendants over to 'npath'.  If the old name still exists, both
+ * were links to the same file and rename(2) did nothing.
+ */
+static void
+_rename_paths (Npsrv *srv, Path opath, Path npath, int odirfd, char *oname)
+{
+    struct stat sb;
+
+    if (fstatat (odirfd, oname, &sb, AT_SYMLINK_NOFOLLOW) < 0
+                                                    && errno == ENOENT)
+        path_rename (srv, opath, npath);
+}
+
 /* Trename - rename a file, potentially to another directory
  */
 Npfcall*
@@ -895,33 +1008,46 @@ diod_rename (Npfid *fid, Npfid *dfid, Npstr *name)
     Npsrv *srv = fid->conn->srv;
     Fid *f = fid->aux;
     Fid *d = dfid->aux;
-    Npfcall *ret;
+    Npfcall *ret = NULL;
     Path npath = NULL;
-    int renamed = 0;
+    char *oname, *nname;
+    int odirfd, ndirfd;
 
     if (!(npath = path_append (srv, d->path, name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (rename (path_s (f->path), path_s (npath)) < 0) {
-        np_uerror (errno);
-        goto error_quiet;
-    }
-    renamed = 1;
+    /* Allocate the reply first, as a rename that replaced name
+     * cannot be undone.
+     */
     if (!(ret = np_create_rrename ())) {
         np_uerror (ENOMEM);
         goto error;
     }
-    path_decref (srv, f->path);
-    f->path = npath;
+    odirfd = path_at (f->path, &oname);
+    ndirfd = path_at (npath, &nname);
+    if (renameat (odirfd, oname, ndirfd, nname) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    ioctx_cache_inval (srv, f->path, 0);
+    ioctx_cache_inval (srv, npath, 1);
+    acache_inval_tree (path_s (f->path));
+    acache_inval_tree (path_s (npath));
+    _rename_paths (srv, f->path, npath, odirfd, oname);
+    if (strcmp (path_s (f->path), path_s (npath)) != 0) {
+        path_decref (srv, f->path);
+        f->path = npath;
+    } else
+        path_decref (srv, npath);
     return ret;
 error:
     errn (np_rerror (), "diod_rename %s@%s:%s to %s/%.*s",
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           path_s (d->path), name->len, name->str);
 error_quiet:
-    if (renamed && npath)
-        (void)rename (path_s (npath), path_s (f->path));
+    if (ret)
+        free (ret);
     if (npath)
         path_decref (srv, npath);
     return NULL;
@@ -933,9 +1059,10 @@ diod_readlink(Npfid *fid)
     Fid *f = fid->aux;
     Npfcall *ret;
     char target[PATH_MAX + 1];
-    int n;
+    char *name;
+    int n, dirfd = path_at (f->path, &name);
 
-    if ((n = readlink (path_s (f->path), target, sizeof(target) - 1)) < 0) {
+    if ((n = readlinkat (dirfd, name, target, sizeof(target) - 1)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
@@ -953,61 +1080,277 @@ error_quiet:
     return NULL;
 }
 
+#if !HAVE_UTIMENSAT
 static int
 _lstat (Fid *f, struct stat *sb)
 {
+    char *name;
+    int dirfd;
+
     if (f->ioctx != NULL) {
         return ioctx_stat(f->ioctx, sb);
     }
-    return lstat(path_s (f->path), sb);
+    dirfd = path_at (f->path, &name);
+    return fstatat (dirfd, name, sb, AT_SYMLINK_NOFOLLOW);
 }
+#endif
 
 
+/* Attributes for Rgetattr: a struct stat plus what statx(2) adds.
+ */
+typedef struct {
+    struct stat sb;
+    u64 valid;          /* P9_STAT_* bits filled in */
+    u64 btime_sec;
+    u64 btime_nsec;
+    u64 data_version;
+} Attr;
+
+#if HAVE_STATX
+static unsigned int
+_p9mask2statx (u64 mask)
+{
+    /* qid.version is derived from mtime and size, so they are always
+     * fetched, or it would differ from what walk and open report.
+     */
+    unsigned int m = STATX_TYPE | STATX_INO | STATX_MTIME | STATX_SIZE;
+
+    if ((mask & P9_STAT_MODE))
+        m |= STATX_MODE;
+    if ((mask & P9_STAT_NLINK))
+        m |= STATX_NLINK;
+    if ((mask & P9_STAT_UID))
+        m |= STATX_UID;
+    if ((mask & P9_STAT_GID))
+        m |= STATX_GID;
+    if ((mask & P9_STAT_ATIME))
+        m |= STATX_ATIME;
+    if ((mask & (P9_STAT_CTIME | P9_STAT_DATA_VERSION)))
+        m |= STATX_CTIME;
+    if ((mask & P9_STAT_BLOCKS))
+        m |= STATX_BLOCKS;
+    if ((mask & P9_STAT_BTIME))
+        m |= STATX_BTIME;
+    return m;
+}
+
+static u64
+_statx2p9mask (unsigned int m)
+{
+    u64 mask = 0;
+
+    if ((m & STATX_TYPE) && (m & STATX_MODE))
+        mask |= P9_STAT_MODE;
+    if ((m & STATX_TYPE))
+        mask |= P9_STAT_RDEV;
+    if ((m & STATX_NLINK))
+        mask |= P9_STAT_NLINK;
+    if ((m & STATX_UID))
+        mask |= P9_STAT_UID;
+    if ((m & STATX_GID))
+        mask |= P9_STAT_GID;
+    if ((m & STATX_ATIME))
+        mask |= P9_STAT_ATIME;
+    if ((m & STATX_MTIME))
+        mask |= P9_STAT_MTIME;
+    if ((m & STATX_CTIME))
+        mask |= P9_STAT_CTIME;
+    if ((m & STATX_INO))
+        mask |= P9_STAT_INO;
+    if ((m & STATX_SIZE))
+        mask |= P9_STAT_SIZE;
+    if ((m & STATX_BLOCKS))
+        mask |= P9_STAT_BLOCKS;
+    if ((m & STATX_BTIME))
+        mask |= P9_STAT_BTIME;
+    return mask;
+}
+
+static void
+_statx2attr (struct statx *stx, u64 request_mask, Attr *a)
+{
+    struct stat *sb = &a->sb;
+
+    memset (sb, 0, sizeof (*sb));
+    sb->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_ino = stx->stx_ino;
+    sb->st_mode = stx->stx_mode;
+    sb->st_nlink = stx->stx_nlink;
+    sb->st_uid = stx->stx_uid;
+    sb->st_gid = stx->stx_gid;
+    sb->st_rdev = makedev (stx->stx_rdev_major, stx->stx_rdev_minor);
+    sb->st_size = stx->stx_size;
+    sb->st_blksize = stx->stx_blksize;
+    sb->st_blocks = stx->stx_blocks;
+    sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+
+    a->valid = _statx2p9mask (stx->stx_mask);
+    a->btime_sec = a->btime_nsec = 0;
+    if ((a->valid & P9_STAT_BTIME)) {
+        a->btime_sec = stx->stx_btime.tv_sec;
+        a->btime_nsec = stx->stx_btime.tv_nsec;
+    }
+    /* ctime changes on every data or metadata change, so serves as a
+     * change attribute where the file system offers nothing better.
+     */
+    a->data_version = 0;
+    if ((request_mask & P9_STAT_DATA_VERSION) && (a->valid & P9_STAT_CTIME)) {
+        a->data_version = (u64)stx->stx_ctime.tv_sec * 1000000000ULL
+                        + stx->stx_ctime.tv_nsec;
+        a->valid |= P9_STAT_DATA_VERSION;
+    }
+}
+
+/* The backing file system may have to sync to report size and times
+ * accurately, e.g. Lustre OSTs require glimpse locks.  Every request needs
+ * mtime and size for the qid, so only the attrnosync export option gets
+ * AT_STATX_DONT_SYNC.
+ */
+static int
+_statx_sync (Fid *f)
+{
+    if ((f->flags & DIOD_FID_FLAGS_ATTRSYNC))
+        return AT_STATX_FORCE_SYNC;
+    if ((f->flags & DIOD_FID_FLAGS_ATTRNOSYNC))
+        return AT_STATX_DONT_SYNC;
+    return AT_STATX_SYNC_AS_STAT;
+}
+#endif
+
+/* Get attributes of (dirfd, name), or of the open file if name is NULL,
+ * fetching only what 'request_mask' asks for where statx(2) allows.
+ */
+static int
+_getattr (Fid *f, int dirfd, char *name, int flags, u64 request_mask,
+          Attr *a)
+{
+    int rc;
+#if HAVE_STATX
+    struct statx stx;
+    unsigned int mask = _p9mask2statx (request_mask);
+
+    flags |= _statx_sync (f);
+    if (name)
+        rc = statx (dirfd, name, flags, mask, &stx);
+    else
+        rc = ioctx_statx (f->ioctx, flags, mask, &stx);
+    if (rc == 0) {
+        _statx2attr (&stx, request_mask, a);
+        return 0;
+    }
+    if (errno != ENOSYS)
+        return -1;
+    flags &= ~AT_STATX_SYNC_TYPE;
+#endif
+    if (name)
+        rc = fstatat (dirfd, name, &a->sb, flags);
+    else
+        rc = ioctx_stat (f->ioctx, &a->sb);
+    if (rc < 0)
+        return -1;
+    a->valid = P9_STAT_BASIC;
+    a->btime_sec = a->btime_nsec = 0;
+    a->data_version = 0;
+    return 0;
+}
+
+/* As _getattr () for a fid that is not open, going through the attribute
+ * cache.  Only complete results are cached.
+ */
+static int
+_getattr_cached (Npfid *fid, u64 request_mask, Attr *a)
+{
+    Fid *f = fid->aux;
+    char *name;
+    int n, dirfd, saved_errno;
+
+    if (f->attrttl > 0) {
+        n = acache_lookup (path_s (f->path), fid->user->uid, &a->sb);
+        if (n < 0)
+            return -1;
+        if (n > 0) {
+            a->valid = P9_STAT_BASIC;
+            a->btime_sec = a->btime_nsec = 0;
+            a->data_version = 0;
+            return 0;
+        }
+    }
+    dirfd = path_at (f->path, &name);
+    if (_getattr (f, dirfd, name, AT_SYMLINK_NOFOLLOW, request_mask, a) < 0) {
+        saved_errno = errno;
+        if (errno == ENOENT && f->attrttl > 0)
+            acache_insert (path_s (f->path), fid->user->uid, f->attrttl, NULL);
+        errno = saved_errno;
+        return -1;
+    }
+    if (f->attrttl > 0 && (a->valid & P9_STAT_BASIC) == P9_STAT_BASIC)
+        acache_insert (path_s (f->path), fid->user->uid, f->attrttl, &a->sb);
+    return 0;
+}
+
 Npfcall*
 diod_getattr(Npfid *fid, u64 request_mask)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
     Npqid qid;
-    struct stat sb;
+    Attr a;
+    struct stat *sb = &a.sb;
+    char *name;
+    int dirfd;
 
+    ioctx_flush_path (f->path);
     if ((f->flags & DIOD_FID_FLAGS_MOUNTPT)) {
-        if (_statmnt (path_s (f->path), &sb) < 0) {
+        dirfd = path_at (f->path, &name);
+        if (_getattr (f, dirfd, name, 0, request_mask, &a) < 0) {
+            np_uerror (errno);
+            goto error_quiet;
+        }
+        if (mnt_covered (dirfd, name, path_s (f->path), sb) < 0)
+            goto error_quiet;
+    } else if (f->ioctx == NULL) {
+        if (_getattr_cached (fid, request_mask, &a) < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
     } else {
-        if (_lstat (f, &sb) < 0) {
+        if (_getattr (f, -1, NULL, 0, request_mask, &a) < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
     }
-    diod_ustat2qid (&sb, &qid);
-    if (!(ret = np_create_rgetattr(request_mask, &qid,
-                                    sb.st_mode,
-                                    sb.st_uid,
-                                    sb.st_gid,
-                                    sb.st_nlink,
-                                    sb.st_rdev,
-                                    sb.st_size,
-                                    sb.st_blksize,
-                                    sb.st_blocks,
+    diod_ustat2qid (sb, &qid);
+    if (!(ret = np_create_rgetattr(a.valid, &qid,
+                                    sb->st_mode,
+                                    sb->st_uid,
+                                    sb->st_gid,
+                                    sb->st_nlink,
+                                    sb->st_rdev,
+                                    sb->st_size,
+                                    sb->st_blksize,
+                                    sb->st_blocks,
 #ifdef __APPLE__
-                                    sb.st_atimespec.tv_sec,
-                                    sb.st_atimespec.tv_nsec,
-                                    sb.st_mtimespec.tv_sec,
-                                    sb.st_mtimespec.tv_nsec,
-                                    sb.st_ctimespec.tv_sec,
-                                    sb.st_ctimespec.tv_nsec,
+                                    sb->st_atimespec.tv_sec,
+                                    sb->st_atimespec.tv_nsec,
+                                    sb->st_mtimespec.tv_sec,
+                                    sb->st_mtimespec.tv_nsec,
+                                    sb->st_ctimespec.tv_sec,
+                                    sb->st_ctimespec.tv_nsec,
 #else
-                                    sb.st_atim.tv_sec,
-                                    sb.st_atim.tv_nsec,
-                                    sb.st_mtim.tv_sec,
-                                    sb.st_mtim.tv_nsec,
-                                    sb.st_ctim.tv_sec,
-                                    sb.st_ctim.tv_nsec,
+                                    sb->st_atim.tv_sec,
+                                    sb->st_atim.tv_nsec,
+                                    sb->st_mtim.tv_sec,
+                                    sb->st_mtim.tv_nsec,
+                                    sb->st_ctim.tv_sec,
+                                    sb->st_ctim.tv_nsec,
 #endif
-                                    0, 0, 0, 0))) {
+                                    a.btime_sec, a.btime_nsec,
+                                    0, a.data_version))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -1023,19 +1366,27 @@ error_quiet:
 static int
 _chmod (Fid *f, u32 mode)
 {
+    char *name;
+    int dirfd;
+
     if (f->ioctx != NULL) {
         return ioctx_chmod (f->ioctx, mode);
     }
-    return chmod (path_s (f->path), mode);
+    dirfd = path_at (f->path, &name);
+    return fchmodat (dirfd, name, mode, 0);
 }
 
 static int
 _lchown (Fid *f, u32 uid, u32 gid)
 {
+    char *name;
+    int dirfd;
+
     if (f->ioctx != NULL) {
         return ioctx_chown (f->ioctx, uid, gid);
     }
-    return lchown (path_s (f->path), uid, gid);
+    dirfd = path_at (f->path, &name);
+    return fchownat (dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
 }
 
 static int
@@ -1051,10 +1402,14 @@ _truncate (Fid *f, u64 size)
 static int
 _utimensat (Fid *f, const struct timespec ts[2], int flags)
 {
+    char *name;
+    int dirfd;
+
     if (f->ioctx != NULL) {
         return ioctx_utimensat (f->ioctx, ts, flags);
     }
-    return utimensat (-1, path_s (f->path), ts, flags);
+    dirfd = path_at (f->path, &name);
+    return utimensat (dirfd, name, ts, flags);
 }
 #else /* HAVE_UTIMENSAT */
 static int
@@ -1067,6 +1422,21 @@ _utimens (Fid *f, const struct utimbuf *times)
 }
 #endif
 
+/* Drop cached attributes of a fid's file after changing them.
+ */
+static void
+_inval_attr (Npfid *fid)
+{
+    Fid *f = fid->aux;
+
+    ioctx_cache_inval (fid->conn->srv, f->path, 0);
+    acache_inval (path_s (f->path));
+    if (f->ioctx) {
+        acache_inval_ino (ioctx_dev (f->ioctx), ioctx_qid (f->ioctx)->path);
+        fcache_inval_ino (ioctx_dev (f->ioctx), ioctx_qid (f->ioctx)->path);
+    }
+}
+
 Npfcall*
 diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
               u64 atime_sec, u64 atime_nsec, u64 mtime_sec, u64 mtime_nsec)
@@ -1075,6 +1445,7 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
     Fid *f = fid->aux;
     int ctime_updated = 0;
 
+    ioctx_flush_path (f->path);
     if ((valid & P9_ATTR_MODE)) { /* N.B. derefs symlinks */
         if (_chmod (f, mode) < 0) {
             np_uerror(errno);
@@ -1176,6 +1547,7 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
             goto error_quiet;
         }
     }
+    _inval_attr (fid);
     if (!(ret = np_create_rsetattr())) {
         np_uerror (ENOMEM);
         goto error;
@@ -1186,6 +1558,7 @@ error:
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           valid);
 error_quiet:
+    _inval_attr (fid); /* some attributes may have been changed */
     return NULL;
 }
 
@@ -1195,11 +1568,10 @@ _copy_dirent_linux (Fid *f, struct diod_dirent *dp, u8 *buf, u32 buflen)
     Npqid qid;
     u32 ret = 0;
 
-    if (dp->dir_entry.d_type == DT_UNKNOWN) {
-        char path[PATH_MAX + 1];
+    if (dp->d_type == DT_UNKNOWN) {
         struct stat sb;
-        snprintf (path, sizeof(path), "%s/%s", path_s (f->path), dp->dir_entry.d_name);
-        if (lstat (path, &sb) < 0) {
+
+        if (ioctx_fstatat (f->ioctx, dp->d_name, &sb) < 0) {
             np_uerror (errno);
             goto done;
         }
@@ -1207,41 +1579,241 @@ _copy_dirent_linux (Fid *f, struct diod_dirent *dp, u8 *buf, u32 buflen)
     } else  {
         _dirent2qid (dp, &qid);
     }
-    ret = np_serialize_p9dirent(&qid, dp->d_off, dp->dir_entry.d_type,
-                                      dp->dir_entry.d_name, buf, buflen);
+    ret = np_serialize_p9dirent(&qid, dp->d_off, dp->d_type,
+                                      dp->d_name, buf, buflen);
 done:
     return ret;
 }
 
+static void
+_ustat2rgetattr (struct stat *sb, u64 request_mask, struct p9_rgetattr *attr)
+{
+    memset (attr, 0, sizeof (*attr));
+    attr->valid = request_mask & P9_STAT_BASIC;
+    diod_ustat2qid (sb, &attr->qid);
+    attr->mode = sb->st_mode;
+    attr->uid = sb->st_uid;
+    attr->gid = sb->st_gid;
+    attr->nlink = sb->st_nlink;
+    attr->rdev = sb->st_rdev;
+    attr->size = sb->st_size;
+    attr->blksize = sb->st_blksize;
+    attr->blocks = sb->st_blocks;
+#ifdef __APPLE__
+    attr->atime_sec = sb->st_atimespec.tv_sec;
+    attr->atime_nsec = sb->st_atimespec.tv_nsec;
+    attr->mtime_sec = sb->st_mtimespec.tv_sec;
+    attr->mtime_nsec = sb->st_mtimespec.tv_nsec;
+    attr->ctime_sec = sb->st_ctimespec.tv_sec;
+    attr->ctime_nsec = sb->st_ctimespec.tv_nsec;
+#else
+    attr->atime_sec = sb->st_atim.tv_sec;
+    attr->atime_nsec = sb->st_atim.tv_nsec;
+    attr->mtime_sec = sb->st_mtim.tv_sec;
+    attr->mtime_nsec = sb->st_mtim.tv_nsec;
+    attr->ctime_sec = sb->st_ctim.tv_sec;
+    attr->ctime_nsec = sb->st_ctim.tv_nsec;
+#endif
+}
+
+/* A mount point entry reports the inode the mount covers, as walk
+ * does, so readdirplus and walk+getattr agree on its qid.
+ */
+static int
+_direntplus_covered (Fid *f, struct diod_dirent *dp, struct stat *sb)
+{
+    char *path, *name;
+    int len, dirfd, rc;
+
+    len = strlen (path_s (f->path)) + strlen (dp->d_name) + 2;
+    if (!(path = malloc (len))) {
+        np_uerror (ENOMEM);
+        return -1;
+    }
+    snprintf (path, len, "%s/%s", path_s (f->path), dp->d_name);
+    if ((dirfd = path_dirfd (f->path)) >= 0)
+        name = dp->d_name;
+    else {
+        dirfd = AT_FDCWD;
+        name = path;
+    }
+    rc = mnt_covered (dirfd, name, path, sb);
+    free (path);
+    return rc;
+}
+
+/* Like _copy_dirent_linux () but with the entry's attributes, as
+ * getattr would return them, fetched with fstatat () on the directory
+ * once any writes to the entry buffered by write-behind are flushed.
+ * An entry that cannot be stat'd (it vanished since getdents, or the
+ * directory is not searchable), or a mount point whose covered inode
+ * cannot be found, is returned with valid=0 and whatever qid the dirent
+ * alone provides.
+ */
 static u32
-_read_dir_linux (Fid *f, u8* buf, u64 offset, u32 count)
+_copy_direntplus_linux (Npsrv *srv, Fid *f, struct diod_dirent *dp,
+                        u64 request_mask, u8 *buf, u32 buflen)
 {
-    struct diod_dirent dbuf, *dp;
-    int i, n = 0, err;
+    struct p9_rgetattr attr;
+    struct stat sb;
+    Npqid qid;
+    int rc;
+
+    ioctx_flush_child (srv, f->path, dp->d_name);
+    rc = ioctx_fstatat (f->ioctx, dp->d_name, &sb);
+    if (rc == 0 && sb.st_dev != ioctx_dev (f->ioctx)
+                && strcmp (dp->d_name, ".") && strcmp (dp->d_name, "..")) {
+        if ((rc = _direntplus_covered (f, dp, &sb)) < 0)
+            np_uerror (0);
+    }
+    if (rc < 0) {
+        memset (&attr, 0, sizeof (attr));
+        if (dp->d_type == DT_UNKNOWN) {
+            qid.path = dp->d_ino;
+            qid.version = 0;
+            qid.type = 0;
+        } else
+            _dirent2qid (dp, &qid);
+    } else {
+        _ustat2rgetattr (&sb, request_mask, &attr);
+        qid = attr.qid;
+    }
+    return np_serialize_p9direntplus (&qid, dp->d_off, dp->d_type,
+                                      dp->d_name, &attr, buf, buflen);
+}
 
-    if (offset == 0)
-        ioctx_rewinddir (f->ioctx);
-    else
-        ioctx_seekdir (f->ioctx, offset);
-    do {
-        err = ioctx_readdir_r (f->ioctx, &dbuf, &dp);
-        if (err > 0) {
-            np_uerror (err);
+/* Fill 'buf' with entries from a batch of raw entries read by
+ * ioctx_getdents ().  Returns bytes used, and stops early, with
+ * *fullp set, if 'buf' fills.  *offsetp is advanced past each
+ * entry consumed.  If 'plus' is set, entries carry attributes.
+ */
+static u32
+_copy_dirents_linux (Npsrv *srv, Fid *f, u8 *dbuf, int dlen, u8 *buf,
+                     u32 count, int plus, u64 request_mask, u64 *offsetp,
+                     int *fullp)
+{
+    struct diod_dirent *dp;
+    u32 i, n = 0;
+    int pos;
+
+    for (pos = 0; pos < dlen; pos += dp->d_reclen) {
+        dp = (struct diod_dirent *)(dbuf + pos);
+        if ((f->flags & DIOD_FID_FLAGS_MOUNTPT) && strcmp (dp->d_name, ".")
+                                                && strcmp (dp->d_name, "..")) {
+            *offsetp = dp->d_off;
+            continue;
+        }
+        if (plus)
+            i = _copy_direntplus_linux (srv, f, dp, request_mask,
+                                        buf + n, count - n);
+        else
+            i = _copy_dirent_linux (f, dp, buf + n, count - n);
+        if (i == 0) {
+            *fullp = 1;
             break;
         }
-        if (err == 0 && dp == NULL)
+        n += i;
+        *offsetp = dp->d_off;
+    }
+    return n;
+}
+
+static u32
+_read_dir_linux (Npsrv *srv, Fid *f, u8* buf, u64 offset, u32 count,
+                 int plus, u64 request_mask)
+{
+    int dlen, dsize = count < DIOD_DIRBUF_MIN ? DIOD_DIRBUF_MIN : count;
+    int full = 0;
+    u8 *dbuf;
+    u32 n = 0;
+
+    if (!(dbuf = malloc (dsize))) {
+        np_uerror (ENOMEM);
+        return 0;
+    }
+    while (!full && n < count) {
+        if ((dlen = ioctx_getdents (f->ioctx, offset, dbuf, dsize)) < 0) {
+            np_uerror (errno);
             break;
-        if ((f->flags & DIOD_FID_FLAGS_MOUNTPT) && strcmp (dp->dir_entry.d_name, ".")
-                                                && strcmp (dp->dir_entry.d_name, ".."))
-                continue;
-        i = _copy_dirent_linux (f, dp, buf + n, count - n);
-        if (i == 0)
+        }
+        if (dlen == 0)
             break;
-        n += i;
-    } while (n < count);
+        n += _copy_dirents_linux (srv, f, dbuf, dlen, buf + n, count - n,
+                                  plus, request_mask, &offset, &full);
+        if (np_rerror ())
+            break;
+    }
+    free (dbuf);
     return n;
 }
 
+/* Enumerate the whole directory into snapshot 's'.
+ */
+static int
+_build_dir_snap (Fid *f, DSnap s)
+{
+    u8 *dbuf, rec[DIOD_DIRENT_MAX];
+    struct diod_dirent *dp;
+    int dlen, pos, len, rc = -1;
+    u64 offset = 0;
+
+    if (!(dbuf = malloc (DIOD_DIRBUF_SNAP)))
+        return -1;
+    while ((dlen = ioctx_getdents (f->ioctx, offset, dbuf,
+                                   DIOD_DIRBUF_SNAP)) > 0) {
+        for (pos = 0; pos < dlen; pos += dp->d_reclen) {
+            dp = (struct diod_dirent *)(dbuf + pos);
+            if ((len = _copy_dirent_linux (f, dp, rec, sizeof (rec))) == 0)
+                goto done;
+            if (dcache_append (s, rec, len, dp->d_off) < 0)
+                goto done;
+            offset = dp->d_off;
+        }
+    }
+    if (dlen == 0)
+        rc = 0;
+done:
+    np_uerror (0); /* errors just mean no snapshot */
+    free (dbuf);
+    return rc;
+}
+
+/* Serve a readdir from the shared snapshot of the directory, taking one
+ * when a read starts at offset 0.  Returns -1 if the directory must be
+ * read directly.
+ */
+static int
+_read_dir_snap (Fid *f, u8* buf, u64 offset, u32 count)
+{
+    struct stat sb;
+    DSnap s;
+    int build;
+
+    if (offset == 0) {
+        if (f->dsnap) {
+            dcache_put (f->dsnap);
+            f->dsnap = NULL;
+        }
+        if (ioctx_stat (f->ioctx, &sb) < 0)
+            return -1;
+        if (!(s = dcache_lookup (&sb, f->dircache, &build)))
+            return -1;
+        if (build) {
+            if (_build_dir_snap (f, s) < 0) {
+                dcache_done (s, 0);
+                dcache_put (s);
+                return -1;
+            }
+            dcache_done (s, 1);
+        }
+        f->dsnap = s;
+        f->dsnapcur = 0;
+    }
+    if (!f->dsnap)
+        return -1;
+    return dcache_read (f->dsnap, offset, &f->dsnapcur, buf, count);
+}
+
 Npfcall*
 diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
 {
@@ -1258,7 +1830,13 @@ diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
         np_uerror (ENOMEM);
         goto error;
     }
-    n = _read_dir_linux (f, ret->u.rreaddir.data, offset, count);
+    n = -1;
+    if ((f->flags & DIOD_FID_FLAGS_DIRCACHE)
+                            && !(f->flags & DIOD_FID_FLAGS_MOUNTPT))
+        n = _read_dir_snap (f, ret->u.rreaddir.data, offset, count);
+    if (n < 0)
+        n = _read_dir_linux (fid->conn->srv, f, ret->u.rreaddir.data,
+                             offset, count, 0, 0);
     if (np_rerror ()) {
         free (ret);
         ret = NULL;
@@ -1272,6 +1850,41 @@ error:
     return NULL;
 }
 
+/* Readdir returning each entry with its attributes, so a client
+ * listing a directory need not walk and getattr every entry.
+ */
+Npfcall*
+diod_readdirplus(Npfid *fid, u64 offset, u32 count, u64 request_mask,
+                 Npreq *req)
+{
+    int n;
+    Fid *f = fid->aux;
+    Npfcall *ret;
+
+    if (!f->ioctx) {
+        msg ("diod_readdirplus: fid is not open");
+        np_uerror (EBADF);
+        goto error;
+    }
+    if (!(ret = np_create_rreaddirplus (count))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    n = _read_dir_linux (fid->conn->srv, f, ret->u.rreaddirplus.data,
+                         offset, count, 1, request_mask);
+    if (np_rerror ()) {
+        free (ret);
+        ret = NULL;
+    } else
+        np_finalize_rreaddirplus (ret, n);
+    return ret;
+error:
+    errn (np_rerror (), "diod_readdirplus %s@%s:%s",
+          fid->user->uname, np_conn_get_client_id (fid->conn),
+          path_s (f->path));
+    return NULL;
+}
+
 Npfcall*
 diod_fsync (Npfid *fid)
 {
@@ -1322,6 +1935,10 @@ diod_lock (Npfid *fid, u8 type, u32 flags, u64 start, u64 length, u32 proc_id,
         np_uerror (EBADF);
         goto error;
     }
+    if (ioctx_flush (f->ioctx) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
     switch (type) {
         case P9_LOCK_TYPE_UNLCK:
             if (ioctx_flock (f->ioctx, LOCK_UN) == 0)
@@ -1403,17 +2020,23 @@ diod_link (Npfid *dfid, Npfid *fid, Npstr *name)
     Npfcall *ret;
     Fid *df = dfid->aux;
     Path npath = NULL;
+    char *oname, *nname;
+    int odirfd, ndirfd;
 
     if (!(npath = path_append (srv, df->path, name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (link (path_s (f->path), path_s (npath)) < 0) {
+    odirfd = path_at (f->path, &oname);
+    ndirfd = path_at (npath, &nname);
+    if (linkat (odirfd, oname, ndirfd, nname, 0) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    acache_inval (path_s (f->path));
+    acache_inval (path_s (npath));
     if (!((ret = np_create_rlink ()))) {
-        (void)unlink (path_s (npath));
+        (void)unlinkat (ndirfd, nname, 0);
         np_uerror (ENOMEM);
         goto error;
     }
@@ -1438,18 +2061,23 @@ diod_mkdir (Npfid *fid, Npstr *name, u32 mode, u32 gid)
     Path npath = NULL;
     Npqid qid;
     struct stat sb;
+    char *cname;
+    int dirfd;
 
     if (!(npath = path_append (srv, f->path, name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (mkdir (path_s (npath), mode) < 0 || lstat (path_s (npath), &sb) < 0) {
+    dirfd = path_at (npath, &cname);
+    if (mkdirat (dirfd, cname, mode) < 0
+            || fstatat (dirfd, cname, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    acache_inval (path_s (npath));
     diod_ustat2qid (&sb, &qid);
     if (!((ret = np_create_rmkdir (&qid)))) {
-        (void)rmdir(path_s (npath));
+        (void)unlinkat (dirfd, cname, AT_REMOVEDIR);
         np_uerror (ENOMEM);
         goto error;
     }
@@ -1465,6 +2093,144 @@ error_quiet:
     return NULL;
 }
 
+/* Trenameat - rename a file relative to directory fids.
+ * Unlike Trename, the client need not walk a fid to the file first.
+ */
+Npfcall*
+diod_renameat (Npfid *olddirfid, Npstr *oldname,
+               Npfid *newdirfid, Npstr *newname)
+{
+    Npsrv *srv = olddirfid->conn->srv;
+    Fid *od = olddirfid->aux;
+    Fid *nd = newdirfid->aux;
+    Npfcall *ret = NULL;
+    Path opath = NULL, npath = NULL;
+    char *oname, *nname;
+    int odirfd, ndirfd;
+
+    if (!(opath = path_append (srv, od->path, oldname))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    if (!(npath = path_append (srv, nd->path, newname))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    /* Allocate the reply first, as a rename that replaced newname
+     * cannot be undone.
+     */
+    if (!(ret = np_create_rrenameat ())) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    odirfd = path_at (opath, &oname);
+    ndirfd = path_at (npath, &nname);
+    if (renameat (odirfd, oname, ndirfd, nname) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    ioctx_cache_inval (srv, opath, 0);
+    ioctx_cache_inval (srv, npath, 1);
+    acache_inval_tree (path_s (opath));
+    acache_inval_tree (path_s (npath));
+    _rename_paths (srv, opath, npath, odirfd, oname);
+    path_decref (srv, opath);
+    path_decref (srv, npath);
+    return ret;
+error:
+    errn (np_rerror (), "diod_renameat %s@%s:%s/%.*s to %s/%.*s",
+          olddirfid->user->uname, np_conn_get_client_id (olddirfid->conn),
+          path_s (od->path), oldname->len, oldname->str,
+          path_s (nd->path), newname->len, newname->str);
+error_quiet:
+    if (ret)
+        free (ret);
+    if (opath)
+        path_decref (srv, opath);
+    if (npath)
+        path_decref (srv, npath);
+    return NULL;
+}
+
+/* Tunlinkat - remove a file or directory relative to a directory fid.
+ * Unlike Tremove, the client need not walk a fid to the file first.
+ */
+Npfcall*
+diod_unlinkat (Npfid *dirfid, Npstr *name, u32 flags)
+{
+    Npsrv *srv = dirfid->conn->srv;
+    Fid *d = dirfid->aux;
+    Npfcall *ret;
+    Path npath = NULL;
+    char *cname;
+    int dirfd;
+    int uflags = (flags & P9_DOTL_AT_REMOVEDIR) ? AT_REMOVEDIR : 0;
+
+    if (!(npath = path_append (srv, d->path, name))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    dirfd = path_at (npath, &cname);
+    if (unlinkat (dirfd, cname, uflags) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    ioctx_cache_inval (srv, npath, 1);
+    acache_inval (path_s (npath));
+    if (!(ret = np_create_runlinkat ())) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    path_decref (srv, npath);
+    return ret;
+error:
+    errn (np_rerror (), "diod_unlinkat %s@%s:%s/%.*s",
+          dirfid->user->uname, np_conn_get_client_id (dirfid->conn),
+          path_s (d->path), name->len, name->str);
+error_quiet:
+    if (npath)
+        path_decref (srv, npath);
+    return NULL;
+}
+
+/* Tcopyrange - copy between two open files without the data crossing
+ * the wire (diod extension).
+ */
+Npfcall*
+diod_copyrange (Npfid *srcfid, u64 srcoff, Npfid *dstfid, u64 dstoff,
+                u64 count)
+{
+    Fid *sf = srcfid->aux;
+    Fid *df = dstfid->aux;
+    Npfcall *ret;
+    ssize_t n;
+
+    if (!sf->ioctx || !df->ioctx) {
+        msg ("diod_copyrange: fid is not open");
+        np_uerror (EBADF);
+        goto error;
+    }
+    ioctx_flush_path (sf->path);
+    n = ioctx_copy_range (sf->ioctx, srcoff, df->ioctx, dstoff, count);
+    if (n < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    acache_inval_ino (ioctx_dev (df->ioctx), ioctx_qid (df->ioctx)->path);
+    fcache_inval_ino (ioctx_dev (df->ioctx), ioctx_qid (df->ioctx)->path);
+    if (!(ret = np_create_rcopyrange (n))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    return ret;
+error:
+    errn (np_rerror (), "diod_copyrange %s@%s:%s",
+          dstfid->user->uname, np_conn_get_client_id (dstfid->conn),
+          path_s (df->path));
+error_quiet:
+    return NULL;
+}
+
 Npfcall*
 diod_xattrwalk (Npfid *fid, Npfid *attrfid, Npstr *name)
 {
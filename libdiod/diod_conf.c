@@ -87,6 +87,9 @@
 #define RO_STATFS_PASSTHRU      0x00010000
 #define RO_AUTH_REQUIRED_CTL    0x00020000
 #define RO_HOSTNAME_LOOKUP      0x00040000
+#define RO_SENDQ_LIMIT          0x00080000
+#define RO_USER_AFFINITY        0x00100000
+#define RO_OPENCACHE            0x00200000
 
 typedef struct {
     int          debuglevel;
@@ -95,6 +98,10 @@ typedef struct {
     int          auth_required;
     int          hostname_lookup;
     int          statfs_passthru;
+    int          sendq_limit;
+    int          user_affinity;
+    int          maxmmap;
+    int          opencache;
     int          userdb;
     int          allsquash;
     char        *squashuser;
@@ -149,6 +156,10 @@ _create_export (char *path)
     x->hosts = NULL;
     x->users = NULL;
     x->oflags = 0;
+    x->attrttl = 0;
+    x->dircache = DFLT_DIRCACHE;
+    x->readahead = DFLT_READAHEAD;
+    x->writebehind = 0;
     return x;
 }
 
@@ -183,6 +194,10 @@ diod_conf_init (void)
     config.auth_required = DFLT_AUTH_REQUIRED;
     config.hostname_lookup = DFLT_HOSTNAME_LOOKUP;
     config.statfs_passthru = DFLT_STATFS_PASSTHRU;
+    config.sendq_limit = DFLT_SENDQ_LIMIT;
+    config.user_affinity = DFLT_USER_AFFINITY;
+    config.maxmmap = DFLT_MAXMMAP;
+    config.opencache = DFLT_OPENCACHE;
     config.userdb = DFLT_USERDB;
     config.allsquash = DFLT_ALLSQUASH;
     config.squashuser = _xstrdup (DFLT_SQUASHUSER);
@@ -296,6 +311,46 @@ void diod_conf_set_statfs_passthru (int i)
     config.ro_mask |= RO_STATFS_PASSTHRU;
 }
 
+/* sendq_limit - reply bytes queued per connection before input pauses
+ */
+int diod_conf_get_sendq_limit (void) { return config.sendq_limit; }
+int diod_conf_opt_sendq_limit (void) { return config.ro_mask & RO_SENDQ_LIMIT; }
+void diod_conf_set_sendq_limit (int i)
+{
+    config.sendq_limit = i;
+    config.ro_mask |= RO_SENDQ_LIMIT;
+}
+
+/* user_affinity - requests a worker may take out of order to keep its creds
+ */
+int diod_conf_get_user_affinity (void) { return config.user_affinity; }
+int diod_conf_opt_user_affinity (void) { return config.ro_mask & RO_USER_AFFINITY; }
+void diod_conf_set_user_affinity (int i)
+{
+    config.user_affinity = i;
+    config.ro_mask |= RO_USER_AFFINITY;
+}
+
+/* maxmmap - megabytes of hot file data to cache in memory
+ */
+int diod_conf_get_maxmmap (void) { return config.maxmmap; }
+int diod_conf_opt_maxmmap (void) { return config.ro_mask & RO_MAXMMAP; }
+void diod_conf_set_maxmmap (int i)
+{
+    config.maxmmap = i;
+    config.ro_mask |= RO_MAXMMAP;
+}
+
+/* opencache - number of closed files to keep open for reuse
+ */
+int diod_conf_get_opencache (void) { return config.opencache; }
+int diod_conf_opt_opencache (void) { return config.ro_mask & RO_OPENCACHE; }
+void diod_conf_set_opencache (int i)
+{
+    config.opencache = i;
+    config.ro_mask |= RO_OPENCACHE;
+}
+
 /* userdb - whether to do passwd/group lookup
  */
 int diod_conf_get_userdb (void) { return config.userdb; }
@@ -371,6 +426,8 @@ void diod_conf_add_exports (char *path)
     _xlist_append (config.exports, x);
     config.ro_mask |= RO_EXPORTS;
 }
+static void _parse_expopt (char *s, Export *x);
+
 void diod_conf_validate_exports (void)
 {
     ListIterator itr;
@@ -385,15 +442,24 @@ void diod_conf_validate_exports (void)
             msg_exit ("exports should begin with '/'");
         if (strstr (x->path, "/..") != 0)
             msg_exit ("exports should not contain '/..'"); /* FIXME */
+        /* exports given with -e pick up -o options here */
+        if (!x->opts && config.exportopts) {
+            x->opts = _xstrdup (config.exportopts);
+            _parse_expopt (x->opts, x);
+        }
     }
     list_iterator_destroy (itr);
 }
 
 static void
-_parse_expopt (char *s, int *fp)
+_parse_expopt (char *s, Export *x)
 {
     int flags = 0;
-    char *cpy, *item;
+    int ttl = 0;
+    int dc = x->dircache;
+    int ra = x->readahead;
+    int wb = x->writebehind;
+    char *cpy, *item, *end;
     char *saveptr = NULL;
 
     if (!(cpy = strdup (s)))
@@ -410,12 +476,44 @@ _parse_expopt (char *s, int *fp)
             flags |= XFLAGS_PRIVPORT;
         else if (!strcmp (item, "noauth"))
             flags |= XFLAGS_NOAUTH;
-        else
+        else if (!strcmp (item, "dircache"))
+            flags |= XFLAGS_DIRCACHE;
+        else if (!strncmp (item, "dircache=", 9)) {
+            dc = strtol (item + 9, &end, 10);
+            if (*end != '\0' || end == item + 9 || dc < 1 || dc > 1024)
+                msg_exit ("bad export option: %s", item);
+            flags |= XFLAGS_DIRCACHE;
+        }
+        else if (!strcmp (item, "attrsync"))
+            flags |= XFLAGS_ATTRSYNC;
+        else if (!strcmp (item, "attrnosync"))
+            flags |= XFLAGS_ATTRNOSYNC;
+        else if (!strcmp (item, "dropbehind"))
+            flags |= XFLAGS_DROPBEHIND;
+        else if (!strncmp (item, "attrcache=", 10)) {
+            ttl = strtol (item + 10, &end, 10);
+            if (*end != '\0' || end == item + 10 || ttl < 0)
+                msg_exit ("bad export option: %s", item);
+        } else if (!strncmp (item, "readahead=", 10)) {
+            ra = strtol (item + 10, &end, 10);
+            if (*end != '\0' || end == item + 10 || ra < 0 || ra > 1048576)
+                msg_exit ("bad export option: %s", item);
+        } else if (!strncmp (item, "writebehind=", 12)) {
+            wb = strtol (item + 12, &end, 10);
+            if (*end != '\0' || end == item + 12 || wb < 0 || wb > 65536)
+                msg_exit ("bad export option: %s", item);
+        } else
             msg_exit ("unknown export option: %s", item);
         item = strtok_r (NULL, ",", &saveptr);
     }
     free (cpy);
-    *fp = flags;
+    if ((flags & XFLAGS_ATTRSYNC) && (flags & XFLAGS_ATTRNOSYNC))
+        msg_exit ("export options attrsync and attrnosync conflict");
+    x->oflags = flags;
+    x->attrttl = ttl;
+    x->dircache = dc;
+    x->readahead = ra;
+    x->writebehind = wb;
 }
 
 /* exportall - export everything in /proc/mounts
@@ -454,7 +552,7 @@ List diod_conf_get_mounts (void)
         if (config.exportopts)
             x->opts = _xstrdup (config.exportopts);
         if (x->opts)
-            _parse_expopt (x->opts, &x->oflags);
+            _parse_expopt (x->opts, x);
         if (!list_append (l, x)) {
             _destroy_export (x);
             goto error;
@@ -606,7 +704,7 @@ _lua_getglobal_exports (char *path, lua_State *L, List *lp)
                 if (!x->opts && config.exportopts)
                     x->opts = _xstrdup (config.exportopts);
                 if (x->opts)
-                    _parse_expopt (x->opts, &x->oflags);
+                    _parse_expopt (x->opts, x);
                 _lua_get_expattr (path, i, L, "users", &x->users);
                 _lua_get_expattr (path, i, L, "hosts", &x->hosts);
                 /* FIXME: check for illegal export attributes */
@@ -674,6 +772,23 @@ diod_conf_init_config_file (char *path) /* FIXME: ENOMEM is fatal */
             _lua_getglobal_int (path, L, "statfs_passthru",
                                 &config.statfs_passthru);
         }
+        if (!(config.ro_mask & RO_SENDQ_LIMIT)) {
+            config.sendq_limit = DFLT_SENDQ_LIMIT;
+            _lua_getglobal_int (path, L, "sendq_limit", &config.sendq_limit);
+        }
+        if (!(config.ro_mask & RO_USER_AFFINITY)) {
+            config.user_affinity = DFLT_USER_AFFINITY;
+            _lua_getglobal_int (path, L, "user_affinity",
+                                &config.user_affinity);
+        }
+        if (!(config.ro_mask & RO_MAXMMAP)) {
+            config.maxmmap = DFLT_MAXMMAP;
+            _lua_getglobal_int (path, L, "maxmmap", &config.maxmmap);
+        }
+        if (!(config.ro_mask & RO_OPENCACHE)) {
+            config.opencache = DFLT_OPENCACHE;
+            _lua_getglobal_int (path, L, "opencache", &config.opencache);
+        }
         if (!(config.ro_mask & RO_USERDB)) {
             config.userdb = DFLT_USERDB;
             _lua_getglobal_int (path, L, "userdb", &config.userdb);
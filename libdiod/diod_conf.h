@@ -1,10 +1,15 @@
 #define DFLT_DEBUGLEVEL         0
 #define DFLT_NWTHREADS          16
 #define DFLT_MAXMMAP            0
+#define DFLT_OPENCACHE          0
+#define DFLT_READAHEAD          1024
+#define DFLT_DIRCACHE           32
 #define DFLT_FOREGROUND         0
 #define DFLT_AUTH_REQUIRED      1
 #define DFLT_HOSTNAME_LOOKUP    1
 #define DFLT_STATFS_PASSTHRU    0
+#define DFLT_SENDQ_LIMIT        (4*1024*1024)
+#define DFLT_USER_AFFINITY      8
 #define DFLT_USERDB             1
 #define DFLT_ALLSQUASH          0
 #define DFLT_SQUASHUSER         "nobody"
@@ -51,6 +56,22 @@ int     diod_conf_get_statfs_passthru (void);
 int     diod_conf_opt_statfs_passthru (void);
 void    diod_conf_set_statfs_passthru (int i);
 
+int     diod_conf_get_sendq_limit (void);
+int     diod_conf_opt_sendq_limit (void);
+void    diod_conf_set_sendq_limit (int i);
+
+int     diod_conf_get_user_affinity (void);
+int     diod_conf_opt_user_affinity (void);
+void    diod_conf_set_user_affinity (int i);
+
+int     diod_conf_get_maxmmap (void);
+int     diod_conf_opt_maxmmap (void);
+void    diod_conf_set_maxmmap (int i);
+
+int     diod_conf_get_opencache (void);
+int     diod_conf_opt_opencache (void);
+void    diod_conf_set_opencache (int i);
+
 int     diod_conf_get_userdb (void);
 int     diod_conf_opt_userdb (void);
 void    diod_conf_set_userdb (int i);
@@ -77,11 +98,19 @@ void    diod_conf_add_listen (char *s);
 #define XFLAGS_SHAREFD      0x04
 #define XFLAGS_PRIVPORT     0x08
 #define XFLAGS_NOAUTH       0x10
+#define XFLAGS_DIRCACHE     0x20
+#define XFLAGS_ATTRSYNC     0x40
+#define XFLAGS_ATTRNOSYNC   0x80
+#define XFLAGS_DROPBEHIND   0x100
 
 typedef struct {
     char         *path;
     char         *opts;
     int          oflags;
+    int          attrttl;   /* attribute cache seconds, 0=off */
+    int          dircache;  /* largest directory snapshot in MB */
+    int          readahead; /* readahead window in KB, 0=off */
+    int          writebehind; /* write coalescing buffer in KB, 0=off */
     char         *users;
     char         *hosts;
 } Export;
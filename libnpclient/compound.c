@@ -0,0 +1,360 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+/* compound.c - send several requests in one round trip (diod extension) */
+
+/* With a server that agreed to P9_DIODEXT_VERSION, walk/open and
+ * walk/open/read/clunk sequences, which dominate small file access, are
+ * sent as one Tcompound.  Each request names fids the client chose, so
+ * a request can use the newfid of a walk earlier in the same compound.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+#include "npcimpl.h"
+
+/* Sizes of fixed size replies, for budgeting a read in a compound.
+ */
+#define RLERROR_SIZE	(7 + 4)
+#define RLOPEN_SIZE	(7 + 13 + 4)
+#define RGETATTR_SIZE	(7 + 8 + 13 + 3*4 + 15*8)
+#define RCLUNK_SIZE	7
+#define RREAD_HDRSIZE	(7 + 4)
+#define RWALKS_SIZE(nw,n)	((7 + 2)*(nw) + 13*(n))
+
+/* Send requests 'tcs' in one Tcompound.  Returns the number that
+ * succeeded, with their replies in 'rcs' for the caller to free.
+ * If that is less than 'n', np_rerror () is the error of the next one.
+ * Returns -1 if the compound itself failed.
+ */
+int
+npc_compound (Npcfsys *fs, Npfcall **tcs, int n, Npfcall **rcs)
+{
+	Npfcall *tc = NULL, *rc = NULL;
+	Npfcall fc;
+	int i, len, off = 0, ret = -1;
+
+	if (!(tc = np_create_tcompound (tcs, n))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (tc->size > fs->msize) {
+		np_uerror (EMSGSIZE);
+		goto done;
+	}
+	if (fs->rpc (fs, tc, &rc) < 0)
+		goto done;
+	for (i = 0; i < rc->u.rcompound.count && i < n; i++) {
+		len = np_deserialize_compound (&fc, rc->u.rcompound.data + off,
+					       rc->u.rcompound.size - off);
+		if (len == 0) {
+			np_uerror (EPROTO);
+			goto error;
+		}
+		off += len;
+		if (fc.type == P9_RLERROR) {
+			np_uerror (fc.u.rlerror.ecode);
+			break;
+		}
+		if (fc.type != tcs[i]->type + 1) {
+			np_uerror (EPROTO);
+			goto error;
+		}
+		if (!(rcs[i] = malloc (sizeof (Npfcall) + len))) {
+			np_uerror (ENOMEM);
+			goto error;
+		}
+		memcpy ((u8 *)rcs[i] + sizeof (Npfcall), fc.pkt, len);
+		(void)np_deserialize_compound (rcs[i],
+				(u8 *)rcs[i] + sizeof (Npfcall), len);
+	}
+	if (i < n && np_rerror () == 0) {
+		np_uerror (EPROTO);	/* short compound reply */
+		goto error;
+	}
+	ret = i;
+done:
+	if (tc)
+		free (tc);
+	if (rc)
+		free (rc);
+	return ret;
+error:
+	while (--i >= 0)
+		free (rcs[i]);
+	goto done;
+}
+
+/* Count the names in 'path'.
+ */
+static int
+_count_names (char *path)
+{
+	int n = 0;
+	char *s;
+
+	for (s = path; s && *s; s++) {
+		if (*s != '/' && (s == path || s[-1] == '/'))
+			n++;
+	}
+	return n;
+}
+
+/* Walks needed for 'n' names, at most P9_MAXWELEM each, and at least
+ * one so a new fid is created.
+ */
+static int
+_count_walks (int n)
+{
+	return n == 0 ? 1 : (n + P9_MAXWELEM - 1) / P9_MAXWELEM;
+}
+
+/* Set tcs[0..nw-1] to the walks from 'fid' to 'newfid' along 'path'.
+ * Returns 0, or -1 on error.
+ */
+static int
+_make_walks (Npcfid *fid, Npcfid *newfid, char *path, Npfcall **tcs, int nw)
+{
+	char *cpy, *s, *wnames[P9_MAXWELEM];
+	u32 from = fid->fid;
+	int i, n;
+
+	if (!(cpy = strdup (path ? path : ""))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	s = strtok (cpy, "/");
+	for (i = 0; i < nw; i++) {
+		for (n = 0; s && n < P9_MAXWELEM; s = strtok (NULL, "/"))
+			wnames[n++] = s;
+		if (!(tcs[i] = np_create_twalk (from, newfid->fid, n, wnames))) {
+			np_uerror (ENOMEM);
+			goto error;
+		}
+		from = newfid->fid;
+	}
+	free (cpy);
+	return 0;
+error:
+	while (--i >= 0)
+		free (tcs[i]);
+	free (cpy);
+	return -1;
+}
+
+static void
+_free_fcalls (Npfcall **fcs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (fcs[i])
+			free (fcs[i]);
+	}
+}
+
+/* Send the walks to 'path' from 'root' to new fid 'fid', followed by
+ * tcs[nw..n-1], which may use it.  Returns as npc_compound (), with
+ * *walkedp set if 'fid' was created on the server.
+ */
+static int
+_walk_compound (Npcfid *root, char *path, Npcfid *fid, Npfcall **tcs,
+		int nw, int n, Npfcall **rcs, int *walkedp)
+{
+	int done;
+
+	*walkedp = 0;
+	if (_make_walks (root, fid, path, tcs, nw) < 0)
+		return -1;
+	done = npc_compound (root->fsys, tcs, n, rcs);
+	_free_fcalls (tcs, nw);
+	if (done > 0)
+		*walkedp = 1;
+	return done;
+}
+
+/* Walk 'path' from 'root' and open it with 'flags' in one round trip.
+ * Returns 0 with *fidp set, -1 on error, or 1 if the request does not
+ * fit in a compound and must be sent the ordinary way.
+ */
+int
+npc_open_compound (Npcfid *root, char *path, u32 flags, Npcfid **fidp)
+{
+	Npcfsys *fs = root->fsys;
+	int maxio = fs->msize - P9_IOHDRSZ;
+	int nw = _count_walks (_count_names (path));
+	Npfcall **tcs = NULL, **rcs = NULL;
+	Npcfid *fid = NULL;
+	int walked, done, ret = -1;
+
+	if (!(tcs = calloc (nw + 1, sizeof (*tcs)))
+				|| !(rcs = calloc (nw + 1, sizeof (*rcs)))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (!(fid = npc_fid_alloc (fs)))
+		goto done;
+	if (!(tcs[nw] = np_create_tlopen (fid->fid, flags))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	done = _walk_compound (root, path, fid, tcs, nw, nw + 1, rcs, &walked);
+	if (done < 0) {
+		if (np_rerror () == EMSGSIZE)
+			ret = 1;
+		goto done;
+	}
+	if (done == nw + 1) {
+		fid->iounit = rcs[nw]->u.rlopen.iounit;
+		if (fid->iounit == 0 || fid->iounit > maxio)
+			fid->iounit = maxio;
+		fid->offset = 0;
+		*fidp = fid;
+		fid = NULL;
+		ret = 0;
+	} else if (walked) {
+		int saved_err = np_rerror ();
+		(void)npc_clunk (fid);
+		np_uerror (saved_err);
+		fid = NULL;
+	}
+	_free_fcalls (rcs, done);
+done:
+	if (fid)
+		npc_fid_free (fid);
+	if (tcs) {
+		if (tcs[nw])
+			free (tcs[nw]);
+		free (tcs);
+	}
+	if (rcs)
+		free (rcs);
+	return ret;
+}
+
+/* Walk 'path' from 'root', open it read-only, get its size, read up to
+ * 'count' bytes into 'buf' and clunk it, in one round trip.  Sets *lenp
+ * to the bytes read.  Returns 0 if that read the whole file or filled
+ * 'buf', 1 if the rest must be read the ordinary way, or -1 on error.
+ */
+int
+npc_get_compound (Npcfid *root, char *path, void *buf, u32 count, int *lenp)
+{
+	Npcfsys *fs = root->fsys;
+	int names = _count_names (path);
+	int nw = _count_walks (names);
+	Npfcall **tcs = NULL, **rcs = NULL;
+	Npcfid *fid = NULL;
+	int i, room, walked, done, ret = -1;
+	u32 rcount, n;
+
+	*lenp = 0;
+	/* Size the read so every reply fits in one message.
+	 */
+	room = fs->msize - P9_COMPOUNDHDRSZ - RLERROR_SIZE
+	     - RWALKS_SIZE (nw, names) - RLOPEN_SIZE - RGETATTR_SIZE
+	     - RREAD_HDRSIZE - RCLUNK_SIZE;
+	if (room <= 0)
+		return 1;
+	rcount = count < room ? count : room;
+	if (!(tcs = calloc (nw + 4, sizeof (*tcs)))
+				|| !(rcs = calloc (nw + 4, sizeof (*rcs)))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (!(fid = npc_fid_alloc (fs)))
+		goto done;
+	if (!(tcs[nw] = np_create_tlopen (fid->fid, O_RDONLY))
+		|| !(tcs[nw + 1] = np_create_tgetattr (fid->fid, P9_STAT_SIZE))
+		|| !(tcs[nw + 2] = np_create_tread (fid->fid, 0, rcount))
+		|| !(tcs[nw + 3] = np_create_tclunk (fid->fid))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	done = _walk_compound (root, path, fid, tcs, nw, nw + 4, rcs, &walked);
+	if (done < 0) {
+		if (np_rerror () == EMSGSIZE)
+			ret = 1;
+		goto done;
+	}
+	if (done >= nw + 3) {
+		n = rcs[nw + 2]->u.rread.count;
+		if (n > rcount) {
+			np_uerror (EPROTO);
+			goto free_rcs;
+		}
+		memcpy (buf, rcs[nw + 2]->u.rread.data, n);
+		*lenp = n;
+		if (n == count || n == rcs[nw + 1]->u.rgetattr.size
+			|| ((fs->flags & NPC_SHORTREAD_EOF) && n < rcount))
+			ret = 0;
+		else
+			ret = 1;
+	}
+	/* From clunk(5): even if the clunk fails, the fid is no longer valid.
+	 */
+	if (done == nw + 4 || done == nw + 3) {
+		npc_fid_free (fid);
+		fid = NULL;
+		if (done == nw + 3)
+			ret = -1;
+	} else if (walked) {
+		int saved_err = np_rerror ();
+		(void)npc_clunk (fid);
+		np_uerror (saved_err);
+		fid = NULL;
+	}
+free_rcs:
+	_free_fcalls (rcs, done);
+done:
+	if (fid)
+		npc_fid_free (fid);
+	if (tcs) {
+		for (i = nw; i < nw + 4; i++) {
+			if (tcs[i])
+				free (tcs[i]);
+		}
+		free (tcs);
+	}
+	if (rcs)
+		free (rcs);
+	return ret;
+}
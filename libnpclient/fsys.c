@@ -71,6 +71,7 @@ npc_create_fsys(int rfd, int wfd, int msize, int flags)
 	fs->decref = npc_decref_fsys;
 	fs->disconnect = NULL;
 	fs->flags = flags;
+	fs->diodext = 0;
 
 	fs->trans = np_fdtrans_create(rfd, wfd);
 	if (!fs->trans)
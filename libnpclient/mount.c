@@ -63,15 +63,29 @@ npc_start (int rfd, int wfd, int msize, int flags)
 		fs = npc_create_fsys (rfd, wfd, msize, flags);
 	if (!fs)
 		goto done;
-	if (!(tc = np_create_tversion (msize, "9P2000.L"))) {
+	/* Offer diod's extensions first.  A server that knows them agrees,
+	 * a newer one answers "9P2000.L", and an older one fails the
+	 * version, in which case try again with plain 9P2000.L.
+	 */
+	if (!(tc = np_create_tversion (msize, P9_DIODEXT_VERSION))) {
 		np_uerror (ENOMEM);
 		goto done;
 	}
-	if (fs->rpc (fs, tc, &rc) < 0)
-		goto done;
+	if (fs->rpc (fs, tc, &rc) < 0) {
+		free (tc);
+		if (!(tc = np_create_tversion (msize, "9P2000.L"))) {
+			np_uerror (ENOMEM);
+			goto done;
+		}
+		np_uerror (0);
+		if (fs->rpc (fs, tc, &rc) < 0)
+			goto done;
+	}
 	if (rc->u.rversion.msize < msize)
 		fs->msize = rc->u.rversion.msize;
-	if (np_strcmp (&rc->u.rversion.version, "9P2000.L") != 0) {
+	if (np_strcmp (&rc->u.rversion.version, P9_DIODEXT_VERSION) == 0)
+		fs->diodext = 1;
+	else if (np_strcmp (&rc->u.rversion.version, "9P2000.L") != 0) {
 		np_uerror(EIO);
 		goto done;
 	}
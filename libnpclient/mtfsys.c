@@ -94,6 +94,7 @@ npc_create_mtfsys(int rfd, int wfd, int msize, int flags)
 	fs->decref = npc_decref_fsys;
 	fs->disconnect = npc_disconnect_fsys;
 	fs->flags = flags;
+	fs->diodext = 0;
 
 	fs->trans = np_fdtrans_create(rfd, wfd);
 	if (!fs->trans)
@@ -60,6 +60,7 @@ struct Npcfsys {
 	int		flags;
 	u32		msize;
 	Nptrans*	trans;
+	int		diodext;	/* server agreed to P9_DIODEXT_VERSION */
 
 	int		refcount;
 	Npcpool*	tagpool;
@@ -92,5 +93,12 @@ void npc_destroy_pool(Npcpool *p);
 u32 npc_get_id(Npcpool *p);
 void npc_put_id(Npcpool *p, u32 id);
 
+void npc_attr2stat(struct p9_rgetattr *attr, struct stat *sb);
+
+int npc_compound(Npcfsys *fs, Npfcall **tcs, int n, Npfcall **rcs);
+int npc_open_compound(Npcfid *root, char *path, u32 flags, Npcfid **fidp);
+int npc_get_compound(Npcfid *root, char *path, void *buf, u32 count,
+		     int *lenp);
+
 Npcfid *npc_fid_alloc(Npcfsys *fs);
 void npc_fid_free(Npcfid *fid);
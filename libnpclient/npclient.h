@@ -156,6 +156,24 @@ int npc_remove (Npcfid *fid);
  */
 int npc_readdir (Npcfid *fid, u64 offset, char *data, u32 count);
 
+/* Send READDIRPLUS request (diod extension) to list contents of directory
+ * 'fid' along with the attributes selected by 'request_mask'.  Entries are
+ * as for npc_readdir, each followed by the body of a getattr response
+ * less the qid.  Fails with ENOSYS if the server did not negotiate it.
+ */
+int npc_readdirplus (Npcfid *fid, u64 offset, char *data, u32 count,
+		     u64 request_mask);
+
+/* Send COPYRANGE request (diod extension) to copy up to 'count' bytes
+ * from open file 'src' at 'srcoff' to open file 'dst' at 'dstoff' on the
+ * server, without the data crossing the wire.  Less than 'count' may be
+ * copied, as with npc_pwrite.  Returns bytes copied, 0 at end of 'src',
+ * or -1 on error (retrieve with np_rerror ()).  Fails with ENOSYS if the
+ * server did not negotiate it.
+ */
+ssize_t npc_copy_range (Npcfid *src, u64 srcoff, Npcfid *dst, u64 dstoff,
+			u64 count);
+
 /* Xattr functions
  */
 ssize_t npc_xattrwalk (Npcfid *fid, Npcfid *attrfid, char *name);
@@ -187,7 +205,7 @@ Npcfid *npc_mount (int rfd, int wfd, int msize, char *aname, AuthFun auth);
  */
 void npc_umount (Npcfid *fid);
 
-/* Shorthand for walk/open.
+/* Shorthand for walk/open, sent as one compound request if supported.
  * Returns fid for file, or NULL on error (retrieve with np_rerror ()).
  */
 Npcfid* npc_open_bypath (Npcfid *root, char *path, u32 mode);
@@ -204,6 +222,8 @@ Npcfid *npc_create_bypath (Npcfid *root, char *path, u32 flags, u32 mode,
 int npc_read(Npcfid *fid, void *buf, u32 count);
 
 /* Shorthand for walk/open/read[count]/close, i.e. read the whole file.
+ * A file that fits in one message takes one round trip if the server
+ * supports compound requests.
  * Returns bytes read, or -1 on error (retrieve with np_rerror ()).
  */
 int npc_get(Npcfid *root, char *path, void *buf, u32 count);
@@ -271,6 +291,13 @@ Npcfid *npc_opendir (Npcfid *root, char *path);
  * On EOF set result to NULL, otherwise set to entry.
  */
 int npc_readdir_r (Npcfid *fid, struct dirent *entry, struct dirent **result);
+
+/* Like npc_readdir_r() but also return the entry's attributes in 'sb',
+ * in one round trip per buffer of entries if the server supports it.
+ * Do not mix with npc_readdir_r() on the same fid.
+ */
+int npc_readdirplus_r (Npcfid *fid, struct dirent *entry, struct stat *sb,
+		       struct dirent **result);
 void npc_seekdir (Npcfid *fid, long offset);
 long npc_telldir (Npcfid *fid);
 
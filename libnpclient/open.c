@@ -136,6 +136,14 @@ npc_open_bypath (Npcfid *root, char *path, u32 flags)
 {
 	Npcfid *fid;
 
+	if (root->fsys->diodext) {
+		switch (npc_open_compound (root, path, flags, &fid)) {
+			case 0:
+				return fid;
+			case -1:
+				return NULL;
+		}
+	}
 	if (!(fid = npc_walk (root, path)))
 		return NULL;
 	if (npc_open (fid, flags) < 0) {
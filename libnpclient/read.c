@@ -90,8 +90,17 @@ npc_get(Npcfid *root, char *path, void *buf, u32 count)
 	int n, len = 0;
 	Npcfid *fid;
 
+	if (root->fsys->diodext) {
+		switch (npc_get_compound (root, path, buf, count, &len)) {
+			case 0:
+				return len;
+			case -1:
+				return -1;
+		}
+	}
 	if (!(fid = npc_open_bypath(root, path, O_RDONLY)))
 		return -1;
+	fid->offset = len;
 	while (len < count) {
 		n = npc_read(fid, buf + len, count - len);
 		if (n < 0)
@@ -70,6 +70,35 @@ done:
 	return ret;
 }
 
+int
+npc_readdirplus (Npcfid *fid, u64 offset, char *data, u32 count,
+		 u64 request_mask)
+{
+	Npfcall *tc = NULL, *rc = NULL;
+	int ret = -1;
+
+	if (!fid->fsys->diodext) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (!(tc = np_create_treaddirplus(fid->fid, offset, count,
+					  request_mask))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (fid->fsys->rpc(fid->fsys, tc, &rc) < 0)
+		goto done;
+	NP_ASSERT(rc->u.rreaddirplus.count <= count);
+	memcpy (data, rc->u.rreaddirplus.data, rc->u.rreaddirplus.count);
+	ret = rc->u.rreaddirplus.count;
+done:
+	if (tc)
+		free(tc);
+	if (rc)
+		free(rc);
+	return ret;
+}
+
 Npcfid *
 npc_opendir (Npcfid *root, char *path)
 {
@@ -144,6 +173,63 @@ npc_readdir_r (Npcfid *fid, struct dirent *entry, struct dirent **result)
 	return 0;
 }
 
+/* Like npc_readdir_r() but also fill in 'sb' for the entry.  If the
+ * server lacks readdirplus, fall back to a getattr per entry.
+ */
+int
+npc_readdirplus_r (Npcfid *fid, struct dirent *entry, struct stat *sb,
+		   struct dirent **result)
+{
+	struct p9_rgetattr attr;
+	Npqid qid;
+	int dname_size = PATH_MAX + 1;
+	u64 offset;
+	u8 type;
+	int res;
+
+	if (!fid->buf) /* not opened with npc_opendir */
+		return EINVAL;
+	if (!fid->fsys->diodext) {
+		if ((res = npc_readdir_r (fid, entry, result)) || !*result)
+			return res;
+		if (npc_stat (fid, entry->d_name, sb) < 0)
+			return np_rerror ();
+		return 0;
+	}
+	if (fid->buf_used >= fid->buf_len) {
+		fid->buf_len = npc_readdirplus (fid, fid->offset, fid->buf,
+						fid->buf_size, P9_STAT_BASIC);
+		if (fid->buf_len < 0)
+			return np_rerror ();
+		if (fid->buf_len == 0) {	/* EOF */
+			*result = NULL;
+			return 0;
+		}
+		fid->buf_used = 0;
+	}
+	res = np_deserialize_p9direntplus (&qid, &offset, &type,
+					   entry->d_name, dname_size, &attr,
+					   (u8 *)fid->buf + fid->buf_used,
+					   fid->buf_len   - fid->buf_used);
+	if (res == 0)
+		return EIO;
+	if (attr.valid == 0) {		/* entry vanished after getdents */
+		fid->offset = offset;
+		fid->buf_used += res;
+		return npc_readdirplus_r (fid, entry, sb, result);
+	}
+#ifdef _DIRENT_HAVE_D_OFF
+	entry->d_off = offset;
+#endif
+	entry->d_type = type;
+	entry->d_ino = qid.path;
+	npc_attr2stat (&attr, sb);
+	fid->offset = offset;
+	fid->buf_used += res;
+	*result = entry;
+	return 0;
+}
+
 void
 npc_seekdir (Npcfid *fid, long offset)
 {
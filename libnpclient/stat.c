@@ -129,6 +129,27 @@ npc_fstat (Npcfid *fid, struct stat *sb)
 	return ret;
 }
 
+void
+npc_attr2stat (struct p9_rgetattr *attr, struct stat *sb)
+{
+	memset (sb, 0, sizeof (*sb));
+	sb->st_ino = attr->qid.path;
+	sb->st_mode = attr->mode;
+	sb->st_uid = attr->uid;
+	sb->st_gid = attr->gid;
+	sb->st_nlink = attr->nlink;
+	sb->st_rdev = attr->rdev;
+	sb->st_size = attr->size;
+	sb->st_blksize = attr->blksize;
+	sb->st_blocks = attr->blocks;
+	sb->st_atime = attr->atime_sec;
+	sb->st_atimespec.tv_nsec = attr->atime_nsec;
+	sb->st_mtime = attr->mtime_sec;
+	sb->st_mtimespec.tv_nsec = attr->mtime_nsec;
+	sb->st_ctime = attr->ctime_sec;
+	sb->st_ctimespec.tv_nsec = attr->ctime_nsec;
+}
+
 int
 npc_stat (Npcfid *root, char *path, struct stat *sb)
 {
@@ -67,6 +67,32 @@ done:
 	return ret;
 }
 
+ssize_t
+npc_copy_range(Npcfid *src, u64 srcoff, Npcfid *dst, u64 dstoff, u64 count)
+{
+	Npfcall *tc = NULL, *rc = NULL;
+	ssize_t ret = -1;
+
+	if (!src->fsys->diodext) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (!(tc = np_create_tcopyrange(src->fid, srcoff, dst->fid, dstoff,
+					count))) {
+		np_uerror (ENOMEM);
+		goto done;
+	}
+	if (src->fsys->rpc(src->fsys, tc, &rc) < 0)
+		goto done;
+	ret = rc->u.rcopyrange.count;
+done:
+	if (tc)
+		free(tc);
+	if (rc)
+		free(rc);
+	return ret;
+}
+
 int
 npc_write(Npcfid *fid, void *buf, u32 count)
 {
@@ -56,6 +56,12 @@ typedef uint64_t u64;
  * @P9_RRENAME: rename response
  * @P9_TMKDIR: create a directory request
  * @P9_RMKDIR: create a directory response
+ * @P9_TREADDIRPLUS: read directory entries with attributes (diod extension)
+ * @P9_RREADDIRPLUS: response with directory entries and their attributes
+ * @P9_TCOMPOUND: sequence of requests executed in one round trip (diod ext)
+ * @P9_RCOMPOUND: responses to the requests of a compound request
+ * @P9_TCOPYRANGE: copy data between open files on the server (diod ext)
+ * @P9_RCOPYRANGE: copy range response
  * @P9_TVERSION: version handshake request
  * @P9_RVERSION: version handshake response
  * @P9_TAUTH: request to establish authentication channel
@@ -135,6 +141,12 @@ enum p9_msg_t {
 	P9_RRENAMEAT,
 	P9_TUNLINKAT = 76,
 	P9_RUNLINKAT,
+	P9_TREADDIRPLUS = 80,
+	P9_RREADDIRPLUS,
+	P9_TCOMPOUND = 82,
+	P9_RCOMPOUND,
+	P9_TCOPYRANGE = 84,
+	P9_RCOPYRANGE,
 	P9_TVERSION = 100,
 	P9_RVERSION,
 	P9_TAUTH = 102,
@@ -208,6 +220,15 @@ enum p9_qid_t {
 /* Room for readdir header */
 #define P9_READDIRHDRSZ	24
 
+/* Version string a client offers to use diod's protocol extensions
+ * (Treaddirplus, Tcompound, Tcopyrange).  A server that does not know
+ * it replies "9P2000.L".
+ */
+#define P9_DIODEXT_VERSION	"9P2000.L.diod"
+
+/* Room for compound header: size[4] type[1] tag[2] count[2] */
+#define P9_COMPOUNDHDRSZ	9
+
 /**
  * struct p9_str - length prefixed string type
  * @len: length of the string
@@ -323,6 +344,10 @@ struct p9_qid {
 #define P9_LOCK_TYPE_WRLCK 1
 #define P9_LOCK_TYPE_UNLCK 2
 
+/* Bit values for unlinkat flags (Linux AT_REMOVEDIR)
+ */
+#define P9_DOTL_AT_REMOVEDIR 0x200
+
 /* Structures for Protocol Operations */
 struct p9_rlerror {
 	u32 ecode;
@@ -458,6 +483,45 @@ struct p9_rreaddir {
 	u32 count;
 	u8 *data;
 };
+struct p9_treaddirplus {
+	u32 fid;
+	u64 offset;
+	u32 count;
+	u64 request_mask;
+};
+struct p9_rreaddirplus {
+	u32 count;
+	u8 *data;
+};
+/* Tcompound and Rcompound carry 'count' complete 9P messages back to back.
+ * A request may use a fid created by an earlier one in the same compound.
+ * The server stops at the first error, whose Rlerror is the last reply.
+ */
+struct p9_tcompound {
+	u16 count;
+	u32 size;
+	u8 *data;
+};
+struct p9_rcompound {
+	u16 count;
+	u32 size;
+	u8 *data;
+};
+/* Tcopyrange copies up to 'count' bytes from open file 'srcfid' at
+ * 'srcoff' to open file 'dstfid' at 'dstoff' without the data crossing
+ * the wire.  Rcopyrange returns the number copied, which may be less
+ * (0 at end of file), as with write.
+ */
+struct p9_tcopyrange {
+	u32 srcfid;
+	u64 srcoff;
+	u32 dstfid;
+	u64 dstoff;
+	u64 count;
+};
+struct p9_rcopyrange {
+	u64 count;
+};
 struct p9_tfsync {
 	u32 fid;
 };
@@ -40,9 +40,15 @@
 #include "xpthread.h"
 #include "npfsimpl.h"
 
+/* Replies up to this size are copied into the send queue, so they need
+ * not be heap allocated (Rlerror and Rflush are built on the stack).
+ */
+#define SENDQ_COPYMAX	256
+
 static void *np_conn_read_proc(void *);
 static void np_conn_flush (Npconn *conn);
 static void np_conn_destroy(Npconn *conn);
+static void np_conn_sendq_discard(Npconn *conn);
 
 Npconn*
 np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id, int flags)
@@ -73,8 +79,30 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id, int flags)
 
 	conn->trans = trans;
 	conn->aux = NULL;
+	conn->znext = NULL;
+	memset (conn->reqs, 0, sizeof (conn->reqs));
+	conn->nflush = 0;
+	conn->sq_fd = -1;
+	conn->sq_first = conn->sq_last = NULL;
+	conn->sq_off = 0;
+	conn->sq_bytes = 0;
+	conn->sq_busy = conn->sq_dead = conn->sq_paused = 0;
+	if ((srv->flags & SRV_FLAGS_SPLICEWRITE))
+		trans->splicewrite = 1;
 	np_srv_add_conn(srv, conn);
 
+	/* Pollable transports are serviced by the server's reactor threads.
+	 * Others (e.g. rdma) get a dedicated blocking read thread.
+	 */
+	if (srv->reactor && np_trans_pollfd(trans) >= 0) {
+		if (np_reactor_add_conn(srv, conn) < 0) {
+			err = np_rerror ();
+			np_conn_destroy (conn);
+			np_uerror (err);
+			return NULL;
+		}
+		return conn;
+	}
 	err = pthread_create(&conn->rthread, NULL, np_conn_read_proc, conn);
 	if (err != 0) {
 		np_conn_destroy (conn);
@@ -93,19 +121,29 @@ np_conn_incref(Npconn *conn)
 	xpthread_mutex_unlock(&conn->lock);
 }
 
+/* N.B. once the lock is dropped, a connection being torn down may be
+ * destroyed at any time, so anything needed afterwards is copied out first.
+ */
 void
 np_conn_decref(Npconn *conn)
 {
+	Npsrv *reap = NULL;
+
 	xpthread_mutex_lock(&conn->lock);
 	NP_ASSERT(conn->refcount > 0);
 	conn->refcount--;
-	xpthread_mutex_unlock(&conn->lock);
+	if (conn->refcount == 0 && conn->shutdown)
+		reap = conn->srv;
 	xpthread_cond_signal(&conn->refcond);
+	xpthread_mutex_unlock(&conn->lock);
+	if (reap)
+		np_reactor_wake(reap);
 }
 
 static void
 np_conn_destroy(Npconn *conn)
 {
+	Npsrv *srv = conn->srv;
 	int n;
 
 	NP_ASSERT(conn != NULL);
@@ -121,6 +159,9 @@ np_conn_destroy(Npconn *conn)
 		}
 		conn->fidpool = NULL;
 	}
+	np_conn_sendq_discard (conn);
+	if (conn->sq_fd >= 0)
+		np_reactor_del_conn (srv, conn);
 	if (conn->trans) {
 		np_trans_destroy (conn->trans);
 		conn->trans = NULL;
@@ -130,6 +171,7 @@ np_conn_destroy(Npconn *conn)
 	pthread_cond_destroy(&conn->refcond);
 
 	free(conn);
+	np_srv_conn_destroyed (srv);
 }
 
 static void
@@ -153,14 +195,49 @@ _debug_trace (Npsrv *srv, Npfcall *fc)
 	}
 }
 
-/* Per-connection read thread.
+/* Encapsulate fc in a request and hand to srv worker threads.
+ * Returns -1 if the connection should be dropped.
+ */
+static int
+np_conn_dispatch(Npconn *conn, Npfcall *fc)
+{
+	Npsrv *srv = conn->srv;
+	Npreq *req;
+
+	_debug_trace (srv, fc);
+
+	/* In np_req_alloc, req->fid is looked up/initialized.
+	 */
+	req = np_req_alloc(conn, fc);
+	if (!req) {
+		np_logmsg (srv, "out of memory in receive path - "
+			   "dropping connection to '%s'",
+			   conn->client_id);
+		np_trans_release (conn->trans, fc);
+		return -1;
+	}
+
+	/* Enqueue request for processing by next available worker
+	 * thread, except P9_TFLUSH which is handled immediately.
+	 */
+	if (fc->type == P9_TFLUSH) {
+		if (np_flush (req, fc)) {
+			np_req_respond_flush (req);
+			np_req_unref(req);
+		}
+		conn->nflush++;
+	} else
+		np_srv_add_req(srv, req);
+	return 0;
+}
+
+/* Per-connection read thread, for transports the reactor cannot poll.
  */
 static void *
 np_conn_read_proc(void *a)
 {
 	Npconn *conn = (Npconn *)a;
 	Npsrv *srv = conn->srv;
-	Npreq *req;
 	Npfcall *fc;
 
 	pthread_detach(pthread_self());
@@ -174,36 +251,8 @@ np_conn_read_proc(void *a)
 		}
 		if (!fc) /* EOF */
 			break;
-		_debug_trace (srv, fc);
-
-		/* Encapsulate fc in a request and hand to srv worker threads.
-		 * In np_req_alloc, req->fid is looked up/initialized.
-		 */
-		req = np_req_alloc(conn, fc);
-		if (!req) {
-			np_logmsg (srv, "out of memory in receive path - "
-				   "dropping connection to '%s'",
-				   conn->client_id);
-			free (fc);
+		if (np_conn_dispatch (conn, fc) < 0)
 			break;
-		}
-
-		/* Enqueue request for processing by next available worker
-		 * thread, except P9_TFLUSH which is handled immediately.
-		 */
-		if (fc->type == P9_TFLUSH) {
-			if (np_flush (req, fc)) {
-				np_req_respond_flush (req);
-				np_req_unref(req);
-			}
-			xpthread_mutex_lock (&srv->lock);
-			srv->tpool->stats.nreqs[P9_TFLUSH]++;
-			xpthread_mutex_unlock (&srv->lock);
-		} else {
-			xpthread_mutex_lock(&srv->lock);
-			np_srv_add_req(srv, req);
-			xpthread_mutex_unlock(&srv->lock);
-		}
 	}
 	/* Just got EOF on read, or some other fatal error for the
 	 * connection like out of memory.
@@ -220,32 +269,295 @@ np_conn_read_proc(void *a)
 	return NULL;
 }
 
+/* Called from a reactor thread when the connection is readable.
+ * Frame and dispatch every complete request that can be read without
+ * blocking.  Returns 0 if the connection should be re-armed, or -1 on EOF
+ * or a fatal error, in which case the caller begins teardown.
+ */
+int
+np_conn_read_ready(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+	Npfcall *fc;
+
+	for (;;) {
+		if (np_trans_recv(conn->trans, &fc, conn->msize) < 0) {
+			if (np_rerror () == EAGAIN)
+				return 0;
+			np_logerr (srv, "recv error - "
+				   "dropping connection to '%s'",
+				   conn->client_id);
+			return -1;
+		}
+		if (!fc) /* EOF */
+			return -1;
+		if (np_conn_dispatch (conn, fc) < 0)
+			return -1;
+	}
+}
+
+/* First stage of reactor teardown: the connection is no longer polled.
+ * Flush outstanding requests and arrange for the final np_conn_decref ()
+ * to wake the reactor.
+ */
+void
+np_conn_shutdown(Npconn *conn)
+{
+	np_conn_flush (conn);
+
+	/* Queued replies are dropped like those of flushed requests.
+	 * If a send is in progress, the sender does it.
+	 */
+	xpthread_mutex_lock(&conn->wlock);
+	conn->sq_dead = 1;
+	if (!conn->sq_busy)
+		np_conn_sendq_discard (conn);
+	xpthread_mutex_unlock(&conn->wlock);
+
+	xpthread_mutex_lock(&conn->lock);
+	conn->shutdown = 1;
+	xpthread_mutex_unlock(&conn->lock);
+}
+
+/* Second stage of reactor teardown: destroy the connection if no requests
+ * still reference it.  Returns 1 if destroyed, 0 if still busy.
+ */
+int
+np_conn_reap(Npconn *conn)
+{
+	int busy;
+
+	xpthread_mutex_lock(&conn->lock);
+	busy = (conn->refcount > 0);
+	xpthread_mutex_unlock(&conn->lock);
+	if (busy)
+		return 0;
+	np_conn_destroy(conn);
+	return 1;
+}
+
+/* Link/unlink an outstanding request in the conn's tag hash.
+ * Called with conn->lock held.
+ */
+void
+np_conn_add_req(Npconn *conn, Npreq *req)
+{
+	Npreq **head = &conn->reqs[req->tag % REQ_HTABLE_SIZE];
+
+	req->cprev = NULL;
+	req->cnext = *head;
+	if (*head)
+		(*head)->cprev = req;
+	*head = req;
+}
+
+void
+np_conn_remove_req(Npconn *conn, Npreq *req)
+{
+	if (req->cprev)
+		req->cprev->cnext = req->cnext;
+	else
+		conn->reqs[req->tag % REQ_HTABLE_SIZE] = req->cnext;
+	if (req->cnext)
+		req->cnext->cprev = req->cprev;
+	req->cnext = req->cprev = NULL;
+}
+
+/* Find an outstanding request by tag.  Called with conn->lock held.
+ */
+Npreq *
+np_conn_find_req(Npconn *conn, u16 tag)
+{
+	Npreq *req;
+
+	for (req = conn->reqs[tag % REQ_HTABLE_SIZE]; req; req = req->cnext) {
+		if (req->tag == tag)
+			break;
+	}
+	return req;
+}
+
+/* Drop requests still queued and suppress replies to those in progress.
+ */
 static void
 np_conn_flush (Npconn *conn)
 {
 	Nptpool *tp;
-	Npreq *creq, *nextreq;
+	Npreq *creq, *nextreq, *dead = NULL;
+	int i;
 
-	xpthread_mutex_lock(&conn->srv->lock);
-	for (tp = conn->srv->tpool; tp != NULL; tp = tp->next) {
-		for (creq = tp->reqs_first; creq != NULL; creq = nextreq) {
-			nextreq = creq->next;
-			if (creq->conn != conn)
-				continue;
-			np_srv_remove_req(tp, creq);
-			np_req_unref(creq);
-		}
-		for (creq = tp->workreqs; creq != NULL; creq = creq->next) {
-			if (creq->conn != conn)
+	xpthread_mutex_lock(&conn->lock);
+	for (i = 0; i < REQ_HTABLE_SIZE; i++) {
+		for (creq = conn->reqs[i]; creq != NULL; creq = nextreq) {
+			nextreq = creq->cnext;
+			tp = creq->tpool;
+			xpthread_mutex_lock(&tp->lock);
+			if (!creq->wthread) {
+				np_srv_remove_req(tp, creq);
+				xpthread_mutex_unlock(&tp->lock);
+				np_conn_remove_req(conn, creq);
+				creq->next = dead;
+				dead = creq;
 				continue;
+			}
 			creq->state = REQ_NOREPLY;
 			if (conn->srv->flags & SRV_FLAGS_FLUSHSIG)
 				pthread_kill (creq->wthread->thread, SIGUSR2);
+			xpthread_mutex_unlock(&tp->lock);
 		}
 	}
-	xpthread_mutex_unlock(&conn->srv->lock);
+	xpthread_mutex_unlock(&conn->lock);
+
+	/* np_req_unref () takes conn->lock via np_conn_decref () */
+	for (creq = dead; creq != NULL; creq = nextreq) {
+		nextreq = creq->next;
+		np_req_unref(creq);
+	}
 }
 
+/* Free queued replies.  Called with conn->wlock held and no send
+ * in progress.
+ */
+static void
+np_conn_sendq_discard(Npconn *conn)
+{
+	Npfcall *fc;
+
+	while ((fc = conn->sq_first)) {
+		conn->sq_first = fc->next;
+		np_free_fcall (fc);
+	}
+	conn->sq_last = NULL;
+	conn->sq_off = 0;
+	conn->sq_bytes = 0;
+}
+
+/* Re-arm input on a connection paused by np_conn_sendq_full () once its
+ * queue has drained to half of srv->sendqmax, or replies are being
+ * discarded.  Called with conn->wlock held.
+ */
+static void
+np_conn_sendq_resume(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+
+	if (!conn->sq_paused)
+		return;
+	if (!conn->sq_dead && conn->sq_bytes > srv->sendqmax / 2)
+		return;
+	conn->sq_paused = 0;
+	if (np_reactor_resume (srv, conn) < 0)
+		np_logerr (srv, "epoll_ctl - cannot resume input from '%s'",
+			   conn->client_id);
+}
+
+/* Drop 'n' sent bytes from the head of the send queue.
+ */
+static void
+np_conn_sendq_advance(Npconn *conn, int n)
+{
+	Npfcall *fc;
+
+	while (n > 0) {
+		fc = conn->sq_first;
+		if (n < fc->size - conn->sq_off) {
+			conn->sq_off += n;
+			break;
+		}
+		n -= fc->size - conn->sq_off;
+		conn->sq_first = fc->next;
+		if (conn->sq_last == fc)
+			conn->sq_last = NULL;
+		conn->sq_off = 0;
+		conn->sq_bytes -= fc->size;
+		np_free_fcall (fc);
+	}
+	np_conn_sendq_resume (conn);
+}
+
+/* Send queued replies until the queue is empty or the transport would
+ * block.  In the latter case the reactor calls np_conn_write_ready () once
+ * the transport can take more, and until then the conn stays busy.
+ * Replies queued meanwhile by other threads are picked up here, so several
+ * are usually gathered into one send.
+ * Called with conn->wlock held; it is dropped while sending.
+ */
+static void
+np_conn_sendq_drain(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+	Npfcall *first, *last;
+	u32 off;
+	int n;
+
+	conn->sq_busy = 1;
+	while (conn->sq_first && !conn->sq_dead) {
+		first = conn->sq_first;
+		last = conn->sq_last;
+		off = conn->sq_off;
+		xpthread_mutex_unlock(&conn->wlock);
+		n = np_trans_sendv(conn->trans, first, last, off);
+		xpthread_mutex_lock(&conn->wlock);
+		if (n >= 0) {
+			np_conn_sendq_advance (conn, n);
+			continue;
+		}
+		if (np_rerror () == EINTR)
+			continue;
+		if (np_rerror () == EAGAIN) {
+			np_conn_incref (conn); /* dropped by np_conn_write_ready */
+			if (np_reactor_want_write (srv, conn) == 0)
+				return;
+			np_conn_decref (conn);
+		}
+		np_logerr (srv, "send to '%s'", conn->client_id);
+		conn->sq_dead = 1;
+	}
+	if (conn->sq_dead) {
+		np_conn_sendq_discard (conn);
+		np_conn_sendq_resume (conn);
+	}
+	conn->sq_busy = 0;
+}
+
+/* Called from a reactor thread when a busy conn's transport is writable.
+ */
+void
+np_conn_write_ready(Npconn *conn)
+{
+	xpthread_mutex_lock(&conn->wlock);
+	NP_ASSERT(conn->sq_busy);
+	np_conn_sendq_drain (conn);
+	xpthread_mutex_unlock(&conn->wlock);
+	np_conn_decref (conn);
+}
+
+/* Called from a reactor thread after draining a connection's input.
+ * Apply backpressure to a client that is not reading its replies: if more
+ * than srv->sendqmax bytes are queued, mark the connection paused and
+ * return 1, and the caller leaves input disarmed.  Sending re-arms it.
+ * Worker threads never wait on a slow client.
+ */
+int
+np_conn_sendq_full(Npconn *conn)
+{
+	u64 max = conn->srv->sendqmax;
+	int full = 0;
+
+	if (conn->sq_fd < 0 || max == 0)
+		return 0;
+	xpthread_mutex_lock(&conn->wlock);
+	if (conn->sq_bytes > max && !conn->sq_dead) {
+		conn->sq_paused = 1;
+		full = 1;
+	}
+	xpthread_mutex_unlock(&conn->wlock);
+	return full;
+}
+
+/* Reactor connections queue the reply and send it if no other thread is
+ * sending, without blocking.  Others send it synchronously.
+ */
 void
 np_conn_respond(Npreq *req)
 {
@@ -255,11 +567,41 @@ np_conn_respond(Npreq *req)
 	Npfcall *rc = req->rcall;
 
 	_debug_trace (srv, rc);
+	if (conn->sq_fd < 0) {
+		xpthread_mutex_lock(&conn->wlock);
+		n = np_trans_send(conn->trans, rc);
+		xpthread_mutex_unlock(&conn->wlock);
+		if (n < 0)
+			np_logerr (srv, "send to '%s'", conn->client_id);
+		return;
+	}
+	if (rc->size <= SENDQ_COPYMAX && !rc->pipe) {
+		if (!(rc = np_alloc_fcall (req->rcall->size))) {
+			np_logmsg (srv, "out of memory - dropping reply to '%s'",
+				   conn->client_id);
+			return;
+		}
+		memcpy (rc->pkt, req->rcall->pkt, req->rcall->size);
+		rc->size = req->rcall->size;
+	} else
+		req->rcall = NULL;
+	rc->next = NULL;
+
 	xpthread_mutex_lock(&conn->wlock);
-	n = np_trans_send(conn->trans, rc);
+	if (conn->sq_dead) {
+		xpthread_mutex_unlock(&conn->wlock);
+		np_free_fcall (rc);
+		return;
+	}
+	if (conn->sq_last)
+		conn->sq_last->next = rc;
+	else
+		conn->sq_first = rc;
+	conn->sq_last = rc;
+	conn->sq_bytes += rc->size;
+	if (!conn->sq_busy)
+		np_conn_sendq_drain (conn);
 	xpthread_mutex_unlock(&conn->wlock);
-	if (n < 0)
-		np_logerr (srv, "send to '%s'", conn->client_id);
 }
 
 char *
@@ -54,7 +54,17 @@ np_version(Npreq *req, Npfcall *tc)
 		msize = req->conn->msize;
 	if (msize < req->conn->msize)
 		req->conn->msize = msize; /* conn->msize can only be reduced */
-	if (np_strcmp(&tc->u.tversion.version, "9P2000.L") == 0) {
+	if (np_strcmp(&tc->u.tversion.version, P9_DIODEXT_VERSION) == 0) {
+		/* Client knows our extensions - agree and enable them.
+		 */
+		if (!(rc = np_create_rversion(msize, P9_DIODEXT_VERSION))) {
+			np_uerror(ENOMEM);
+			np_logerr(srv, "version: out of memory");
+		} else
+			req->conn->flags |= CONN_FLAGS_DIODEXT;
+	} else if (np_strncmp(&tc->u.tversion.version, "9P2000.L", 8) == 0) {
+		/* Fall back to plain 9P2000.L for other dialects of it.
+		 */
 		if (!(rc = np_create_rversion(msize, "9P2000.L"))) {
 			np_uerror(ENOMEM);
 			np_logerr(srv, "version: out of memory");
@@ -270,45 +280,48 @@ int
 np_flush(Npreq *req, Npfcall *tc)
 {
 	u16 oldtag = tc->u.tflush.oldtag;
-	Npreq *creq;
+	Npreq *creq, *oldflush = NULL;
 	int ret = 1;
 	Nptpool *tp;
-	Npsrv *srv = req->conn->srv;
+	Npconn *conn = req->conn;
+	Npsrv *srv = conn->srv;
 
-	xpthread_mutex_lock(&req->conn->srv->lock);
-	for (tp = req->conn->srv->tpool; tp != NULL; tp = tp->next) {
-		for(creq = tp->reqs_first; creq != NULL; creq = creq->next) {
-			if (!(creq->conn==req->conn && creq->tag==oldtag))
-				continue;
-			if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
-				np_logmsg (srv, "flush(early): req type %d",
-					   creq->tcall->type);
-			}
-			np_srv_remove_req(tp, creq);
-			np_req_unref(creq);
-			goto done;
-		}
-		for(creq = tp->workreqs; creq != NULL; creq = creq->next) {
-			if (!(creq->conn==req->conn && creq->tag==oldtag))
-				continue;
-			if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
-				np_logmsg (srv, "flush(late): req type %d",
-					   creq->tcall->type);
-			}
-			/* only the most recent flush must be responded to */
-			if (creq->flushreq)
-				np_req_unref(creq->flushreq);
-			creq->flushreq = req;
-			ret = 0; /* reply is delayed until after req */
-			if (req->conn->srv->flags & SRV_FLAGS_FLUSHSIG)
-				pthread_kill (creq->wthread->thread, SIGUSR2);
-			goto done;
-		}
+	xpthread_mutex_lock(&conn->lock);
+	if (!(creq = np_conn_find_req (conn, oldtag))) {
+		if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH))
+			np_logmsg (srv, "flush: tag %d not found", oldtag);
+		goto done;
 	}
-	if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH))
-		np_logmsg (srv, "flush: tag %d not found", oldtag);
+	tp = creq->tpool;
+	xpthread_mutex_lock(&tp->lock);
+	if (!creq->wthread) {
+		if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
+			np_logmsg (srv, "flush(early): req type %d",
+				   creq->tcall->type);
+		}
+		np_srv_remove_req(tp, creq);
+		xpthread_mutex_unlock(&tp->lock);
+		np_conn_remove_req(conn, creq);
+		xpthread_mutex_unlock(&conn->lock);
+		np_req_unref(creq);
+		return ret;
+	}
+	if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
+		np_logmsg (srv, "flush(late): req type %d",
+			   creq->tcall->type);
+	}
+	/* only the most recent flush must be responded to */
+	oldflush = creq->flushreq;
+	creq->flushreq = req;
+	ret = 0; /* reply is delayed until after req */
+	if (srv->flags & SRV_FLAGS_FLUSHSIG)
+		pthread_kill (creq->wthread->thread, SIGUSR2);
+	xpthread_mutex_unlock(&tp->lock);
 done:
-	xpthread_mutex_unlock(&req->conn->srv->lock);
+	xpthread_mutex_unlock(&conn->lock);
+	/* np_req_unref () takes conn->lock via np_conn_decref () */
+	if (oldflush)
+		np_req_unref(oldflush);
 	return ret;
 }
 
@@ -476,12 +489,24 @@ np_write(Npreq *req, Npfcall *tc)
 	Npconn *conn = req->conn;
 	Npfid *fid = req->fid;
 	Npfcall *rc = NULL;
+	u8 *buf = NULL;
 
 	if (!fid) {
 		np_uerror (EIO);
 		np_logerr (conn->srv, "write: invalid fid");
 		goto done;
 	}
+	/* Only srv->write can take payload left in a pipe by the transport.
+	 */
+	if (tc->pipe && (fid->type & (P9_QTAUTH | P9_QTTMP))) {
+		if (!(buf = malloc (tc->u.twrite.count))) {
+			np_uerror (ENOMEM);
+			goto done;
+		}
+		if (np_twrite_copyout (tc, buf) < 0)
+			goto done;
+		tc->u.twrite.data = buf;
+	}
 	if (fid->type & P9_QTAUTH) {
 		if (conn->srv->auth) {
 			n = conn->srv->auth->write(fid, tc->u.twrite.offset,
@@ -521,6 +546,10 @@ np_write(Npreq *req, Npfcall *tc)
 					 tc->u.twrite.data, req);
 	}
 done:
+	if (buf) {
+		tc->u.twrite.data = NULL;
+		free (buf);
+	}
 	return rc;
 }
 
@@ -1033,6 +1062,45 @@ done:
 	return rc;
 }
 
+Npfcall *
+np_readdirplus(Npreq *req, Npfcall *tc)
+{
+	Npfid *fid = req->fid;
+	Npfcall *rc = NULL;
+
+	if (!(req->conn->flags & CONN_FLAGS_DIODEXT)) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (!fid) {
+		np_uerror (EIO);
+		np_logerr (req->conn->srv, "readdirplus: invalid fid");
+		goto done;
+	}
+	if (tc->u.treaddirplus.count + P9_READDIRHDRSZ > req->conn->msize) {
+		np_uerror(EIO);
+		np_logerr (req->conn->srv, "readdirplus: count %u too large",
+			   tc->u.treaddirplus.count);
+		goto done;
+	}
+	if (fid->type & P9_QTTMP) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (np_setfsid (req, fid->user, -1) < 0)
+		goto done;
+	if (!req->conn->srv->readdirplus) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	rc = (*req->conn->srv->readdirplus)(fid, tc->u.treaddirplus.offset,
+					    tc->u.treaddirplus.count,
+					    tc->u.treaddirplus.request_mask,
+					    req);
+done:
+	return rc;
+}
+
 Npfcall *
 np_fsync(Npreq *req, Npfcall *tc)
 {
@@ -1212,7 +1280,6 @@ done:
 
 /* renameat and unlinkat are new, post 2.6.38.  Kernels will fall back
  * to rename and remove if they get EOPNOTSUPP error.
- * FIXME: implement these
  */
 
 Npfcall *
@@ -1240,6 +1307,10 @@ np_renameat (Npreq *req, Npfcall *tc)
 		np_logerr (req->conn->srv, "renameat: invalid newdirfid");
 		goto done;
 	}
+	if (newdirfid->type & P9_QTTMP) {
+		np_uerror (EPERM);
+		goto done;
+	}
 	if (np_setfsid (req, newdirfid->user, -1) < 0)
 		goto done;
 	if (!req->conn->srv->renameat) {
@@ -1281,7 +1352,52 @@ np_unlinkat (Npreq *req, Npfcall *tc)
 		np_uerror (95); /* v9fs expects this not ENOSYS for this op */
 		goto done;
 	}
-	rc = (*req->conn->srv->unlinkat)(dirfid, &tc->u.tunlinkat.name);
+	rc = (*req->conn->srv->unlinkat)(dirfid, &tc->u.tunlinkat.name,
+					 tc->u.tunlinkat.flags);
+done:
+	return rc;
+}
+
+Npfcall *
+np_copyrange (Npreq *req, Npfcall *tc)
+{
+	Npfid *srcfid = req->fid;
+	Npfid *dstfid = NULL;
+	Npfcall *rc = NULL;
+
+	if (!(req->conn->flags & CONN_FLAGS_DIODEXT)) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (!srcfid) {
+		np_uerror (EIO);
+		np_logerr (req->conn->srv, "copyrange: invalid srcfid");
+		goto done;
+	}
+	if (!(dstfid = np_fid_find(req->conn, tc->u.tcopyrange.dstfid))) {
+		np_uerror (EIO);
+		np_logerr (req->conn->srv, "copyrange: invalid dstfid");
+		goto done;
+	}
+	if (dstfid->flags & FID_FLAGS_ROFS) {
+		np_uerror (EROFS);
+		goto done;
+	}
+	if ((srcfid->type | dstfid->type) & (P9_QTAUTH | P9_QTTMP)) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	if (np_setfsid (req, dstfid->user, -1) < 0)
+		goto done;
+	if (!req->conn->srv->copyrange) {
+		np_uerror (ENOSYS);
+		goto done;
+	}
+	rc = (*req->conn->srv->copyrange)(srcfid, tc->u.tcopyrange.srcoff,
+					  dstfid, tc->u.tcopyrange.dstoff,
+					  tc->u.tcopyrange.count);
 done:
+	if (dstfid)
+		np_fid_decref (&dstfid);
 	return rc;
 }
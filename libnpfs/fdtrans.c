@@ -31,23 +31,79 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "9p.h"
 #include "npfs.h"
+#include "xpthread.h"
 #include "npfsimpl.h"
 
 typedef struct Fdtrans Fdtrans;
 
+/* Receive buffers are drawn from per-connection size classes so a small
+ * request does not cost an msize allocation.  The last class holds
+ * buffers of the msize in effect when they were allocated; msize can
+ * only shrink, so they remain large enough.
+ */
+#define RBUF_NCLASS	5
+#define RBUF_LARGE	(RBUF_NCLASS - 1)
+static const u32 rbuf_class_size[RBUF_NCLASS] = {
+	256, 2048, 16384, 131072, 0
+};
+static const int rbuf_class_max[RBUF_NCLASS] = {
+	64, 32, 16, 8, 4
+};
+
+/* Bytes are read into a small staging buffer until a frame header is
+ * seen; the remainder of a large frame is read directly into its fcall.
+ */
+#define RBUF_STAGESIZE	8192
+
+/* If the server's write op accepts it, the payload of a large Twrite is
+ * spliced from fdin into a pipe rather than read into a buffer.
+ */
+#define TWRITE_SPLICE_MIN	65536
+#define TWRITE_HDRSZ	(4 + 1 + 2 + 4 + 8 + 4)
+
+/* Most replies gathered into one sendmsg/writev.
+ */
+#define SENDV_MAXIOV	64
+
+typedef struct {
+	int		n;
+	Npfcall		*free[64];
+} Rbufclass;
+
 struct Fdtrans {
 	Nptrans*	trans;
 	int 		fdin;
 	int		fdout;
-	Npfcall		*fc;
-	int		fc_len;  /* used bytes in fc */
+	Npfcall		*fc;	 /* partially received frame, if any */
+	u32		fc_len;  /* used bytes in fc */
+	u8		*stage;
+	int		stage_pos;
+	int		stage_len;
+	pthread_mutex_t	lock;	 /* protects pool */
+	Rbufclass	pool[RBUF_NCLASS];
+	int		notsock; /* fdout is not a socket */
+	int		nosplice; /* fdin does not support splice */
 };
 
 static int np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a);
 static int np_fdtrans_send(Npfcall *fc, void *a);
 static void np_fdtrans_destroy(void *a);
+static int np_fdtrans_pollfd(void *a);
+static int np_fdtrans_pollfdout(void *a);
+static int np_fdtrans_sendv(Npfcall *first, Npfcall *last, u32 off, void *a);
+static void np_fdtrans_release(Npfcall *fc, void *a);
+#if HAVE_SPLICE
+static int np_fdtrans_sendpipe(Npfcall *fc, void *a);
+#endif
 
 Nptrans *
 np_fdtrans_create(int fdin, int fdout)
@@ -60,6 +116,13 @@ np_fdtrans_create(int fdin, int fdout)
 		np_uerror(ENOMEM);
 		return NULL;
 	}
+	memset(fdt, 0, sizeof(*fdt));
+	if (!(fdt->stage = malloc(RBUF_STAGESIZE))) {
+		free(fdt);
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	pthread_mutex_init(&fdt->lock, NULL);
 
 	fdt->fdin = fdin;
 	fdt->fdout = fdout;
@@ -69,10 +132,19 @@ np_fdtrans_create(int fdin, int fdout)
 				   np_fdtrans_send,
 				   np_fdtrans_destroy);
 	if (!npt) {
+		pthread_mutex_destroy(&fdt->lock);
+		free(fdt->stage);
 		free(fdt);
 		return NULL;
 	}
 
+	npt->pollfd = np_fdtrans_pollfd;
+	npt->pollfdout = np_fdtrans_pollfdout;
+	npt->sendv = np_fdtrans_sendv;
+	npt->release = np_fdtrans_release;
+#if HAVE_SPLICE
+	npt->sendpipe = np_fdtrans_sendpipe;
+#endif
 	fdt->trans = npt;
 	return npt;
 }
@@ -81,6 +153,7 @@ static void
 np_fdtrans_destroy(void *a)
 {
 	Fdtrans *fdt = (Fdtrans *)a;
+	int i, j;
 
 	fdt = a;
 	if (fdt->fdin >= 0)
@@ -88,85 +161,354 @@ np_fdtrans_destroy(void *a)
 	if (fdt->fdout >= 0 && fdt->fdout != fdt->fdin)
 		(void)close(fdt->fdout);
 	if (fdt->fc)
-		free(fdt->fc);
+		np_free_fcall(fdt->fc);
+	for (i = 0; i < RBUF_NCLASS; i++) {
+		for (j = 0; j < fdt->pool[i].n; j++)
+			free(fdt->pool[i].free[j]);
+	}
+	pthread_mutex_destroy(&fdt->lock);
+	free(fdt->stage);
 
 	free(fdt);
 }
 
-/* This function must perform request framing, and return with one request
- * or an EOF/error.  If we read some extra bytes after a full request,
- * store the extra in fdt->fc and start reading into that next time instead
- * of allocating a fresh buffer.
- * N.B. msize starts out at max for the server and can shrink if client
- * negotiates a smaller one with Tversion.  It cannot grow, therefore
- * the allocated size of cached 'fc' from a preveious call will always be
- * >= the msize of the current call.  See fcall.c::np_version().
- */
 static int
-np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a)
+np_fdtrans_pollfd(void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+
+	return fdt->fdin;
+}
+
+static int
+np_fdtrans_pollfdout(void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+
+	return fdt->fdout;
+}
+
+static int
+_rbuf_class(u32 size)
+{
+	int i;
+
+	for (i = 0; i < RBUF_LARGE; i++) {
+		if (size <= rbuf_class_size[i])
+			break;
+	}
+	return i;
+}
+
+/* Get a buffer for a frame of 'size' bytes, recycling one if possible.
+ * The buffers are individually malloc'd, so a caller that does not
+ * return them with np_trans_release () may simply free them.
+ */
+static Npfcall *
+_rbuf_get(Fdtrans *fdt, u32 size, u32 msize)
+{
+	int c = _rbuf_class(size);
+	u32 cap = (c == RBUF_LARGE ? msize : rbuf_class_size[c]);
+	Npfcall *fc = NULL;
+
+	xpthread_mutex_lock(&fdt->lock);
+	if (fdt->pool[c].n > 0)
+		fc = fdt->pool[c].free[--fdt->pool[c].n];
+	xpthread_mutex_unlock(&fdt->lock);
+	if (fc)
+		fdt->trans->rbufhit++;
+	else {
+		if (!(fc = np_alloc_fcall(cap)))
+			return NULL;
+		fdt->trans->rbufmiss++;
+	}
+	fc->size = size;
+	return fc;
+}
+
+static void
+np_fdtrans_release(Npfcall *fc, void *a)
 {
 	Fdtrans *fdt = (Fdtrans *)a;
+	int c = _rbuf_class(fc->size);
+
+	if (fc->pipe) {
+		np_free_fcall(fc);
+		return;
+	}
+	xpthread_mutex_lock(&fdt->lock);
+	if (fdt->pool[c].n < rbuf_class_max[c]) {
+		fdt->pool[c].free[fdt->pool[c].n++] = fc;
+		fc = NULL;
+	}
+	xpthread_mutex_unlock(&fdt->lock);
+	if (fc)
+		free(fc);
+}
+
+#if HAVE_SPLICE
+/* If the frame at the head of the staging buffer is a large Twrite,
+ * get an fcall holding only its header, with a pipe to receive the payload.
+ * Returns 1 if *fcp was set, 0 if the frame should be received normally,
+ * or -1 if more of the header must be read before deciding.
+ */
+static int
+_pipe_frame(Fdtrans *fdt, u32 size, u32 msize, Npfcall **fcp)
+{
+	u8 *hdr = fdt->stage + fdt->stage_pos;
 	Npfcall *fc;
-	u32 size;
-	int n, len;
-
-	if (fdt->fc) {
-		fc = fdt->fc;
-		fdt->fc = NULL;
-		len = fdt->fc_len;
-		size = np_peek_size(fc->pkt, len); /* 0 if len < 4 */
-		if (size > msize) {
-			np_uerror(EPROTO);
-			goto error;
+	Nppipe *p;
+	u32 count;
+
+	if (!fdt->trans->splicewrite || fdt->nosplice
+				     || size < TWRITE_SPLICE_MIN)
+		return 0;
+	if (fdt->stage_len - fdt->stage_pos < TWRITE_HDRSZ)
+		return -1;
+	count = np_peek_size(hdr + TWRITE_HDRSZ - 4, 4);
+	if (hdr[4] != P9_TWRITE || count != size - TWRITE_HDRSZ)
+		return 0;
+	if (!(p = np_pipe_get(msize))) {
+		np_uerror(0);
+		return 0;
+	}
+	if (p->size < count || !(fc = np_alloc_fcall(TWRITE_HDRSZ))) {
+		np_pipe_put(p);
+		return 0;
+	}
+	memcpy(fc->pkt, hdr, TWRITE_HDRSZ);
+	fdt->stage_pos += TWRITE_HDRSZ;
+	fc->size = size;
+	fc->pipe = p;
+	*fcp = fc;
+	return 1;
+}
+
+/* The pipe returns EAGAIN when full, which can happen before 'size' bytes
+ * if the input arrives in small pieces.  Tell that apart from fdin
+ * having no data.
+ */
+static int
+_pipe_full(Fdtrans *fdt)
+{
+	int avail;
+
+	if (!(fcntl(fdt->fdin, F_GETFL) & O_NONBLOCK))
+		return 1;
+	if (ioctl(fdt->fdin, FIONREAD, &avail) == 0 && avail > 0)
+		return 1;
+	return 0;
+}
+
+/* Receive the payload of a frame set up by _pipe_frame () into its pipe,
+ * starting with any bytes already staged.  Returns 1 when complete, 0 on
+ * EOF, -1 on error with errno set, or 2 if the pipe cannot take the rest
+ * and the frame must be received normally with _unpipe ().
+ */
+static int
+_recv_pipe(Fdtrans *fdt, Npfcall *fc)
+{
+	Nppipe *p = fc->pipe;
+	u32 count = fc->size - TWRITE_HDRSZ;
+	int n;
+
+	while (p->len < count && fdt->stage_pos < fdt->stage_len) {
+		n = fdt->stage_len - fdt->stage_pos;
+		if (n > count - p->len)
+			n = count - p->len;
+		n = write(p->fd[1], fdt->stage + fdt->stage_pos, n);
+		if (n < 0)
+			return (errno == EAGAIN ? 2 : -1);
+		fdt->stage_pos += n;
+		p->len += n;
+	}
+	while (p->len < count) {
+		n = splice(fdt->fdin, NULL, p->fd[1], NULL, count - p->len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			p->len += n;
+			continue;
 		}
-	} else {
-		if (!(fc = np_alloc_fcall(msize))) {
-			np_uerror (ENOMEM);
-			goto error;
+		if (n < 0 && errno == EINVAL) {
+			fdt->nosplice = 1;
+			return 2;
 		}
-		len = 0;
-		size = 0;
+		if (n < 0 && errno == EAGAIN && _pipe_full(fdt))
+			return 2;
+		return n;
 	}
-	while (size == 0 || len < size) {
-		n = read(fdt->fdin, fc->pkt + len, msize - len);
+	return 1;
+}
+
+/* Move a partially received pipe frame into a regular receive buffer.
+ * On success the pipe fcall is freed and *lenp is set to the bytes received.
+ */
+static Npfcall *
+_unpipe(Fdtrans *fdt, Npfcall *fc, u32 msize, u32 *lenp)
+{
+	Nppipe *p = fc->pipe;
+	Npfcall *nfc;
+	u32 len = TWRITE_HDRSZ;
+	int n;
+
+	if (!(nfc = _rbuf_get(fdt, fc->size, msize))) {
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	memcpy(nfc->pkt, fc->pkt, TWRITE_HDRSZ);
+	while (p->len > 0) {
+		n = read(p->fd[0], nfc->pkt + len, p->len);
 		if (n < 0 && errno == EINTR)
 			continue;
-		if (n < 0) {
-			np_uerror(errno);
-			goto error;
+		if (n <= 0) {
+			np_uerror(n < 0 ? errno : EIO);
+			free(nfc);
+			return NULL;
 		}
-		if (n == 0)
-			goto eof;
+		p->len -= n;
 		len += n;
-		if (size == 0) {
-			size = np_peek_size(fc->pkt, len);
-			if (size > msize) {
+	}
+	np_free_fcall(fc);
+	*lenp = len;
+	return nfc;
+}
+#endif
+
+/* This function must perform request framing, and return with one request
+ * or an EOF/error.  Input is read into the staging buffer until a frame's
+ * size header is seen, then a buffer of the right size class is taken from
+ * the pool and the frame is copied/read into it.  Extra bytes after a full
+ * request stay in the staging buffer for the next call.
+ * N.B. msize starts out at max for the server and can shrink if client
+ * negotiates a smaller one with Tversion.  It cannot grow.
+ * See fcall.c::np_version().
+ * If fdin is non-blocking (reactor mode) and a full request is not yet
+ * available, the partial request is kept in fdt->fc and we fail with
+ * EAGAIN.  The next call picks up where this one left off.
+ * A large Twrite may be returned with only its header in fc->pkt and the
+ * payload in fc->pipe (see _pipe_frame ()).
+ */
+static int
+np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+	Npfcall *fc = fdt->fc;
+	u32 size, len = fdt->fc_len;
+	int n, more = 0;
+
+	fdt->fc = NULL;
+	for (;;) {
+		if (!fc && fdt->stage_len - fdt->stage_pos >= 4) {
+			size = np_peek_size(fdt->stage + fdt->stage_pos, 4);
+			if (size < 7 || size > msize) {
 				np_uerror(EPROTO);
 				goto error;
 			}
+#if HAVE_SPLICE
+			more = _pipe_frame(fdt, size, msize, &fc);
+#endif
+			if (!fc && !more
+				&& !(fc = _rbuf_get(fdt, size, msize))) {
+				np_uerror(ENOMEM);
+				goto error;
+			}
+			len = 0;
 		}
-	}
-	if (len > size) {
-		if (!(fdt->fc = np_alloc_fcall (msize))) {
-			np_uerror(ENOMEM);
+#if HAVE_SPLICE
+		if (fc && fc->pipe) {
+			Npfcall *nfc;
+
+			n = _recv_pipe(fdt, fc);
+			if (n == 1)
+				break;
+			if (n == 2) {
+				if (!(nfc = _unpipe(fdt, fc, msize, &len)))
+					goto error;
+				fc = nfc;
+				continue;
+			}
+			goto readerr;
+		}
+#endif
+		if (fc) {
+			n = fdt->stage_len - fdt->stage_pos;
+			if (n > fc->size - len)
+				n = fc->size - len;
+			memcpy(fc->pkt + len, fdt->stage + fdt->stage_pos, n);
+			fdt->stage_pos += n;
+			len += n;
+			if (len == fc->size)
+				break;
+			/* staging buffer is empty - read the rest directly */
+			if (fc->size - len >= RBUF_STAGESIZE) {
+				n = read(fdt->fdin, fc->pkt + len, fc->size - len);
+				if (n > 0) {
+					len += n;
+					continue;
+				}
+				goto readerr;
+			}
+		}
+		if (fdt->stage_pos == fdt->stage_len)
+			fdt->stage_pos = fdt->stage_len = 0;
+		else if (fdt->stage_pos > 0) {
+			fdt->stage_len -= fdt->stage_pos;
+			memmove(fdt->stage, fdt->stage + fdt->stage_pos,
+				fdt->stage_len);
+			fdt->stage_pos = 0;
+		}
+		n = read(fdt->fdin, fdt->stage + fdt->stage_len,
+			 RBUF_STAGESIZE - fdt->stage_len);
+		if (n > 0) {
+			fdt->stage_len += n;
+			continue;
+		}
+readerr:
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			fdt->fc = fc;
+			fdt->fc_len = len;
+			np_uerror(EAGAIN);
+			return -1;
+		}
+		if (n < 0) {
+			np_uerror(errno);
 			goto error;
 		}
-		fdt->fc_len = len - size;
-		memcpy (fdt->fc->pkt, fc->pkt + size, fdt->fc_len);
+		goto eof;
 	}
-	fc->size = size;
 	*fcp = fc;
 	return 0;
 eof:
-	free(fc);
+	if (fc)
+		np_free_fcall(fc);
 	*fcp = NULL;
 	return 0;
 error:
 	if (fc)
-		free (fc);
+		np_free_fcall(fc);
 	return -1;
 }
 
+/* fdout may share a non-blocking file description with fdin
+ * in reactor mode.  Wait for it to drain so a write can be retried.
+ */
+static int
+_waitout(Fdtrans *fdt)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fdt->fdout;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		np_uerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
 static int
 np_fdtrans_send(Npfcall *fc, void *a)
 {
@@ -180,13 +522,153 @@ np_fdtrans_send(Npfcall *fc, void *a)
 		n = write(fdt->fdout, data + len, size - len);
 		if (n < 0 && errno == EINTR)
 			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (_waitout(fdt) < 0)
+				goto error;
+			continue;
+		}
+		if (n < 0) {
+			np_uerror(errno);
+			goto error;
+		}
+		len += n;
+	}
+	return len;
+error:
+	return -1;
+}
+
+#if HAVE_SPLICE
+/* Send an Rread whose payload is held in fc->pipe.  The header is sent
+ * with MSG_MORE so it is coalesced with the payload, which is then
+ * spliced from the pipe to fdout.
+ */
+static int
+np_fdtrans_sendpipe(Npfcall *fc, void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+	Nppipe *p = fc->pipe;
+	u32 hsize = fc->size - p->len;
+	int len = 0;
+	int n;
+
+	while (len < hsize) {
+		if (fdt->notsock)
+			n = write(fdt->fdout, fc->pkt + len, hsize - len);
+		else {
+			n = send(fdt->fdout, fc->pkt + len, hsize - len,
+				 p->len > 0 ? MSG_MORE : 0);
+			if (n < 0 && errno == ENOTSOCK) {
+				fdt->notsock = 1;
+				continue;
+			}
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (_waitout(fdt) < 0)
+				goto error;
+			continue;
+		}
 		if (n < 0) {
 			np_uerror(errno);
 			goto error;
 		}
 		len += n;
 	}
+	while (p->len > 0) {
+		n = splice(p->fd[0], NULL, fdt->fdout, NULL, p->len,
+			   SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (_waitout(fdt) < 0)
+				goto error;
+			continue;
+		}
+		if (n <= 0) {
+			np_uerror(n < 0 ? errno : EIO);
+			goto error;
+		}
+		p->len -= n;
+		len += n;
+	}
 	return len;
 error:
 	return -1;
 }
+#endif
+
+/* Send fcalls 'first' through 'last' as far as possible without blocking,
+ * starting 'off' bytes into 'first'.  Consecutive fcalls are gathered into
+ * one sendmsg (writev if fdout is not a socket).  An Rread with its payload
+ * in a pipe ends the batch: its header is sent with MSG_MORE and then the
+ * payload is spliced.  fdout is non-blocking.
+ * Returns the number of bytes sent, or -1 with np_rerror () set.
+ */
+static int
+np_fdtrans_sendv(Npfcall *first, Npfcall *last, u32 off, void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+	struct iovec iov[SENDV_MAXIOV];
+	struct msghdr msg;
+	Npfcall *fc, *pfc = NULL;
+	int niov = 0, len = 0, n;
+	u32 hsize, ilen = 0;
+
+	for (fc = first; fc != NULL; fc = (fc == last ? NULL : fc->next)) {
+		hsize = fc->size;
+		if (fc->pipe)
+			hsize -= fc->u.rread.count;
+		if (off < hsize) {
+			iov[niov].iov_base = fc->pkt + off;
+			iov[niov].iov_len = hsize - off;
+			ilen += hsize - off;
+			niov++;
+		}
+		if (fc->pipe) {
+			pfc = fc;
+			break;
+		}
+		off = 0;
+		if (niov == SENDV_MAXIOV)
+			break;
+	}
+	if (niov > 0) {
+		if (!fdt->notsock) {
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = niov;
+			n = sendmsg(fdt->fdout, &msg,
+				    pfc && pfc->pipe->len > 0 ? MSG_MORE : 0);
+			if (n < 0 && errno == ENOTSOCK) {
+				fdt->notsock = 1;
+				n = writev(fdt->fdout, iov, niov);
+			}
+		} else
+			n = writev(fdt->fdout, iov, niov);
+		if (n < 0) {
+			np_uerror(errno == EWOULDBLOCK ? EAGAIN : errno);
+			return -1;
+		}
+		len = n;
+		if (len < ilen)
+			return len;
+	}
+#if HAVE_SPLICE
+	if (pfc && pfc->pipe->len > 0) {
+		n = splice(pfc->pipe->fd[0], NULL, fdt->fdout, NULL,
+			   pfc->pipe->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			pfc->pipe->len -= n;
+			len += n;
+		} else if (len == 0) {
+			np_uerror(n < 0 ? errno : EIO);
+			if (np_rerror() == EWOULDBLOCK)
+				np_uerror(EAGAIN);
+			return -1;
+		}
+	}
+#endif
+	return len;
+}
@@ -107,6 +107,24 @@ np_printdents(char *s, int len, u8 *buf, int buflen)
 	np_sndump(s, len, buf, buflen < 64 ? buflen : 64);
 }
 
+static void
+np_printcompound(char *s, int len, u16 count, u8 *buf, int buflen)
+{
+	Npfcall fc;
+	int i, n, off = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!(n = np_deserialize_compound(&fc, buf + off, buflen - off)))
+			break;
+		off += n;
+		spf (s, len, "\n  ");
+		n = strlen(s);
+		if (n >= len - 1)
+			break;
+		np_snprintfcall(s + n, len - n, &fc);
+	}
+}
+
 static void
 np_printdata(char *s, int len, u8 *buf, int buflen)
 {
@@ -404,6 +422,44 @@ np_snprintfcall(char *s, int len, Npfcall *fc)
 		spf (s, len, " count %"PRIu32, fc->u.rreaddir.count);
 		np_printdents(s, len, fc->u.rreaddir.data, fc->u.rreaddir.count);
 		break;
+	case P9_TCOMPOUND:
+		spf (s, len, "P9_TCOMPOUND tag %u", fc->tag);
+		spf (s, len, " count %u", fc->u.tcompound.count);
+		np_printcompound(s, len, fc->u.tcompound.count,
+				 fc->u.tcompound.data, fc->u.tcompound.size);
+		break;
+	case P9_RCOMPOUND:
+		spf (s, len, "P9_RCOMPOUND tag %u", fc->tag);
+		spf (s, len, " count %u", fc->u.rcompound.count);
+		np_printcompound(s, len, fc->u.rcompound.count,
+				 fc->u.rcompound.data, fc->u.rcompound.size);
+		break;
+	case P9_TCOPYRANGE:
+		spf (s, len, "P9_TCOPYRANGE tag %u", fc->tag);
+		spf (s, len, " srcfid %"PRIu32, fc->u.tcopyrange.srcfid);
+		spf (s, len, " srcoff %"PRIu64, fc->u.tcopyrange.srcoff);
+		spf (s, len, " dstfid %"PRIu32, fc->u.tcopyrange.dstfid);
+		spf (s, len, " dstoff %"PRIu64, fc->u.tcopyrange.dstoff);
+		spf (s, len, " count %"PRIu64, fc->u.tcopyrange.count);
+		break;
+	case P9_RCOPYRANGE:
+		spf (s, len, "P9_RCOPYRANGE tag %u", fc->tag);
+		spf (s, len, " count %"PRIu64, fc->u.rcopyrange.count);
+		break;
+	case P9_TREADDIRPLUS:
+		spf (s, len, "P9_TREADDIRPLUS tag %u", fc->tag);
+		spf (s, len, " fid %"PRIu32, fc->u.treaddirplus.fid);
+		spf (s, len, " offset %"PRIu64, fc->u.treaddirplus.offset);
+		spf (s, len, " count %"PRIu32, fc->u.treaddirplus.count);
+		spf (s, len, " request_mask 0x%"PRIx64,
+		     fc->u.treaddirplus.request_mask);
+		break;
+	case P9_RREADDIRPLUS:
+		spf (s, len, "P9_RREADDIRPLUS tag %u", fc->tag);
+		spf (s, len, " count %"PRIu32, fc->u.rreaddirplus.count);
+		np_printdents(s, len, fc->u.rreaddirplus.data,
+			      fc->u.rreaddirplus.count);
+		break;
 	case P9_TFSYNC:
 		spf (s, len, "P9_TFSYNC tag %u", fc->tag);
 		spf (s, len, " fid %"PRIu32, fc->u.tfsync.fid);
@@ -567,14 +623,18 @@ np_snprintfcall(char *s, int len, Npfcall *fc)
 	case P9_RREAD:
 		spf (s, len, "P9_RREAD tag %u count %u", fc->tag,
 			fc->u.rread.count);
-		np_printdata(s, len, fc->u.rread.data, fc->u.rread.count);
+		if (fc->u.rread.data) /* NULL if payload is in fc->pipe */
+			np_printdata(s, len, fc->u.rread.data,
+				     fc->u.rread.count);
 		break;
 	case P9_TWRITE:
 		spf (s, len, "P9_TWRITE tag %u", fc->tag);
 		spf (s, len, " fid %d", fc->u.twrite.fid);
 		spf (s, len, " offset %"PRIu64, fc->u.twrite.offset);
 		spf (s, len, " count %u", fc->u.twrite.count);
-		np_printdata(s, len, fc->u.twrite.data, fc->u.twrite.count);
+		if (fc->u.twrite.data)
+			np_printdata(s, len, fc->u.twrite.data,
+				     fc->u.twrite.count);
 		break;
 	case P9_RWRITE:
 		spf (s, len, "P9_RWRITE tag %u count %u", fc->tag, fc->u.rwrite.count);
@@ -259,6 +259,7 @@ np_create_common(struct cbuf *bufp, u32 size, u8 id)
 	if (!(fc = malloc(sizeof(Npfcall) + size)))
 		return NULL;
 	fc->pkt = (u8 *) fc + sizeof(*fc);
+	fc->pipe = NULL;
 	buf_init(bufp, (char *) fc->pkt, size);
 	buf_put_int32(bufp, size, &fc->size);
 	buf_put_int8(bufp, id, &fc->type);
@@ -278,6 +279,7 @@ np_create_common_static(struct cbuf *bufp, u32 size, u8 id,
 
 	fc = buf;
 	fc->pkt = (u8 *) fc + sizeof(*fc);
+	fc->pipe = NULL;
 	buf_init(bufp, (char *) fc->pkt, size);
 	buf_put_int32(bufp, size, &fc->size);
 	buf_put_int8(bufp, id, &fc->type);
@@ -519,6 +521,34 @@ np_alloc_rread(u32 count)
 	return np_post_check(fc, bufp);
 }
 
+/* Allocate an Rread whose payload is the contents of pipe 'p'.  Only the
+ * header is stored in fc->pkt; fc->size covers header and payload as
+ * they will appear on the wire.  The fcall takes ownership of the pipe.
+ */
+Npfcall *
+np_alloc_rread_pipe(Nppipe *p)
+{
+	int size = sizeof(u32);
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, size, P9_RREAD)))
+		return NULL;
+	buf_put_int32(bufp, p->len, &fc->u.rread.count);
+	fc->u.rread.data = NULL;
+	if (!(fc = np_post_check(fc, bufp)))
+		return NULL;
+	fc->size += p->len;
+	fc->pkt[0] = fc->size;
+	fc->pkt[1] = fc->size >> 8;
+	fc->pkt[2] = fc->size >> 16;
+	fc->pkt[3] = fc->size >> 24;
+	fc->pipe = p;
+
+	return fc;
+}
+
 Npfcall *
 np_create_rread(u32 count, u8* data)
 {
@@ -1100,6 +1130,176 @@ np_finalize_rreaddir(Npfcall *fc, u32 count)
 	buf_put_int32(bufp, count, &fc->u.rreaddir.count);
 }
 
+Npfcall *
+np_create_rreaddirplus(u32 count)
+{
+	int size = sizeof(u32) + count;
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, size, P9_RREADDIRPLUS)))
+		return NULL;
+	buf_put_int32(bufp, count, &fc->u.rreaddirplus.count);
+	fc->u.rreaddirplus.data = buf_alloc(bufp, count);
+
+	return np_post_check(fc, bufp);
+}
+
+void
+np_finalize_rreaddirplus(Npfcall *fc, u32 count)
+{
+	int size = sizeof(u32) + sizeof(u8) + sizeof(u16)
+		 + sizeof(u32) + count;
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+
+	NP_ASSERT (count <= fc->u.rreaddirplus.count);
+
+	buf_init(bufp, (char *) fc->pkt, size);
+	buf_put_int32(bufp, size, &fc->size);
+	buf_init(bufp, (char *) fc->pkt + 7, size - 7);
+	buf_put_int32(bufp, count, &fc->u.rreaddirplus.count);
+}
+
+Npfcall *
+np_create_treaddirplus(u32 fid, u64 offset, u32 count, u64 request_mask)
+{
+	int size = sizeof(u32) + sizeof(u64) + sizeof(u32) + sizeof(u64);
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, size, P9_TREADDIRPLUS)))
+		return NULL;
+	buf_put_int32(bufp, fid, &fc->u.treaddirplus.fid);
+	buf_put_int64(bufp, offset, &fc->u.treaddirplus.offset);
+	buf_put_int32(bufp, count, &fc->u.treaddirplus.count);
+	buf_put_int64(bufp, request_mask, &fc->u.treaddirplus.request_mask);
+
+	return np_post_check(fc, bufp);
+}
+
+Npfcall *
+np_create_tcopyrange(u32 srcfid, u64 srcoff, u32 dstfid, u64 dstoff,
+		     u64 count)
+{
+	int size = sizeof(u32) + sizeof(u64) + sizeof(u32) + sizeof(u64)
+		 + sizeof(u64);
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, size, P9_TCOPYRANGE)))
+		return NULL;
+	buf_put_int32(bufp, srcfid, &fc->u.tcopyrange.srcfid);
+	buf_put_int64(bufp, srcoff, &fc->u.tcopyrange.srcoff);
+	buf_put_int32(bufp, dstfid, &fc->u.tcopyrange.dstfid);
+	buf_put_int64(bufp, dstoff, &fc->u.tcopyrange.dstoff);
+	buf_put_int64(bufp, count, &fc->u.tcopyrange.count);
+
+	return np_post_check(fc, bufp);
+}
+
+Npfcall *
+np_create_rcopyrange(u64 count)
+{
+	int size = sizeof(u64);
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, size, P9_RCOPYRANGE)))
+		return NULL;
+	buf_put_int64(bufp, count, &fc->u.rcopyrange.count);
+
+	return np_post_check(fc, bufp);
+}
+
+/* Pack already serialized requests 'tcs' into one Tcompound.
+ */
+Npfcall *
+np_create_tcompound(Npfcall **tcs, int n)
+{
+	int i, size = sizeof(u16);
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+	u8 *p;
+
+	for (i = 0; i < n; i++)
+		size += tcs[i]->size;
+	if (!(fc = np_create_common(bufp, size, P9_TCOMPOUND)))
+		return NULL;
+	buf_put_int16(bufp, n, &fc->u.tcompound.count);
+	fc->u.tcompound.size = size - sizeof(u16);
+	fc->u.tcompound.data = buf_alloc(bufp, fc->u.tcompound.size);
+	if (!(fc = np_post_check(fc, bufp)))
+		return NULL;
+	for (p = fc->u.tcompound.data, i = 0; i < n; i++) {
+		memcpy(p, tcs[i]->pkt, tcs[i]->size);
+		p += tcs[i]->size;
+	}
+
+	return fc;
+}
+
+/* Create an Rcompound with room for 'size' bytes of replies,
+ * to be filled in by the caller then sized by np_finalize_rcompound().
+ */
+Npfcall *
+np_create_rcompound(u32 size)
+{
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, sizeof(u16) + size, P9_RCOMPOUND)))
+		return NULL;
+	buf_put_int16(bufp, 0, &fc->u.rcompound.count);
+	fc->u.rcompound.size = size;
+	fc->u.rcompound.data = buf_alloc(bufp, size);
+
+	return np_post_check(fc, bufp);
+}
+
+void
+np_finalize_rcompound(Npfcall *fc, u16 count, u32 size)
+{
+	int fsize = P9_COMPOUNDHDRSZ + size;
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+
+	NP_ASSERT (size <= fc->u.rcompound.size);
+
+	buf_init(bufp, (char *) fc->pkt, fsize);
+	buf_put_int32(bufp, fsize, &fc->size);
+	buf_init(bufp, (char *) fc->pkt + 7, fsize - 7);
+	buf_put_int16(bufp, count, &fc->u.rcompound.count);
+	fc->u.rcompound.size = size;
+}
+
+/* Deserialize the message at the start of 'buf', one of the requests or
+ * replies in a compound, into 'fc', which then points into 'buf'.
+ * Returns the message size, or 0 if it is malformed.
+ */
+int
+np_deserialize_compound(Npfcall *fc, u8 *buf, int buflen)
+{
+	u32 size;
+
+	if (buflen < 7)
+		return 0;
+	size = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+	if (size < 7 || size > buflen)
+		return 0;
+	fc->pkt = buf;
+	fc->pipe = NULL;
+	fc->next = NULL;
+
+	return np_deserialize(fc);
+}
+
 Npfcall *
 np_create_treaddir(u32 fid, u64 offset, u32 count)
 {
@@ -1370,11 +1570,20 @@ np_alloc_fcall(int msize)
         if ((fc = malloc(sizeof(*fc) + msize))) {
                 fc->pkt = (u8*) fc + sizeof(*fc);
 		fc->size = msize;
+		fc->pipe = NULL;
 	}
 
         return fc;
 }
 
+void
+np_free_fcall(Npfcall *fc)
+{
+	if (fc->pipe)
+		np_pipe_put(fc->pipe);
+	free(fc);
+}
+
 int
 np_deserialize(Npfcall *fc)
 {
@@ -1604,6 +1813,39 @@ np_deserialize(Npfcall *fc)
 		fc->u.rreaddir.count = buf_get_int32(bufp);
                 fc->u.rreaddir.data = buf_alloc(bufp, fc->u.rreaddir.count);
 		break;
+	case P9_TREADDIRPLUS:
+		fc->u.treaddirplus.fid = buf_get_int32(bufp);
+		fc->u.treaddirplus.offset = buf_get_int64(bufp);
+		fc->u.treaddirplus.count = buf_get_int32(bufp);
+		fc->u.treaddirplus.request_mask = buf_get_int64(bufp);
+		break;
+	case P9_RREADDIRPLUS:
+		fc->u.rreaddirplus.count = buf_get_int32(bufp);
+		fc->u.rreaddirplus.data = buf_alloc(bufp,
+						fc->u.rreaddirplus.count);
+		break;
+	case P9_TCOMPOUND:
+		fc->u.tcompound.count = buf_get_int16(bufp);
+		fc->u.tcompound.size = fc->size - P9_COMPOUNDHDRSZ;
+		fc->u.tcompound.data = buf_alloc(bufp,
+						 fc->u.tcompound.size);
+		break;
+	case P9_RCOMPOUND:
+		fc->u.rcompound.count = buf_get_int16(bufp);
+		fc->u.rcompound.size = fc->size - P9_COMPOUNDHDRSZ;
+		fc->u.rcompound.data = buf_alloc(bufp,
+						 fc->u.rcompound.size);
+		break;
+	case P9_TCOPYRANGE:
+		fc->u.tcopyrange.srcfid = buf_get_int32(bufp);
+		fc->u.tcopyrange.srcoff = buf_get_int64(bufp);
+		fc->u.tcopyrange.dstfid = buf_get_int32(bufp);
+		fc->u.tcopyrange.dstoff = buf_get_int64(bufp);
+		fc->u.tcopyrange.count = buf_get_int64(bufp);
+		break;
+	case P9_RCOPYRANGE:
+		fc->u.rcopyrange.count = buf_get_int64(bufp);
+		break;
 	case P9_TFSYNC:
 		fc->u.tfsync.fid = buf_get_int32(bufp);
 		break;
@@ -1723,3 +1965,95 @@ np_deserialize_p9dirent(Npqid *qid, u64 *offset, u8 *type,
 
 	return bufp->p - bufp->sp;
 }
+
+/* A Rreaddirplus entry is a readdir entry followed by the Rgetattr
+ * fields for it, less the qid which would be repeated.
+ */
+int
+np_serialize_p9direntplus(Npqid *qid, u64 offset, u8 type, char *name,
+			  struct p9_rgetattr *attr, u8 *buf, int buflen)
+{
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	int size = QIDSIZE + sizeof(u64) + sizeof(u8)
+		 + sizeof(u16) + strlen(name)
+		 + 3*sizeof(u32) + 16*sizeof(u64);
+	Npstr nstr;
+	Npqid nqid;
+	u32 n32;
+	u64 n64;
+
+	if (size > buflen)
+		return 0;
+	buf_init(bufp, buf, buflen);
+	buf_put_qid(bufp, qid, &nqid);
+	buf_put_int64(bufp, offset, NULL);
+	buf_put_int8(bufp, type, NULL);
+	buf_put_str(bufp, name, &nstr);
+	buf_put_int64(bufp, attr->valid, &n64);
+	buf_put_int32(bufp, attr->mode, &n32);
+	buf_put_int32(bufp, attr->uid, &n32);
+	buf_put_int32(bufp, attr->gid, &n32);
+	buf_put_int64(bufp, attr->nlink, &n64);
+	buf_put_int64(bufp, attr->rdev, &n64);
+	buf_put_int64(bufp, attr->size, &n64);
+	buf_put_int64(bufp, attr->blksize, &n64);
+	buf_put_int64(bufp, attr->blocks, &n64);
+	buf_put_int64(bufp, attr->atime_sec, &n64);
+	buf_put_int64(bufp, attr->atime_nsec, &n64);
+	buf_put_int64(bufp, attr->mtime_sec, &n64);
+	buf_put_int64(bufp, attr->mtime_nsec, &n64);
+	buf_put_int64(bufp, attr->ctime_sec, &n64);
+	buf_put_int64(bufp, attr->ctime_nsec, &n64);
+	buf_put_int64(bufp, attr->btime_sec, &n64);
+	buf_put_int64(bufp, attr->btime_nsec, &n64);
+	buf_put_int64(bufp, attr->gen, &n64);
+	buf_put_int64(bufp, attr->data_version, &n64);
+
+	if (buf_check_overflow(bufp))
+		return 0;
+
+	return bufp->p - bufp->sp;
+}
+
+int
+np_deserialize_p9direntplus(Npqid *qid, u64 *offset, u8 *type,
+			    char *name, int namelen, struct p9_rgetattr *attr,
+			    u8 *buf, int buflen)
+{
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	struct p9_str s9;
+
+	buf_init(bufp, buf, buflen);
+	buf_get_qid(bufp, qid);
+	*offset = buf_get_int64(bufp);
+	*type = buf_get_int8(bufp);
+	buf_get_str(bufp, &s9);
+	snprintf (name, namelen, "%.*s", s9.len, s9.str);
+	attr->valid = buf_get_int64(bufp);
+	attr->qid = *qid;
+	attr->mode = buf_get_int32(bufp);
+	attr->uid = buf_get_int32(bufp);
+	attr->gid = buf_get_int32(bufp);
+	attr->nlink = buf_get_int64(bufp);
+	attr->rdev = buf_get_int64(bufp);
+	attr->size = buf_get_int64(bufp);
+	attr->blksize = buf_get_int64(bufp);
+	attr->blocks = buf_get_int64(bufp);
+	attr->atime_sec = buf_get_int64(bufp);
+	attr->atime_nsec = buf_get_int64(bufp);
+	attr->mtime_sec = buf_get_int64(bufp);
+	attr->mtime_nsec = buf_get_int64(bufp);
+	attr->ctime_sec = buf_get_int64(bufp);
+	attr->ctime_nsec = buf_get_int64(bufp);
+	attr->btime_sec = buf_get_int64(bufp);
+	attr->btime_nsec = buf_get_int64(bufp);
+	attr->gen = buf_get_int64(bufp);
+	attr->data_version = buf_get_int64(bufp);
+
+	if (buf_check_overflow (bufp))
+		return 0;
+
+	return bufp->p - bufp->sp;
+}
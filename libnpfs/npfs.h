@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 typedef struct p9_str Npstr;
 typedef struct p9_qid Npqid;
@@ -37,10 +38,13 @@ typedef struct Nptrans Nptrans;
 typedef struct Npconn Npconn;
 typedef struct Npreq Npreq;
 typedef struct Npstats Npstats;
+typedef struct Nplat Nplat;
 typedef struct Npwthread Npwthread;
 typedef struct Nptpool Nptpool;
 typedef struct Npauth Npauth;
 typedef struct Npsrv Npsrv;
+typedef struct Npreactor Npreactor;
+typedef struct Nppipe Nppipe;
 typedef struct Npuser Npuser;
 
 #define FID_HTABLE_SIZE 64
@@ -48,6 +52,8 @@ typedef struct Npuser Npuser;
 #define FID_MAGIC 0x765abcdf
 #define FID_MAGIC_FREED 0xdeadbeef
 
+#define REQ_HTABLE_SIZE 64
+
 #define STATIC_RFLUSH_SIZE	(sizeof(Npfcall) + 4 + 1 + 2)
 #define STATIC_RLERROR_SIZE	(sizeof(Npfcall) + 4 + 1 + 2 + 4)
 
@@ -56,6 +62,8 @@ struct Npfcall {
 	u8		type;
 	u16		tag;
 	u8*		pkt;
+	Nppipe*		pipe;	/* Rread/Twrite payload held in a pipe */
+	Npfcall*	next;	/* conn send queue */
 	union {
 	   struct p9_rlerror rlerror;
 	   struct p9_tstatfs tstatfs;
@@ -82,6 +90,12 @@ struct Npfcall {
 	   struct p9_rxattrcreate rxattrcreate;
 	   struct p9_treaddir treaddir;
 	   struct p9_rreaddir rreaddir;
+	   struct p9_treaddirplus treaddirplus;
+	   struct p9_rreaddirplus rreaddirplus;
+	   struct p9_tcompound tcompound;
+	   struct p9_rcompound rcompound;
+	   struct p9_tcopyrange tcopyrange;
+	   struct p9_rcopyrange rcopyrange;
 	   struct p9_tfsync tfsync;
 	   struct p9_rfsync rfsync;
 	   struct p9_tlock tlock;
@@ -148,11 +162,30 @@ struct Npbuf {
 	Npbuf*		next;
 };
 
+/* A pipe holding Rread payload spliced from a file, so that it can be
+ * spliced on to the transport without a copy through user space, or
+ * Twrite payload spliced from the transport on its way to a file.
+ */
+struct Nppipe {
+	int		fd[2];
+	u32		len;	/* bytes in pipe */
+	u32		size;	/* pipe capacity */
+	Nppipe*		next;
+};
+
 struct Nptrans {
 	void*		aux;
 	int		(*recv)(Npfcall **, u32, void *);
 	int		(*send)(Npfcall *, void *);
 	void		(*destroy)(void *);
+	int		(*pollfd)(void *);	/* optional */
+	void		(*release)(Npfcall *, void *);	/* optional */
+	int		(*sendpipe)(Npfcall *, void *);	/* optional */
+	int		splicewrite;	/* recv may put Twrite payload in pipe */
+	int		(*sendv)(Npfcall *, Npfcall *, u32, void *); /* optional */
+	int		(*pollfdout)(void *);	/* optional, with sendv */
+	u64		rbufhit;	/* receive buffer pool stats */
+	u64		rbufmiss;
 };
 
 struct Npfidpool {
@@ -163,6 +196,7 @@ struct Npfidpool {
 
 enum {
 	CONN_FLAGS_PRIVPORT =0x00000001,
+	CONN_FLAGS_DIODEXT  =0x00000002, /* negotiated P9_DIODEXT_VERSION */
 };
 
 struct Npconn {
@@ -183,6 +217,23 @@ struct Npconn {
 	pthread_t	rthread;
 
 	Npconn*		next;	/* list of connections within a server */
+	Npconn*		znext;	/* list of connections awaiting teardown */
+	Npreq*		reqs[REQ_HTABLE_SIZE]; /* outstanding requests by tag,
+						* protected by lock */
+	u64		nflush;	/* Tflush count, updated by receiving thread */
+
+	/* Reply send queue, protected by wlock.  Only used for connections
+	 * serviced by the reactor (sq_fd >= 0).
+	 */
+	int		sq_fd;		/* dup of output fd polled by reactor */
+	Npfcall*	sq_first;	/* replies waiting to be sent */
+	Npfcall*	sq_last;
+	u32		sq_off;		/* bytes of sq_first already sent */
+	u64		sq_bytes;	/* bytes queued */
+	int		sq_busy;	/* a thread or the reactor is sending */
+	int		sq_dead;	/* discard replies */
+	int		sq_paused;	/* input not re-armed until the
+					   queue drains */
 };
 
 typedef enum { REQ_NORMAL, REQ_NOREPLY } Reqstate;
@@ -197,13 +248,22 @@ struct Npreq {
 	Npfcall*	tcall;
 	Npfcall*	rcall;
 	Npfid*		fid;
-	time_t		birth;
-
-	Npreq*		next;	/* list of all outstanding requests */
-	Npreq*		prev;	/* used for requests that are worked on */
-	Npwthread*	wthread;/* for requests that are worked on */
+	u64		birth;	/* usec (CLOCK_MONOTONIC) when received */
+	u64		dequeued;/* usec when a worker picked it up */
+
+	Nptpool*	tpool;	/* pool the request was queued on */
+	Npreq*		next;	/* tpool queue, protected by tpool->lock */
+	Npreq*		prev;
+	Npwthread*	wthread;/* set once a worker dequeues the request */
+	Npreq*		cnext;	/* conn->reqs chain, protected by conn->lock */
+	Npreq*		cprev;
+	u32		uid;	/* fid user at enqueue, or P9_NONUNAME */
+	Npreq*		unext;	/* tpool per-user queue, under tpool->lock */
+	Npreq*		uprev;
 };
 
+#define NP_CACHELINE 64
+
 #define NPSTATS_RWCOUNT_BINS 12
 struct Npstats {
 	char		*name;
@@ -216,6 +276,17 @@ struct Npstats {
 	u64		wcount[NPSTATS_RWCOUNT_BINS];
 };
 
+/* Latency histograms per request type: time spent queued waiting for a
+ * worker and time in the worker up to the reply.  Bins are log-linear in
+ * microseconds (four per power of two), see np_lat_bin_usec ().
+ */
+#define NPSTATS_LAT_BINS 100
+#define NPSTATS_LAT_OPS	30
+struct Nplat {
+	u64		wait[NPSTATS_LAT_OPS][NPSTATS_LAT_BINS];
+	u64		serv[NPSTATS_LAT_OPS][NPSTATS_LAT_BINS];
+};
+
 struct Npwthread {
 	Nptpool*	tpool;
 	int		shutdown;
@@ -223,20 +294,36 @@ struct Npwthread {
 	u32		fsuid;
 	u32		fsgid;
 	int		privcap;
+	int		streak;	/* requests taken ahead of the tpool queue head */
 	Npwthread	*next;
+	/* Written only by this thread, so updates need no lock.
+	 * Summed with tpool->stats when ctl:tpools is read.
+	 */
+	Npstats		stats __attribute__ ((aligned (NP_CACHELINE)));
+	Nplat		lat;
+	u64		credswitch;	/* np_setfsid calls that changed creds */
+	u64		affinity;	/* requests picked to match fsuid */
 };
 
+/* Queued requests are also chained on a per-user queue hashed by uid,
+ * so a worker can find work for the user whose credentials it holds.
+ */
+#define NP_UQ_BUCKETS	32
+
 struct Nptpool {
 	char*		name;
 	Npsrv*		srv;
-	pthread_mutex_t lock; /* protects refcount */
+	pthread_mutex_t lock; /* protects all but name, srv, next */
 	int		refcount;
 	int		nwthread;
 	Npwthread*	wthreads;
 	Npreq*		reqs_first;
 	Npreq*		reqs_last;
-	Npreq*		workreqs;
-	Npstats		stats;
+	Npreq*		uq_first[NP_UQ_BUCKETS];
+	Npreq*		uq_last[NP_UQ_BUCKETS];
+	int		nworking;	/* requests dequeued by workers */
+	int		nidle;		/* workers waiting on reqcond */
+	Npstats		stats;		/* requests not run by a worker */
 	pthread_cond_t	reqcond;
 	Nptpool		*next;
 };
@@ -266,6 +353,7 @@ enum {
 	SRV_FLAGS_DAC_BYPASS  	=0x00200000,
 	SRV_FLAGS_SETGROUPS	=0x00400000,
 	SRV_FLAGS_LOOSEFID	=0x00800000, /* work around buggy clients */
+	SRV_FLAGS_SPLICEWRITE	=0x01000000, /* srv->write takes pipe payload */
 };
 
 typedef char * (*SynGetF)(char *name, void *arg);
@@ -324,13 +412,15 @@ struct Npsrv {
 	Npfcall*	(*xattrwalk)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*xattrcreate)(Npfid *, Npstr *, u64, u32);
 	Npfcall*	(*readdir)(Npfid *, u64, u32, Npreq *);
+	Npfcall*	(*readdirplus)(Npfid *, u64, u32, u64, Npreq *);
 	Npfcall*	(*fsync)(Npfid *);
 	Npfcall*	(*llock)(Npfid *, u8, u32, u64, u64, u32, Npstr *);
 	Npfcall*	(*getlock)(Npfid *, u8 type, u64, u64, u32, Npstr *);
 	Npfcall*	(*link)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*mkdir)(Npfid *, Npstr *, u32, u32);
 	Npfcall*	(*renameat)(Npfid *, Npstr *, Npfid *, Npstr *);
-	Npfcall*	(*unlinkat)(Npfid *, Npstr *);
+	Npfcall*	(*unlinkat)(Npfid *, Npstr *, u32);
+	Npfcall*	(*copyrange)(Npfid *, u64, Npfid *, u64, u64);
 
 	/* implementation specific */
 	pthread_mutex_t	lock;
@@ -340,6 +430,14 @@ struct Npsrv {
 	Npconn*		conns;
 	Nptpool*	tpool;
 	int		nwthread;
+	Npreactor*	reactor;
+	u64		rbufhit;	/* from destroyed connections */
+	u64		rbufmiss;
+	u64		nflush;
+	u64		sendqmax;	/* per-conn reply bytes queued, 0=no max */
+	int		affinitymax;	/* requests a worker may take ahead of
+					   the queue head to keep its creds,
+					   0=strict FIFO */
 };
 
 struct Npuser {
@@ -370,6 +468,7 @@ void np_logmsg(Npsrv *srv, const char *fmt, ...)
 void np_tpool_incref(Nptpool *);
 void np_tpool_decref(Nptpool *);
 int np_decode_tpools_str (char *s, Npstats *stats);
+u64 np_lat_bin_usec (int bin);
 void np_assfail (char *ass, char *file, int line);
 #define NP_ASSERT(exp) if ((exp)) ; else np_assfail(#exp, __FILE__, __LINE__ ) 
 
@@ -400,6 +499,10 @@ Nptrans *np_trans_create(void *aux, int (*recv)(Npfcall **, u32, void *),
 void np_trans_destroy(Nptrans *);
 int np_trans_send(Nptrans *, Npfcall *);
 int np_trans_recv(Nptrans *, Npfcall **, u32);
+int np_trans_pollfd(Nptrans *);
+int np_trans_pollfdout(Nptrans *);
+int np_trans_sendv(Nptrans *, Npfcall *, Npfcall *, u32);
+void np_trans_release(Nptrans *, Npfcall *);
 
 /* npstring.c */
 void np_strzero(Npstr *str);
@@ -413,15 +516,25 @@ int aspf (char **sp, int *lp, const char *fmt, ...)
 	__attribute__ ((format (printf, 3,4)));
 int np_encode_tpools_str (char **s, int *len, Npstats *stats);
 int np_decode_tpools_str (char *s, Npstats *stats);
+int np_encode_latency_str (char **s, int *len, char *name, int type,
+			   char kind, u64 *bins);
+int np_decode_latency_str (char *s, char **name, int *type, char *kind,
+			   u64 *bins);
 
 /* np.c */
 u32 np_peek_size(u8 *buf, int len);
 Npfcall *np_alloc_fcall(int msize);
+void np_free_fcall(Npfcall *fc);
 int np_deserialize(Npfcall*);
 int np_serialize_p9dirent(Npqid *qid, u64 offset, u8 type, char *name, u8 *buf,
                           int buflen);
 int np_deserialize_p9dirent(Npqid *qid, u64 *offset, u8 *type, char *name,
 			    int namelen, u8 *buf, int buflen);
+int np_serialize_p9direntplus(Npqid *qid, u64 offset, u8 type, char *name,
+			      struct p9_rgetattr *attr, u8 *buf, int buflen);
+int np_deserialize_p9direntplus(Npqid *qid, u64 *offset, u8 *type,
+				char *name, int namelen,
+				struct p9_rgetattr *attr, u8 *buf, int buflen);
 void np_set_tag(Npfcall *, u16);
 Npfcall *np_create_tversion(u32 msize, char *version);
 Npfcall *np_create_rversion(u32 msize, char *version);
@@ -445,6 +558,7 @@ Npfcall *np_create_tremove(u32 fid);
 Npfcall *np_create_rremove(void);
 Npfcall *np_create_tread(u32 fid, u64 offset, u32 count);
 Npfcall * np_alloc_rread(u32);
+Npfcall *np_alloc_rread_pipe(Nppipe *p);
 void np_set_rread_count(Npfcall *, u32);
 Npfcall *np_create_rlerror(u32 ecode);
 Npfcall *np_create_rlerror_static(u32 ecode, void *buf, int buflen);
@@ -485,6 +599,17 @@ Npfcall *np_create_rxattrcreate(void);
 Npfcall *np_create_treaddir(u32 fid, u64 offset, u32 count);
 Npfcall *np_create_rreaddir(u32 count);
 void np_finalize_rreaddir(Npfcall *fc, u32 count);
+Npfcall *np_create_treaddirplus(u32 fid, u64 offset, u32 count,
+				u64 request_mask);
+Npfcall *np_create_rreaddirplus(u32 count);
+void np_finalize_rreaddirplus(Npfcall *fc, u32 count);
+Npfcall *np_create_tcompound(Npfcall **tcs, int n);
+Npfcall *np_create_rcompound(u32 size);
+void np_finalize_rcompound(Npfcall *fc, u16 count, u32 size);
+int np_deserialize_compound(Npfcall *fc, u8 *buf, int buflen);
+Npfcall *np_create_tcopyrange(u32 srcfid, u64 srcoff, u32 dstfid, u64 dstoff,
+			      u64 count);
+Npfcall *np_create_rcopyrange(u64 count);
 Npfcall *np_create_tfsync(u32 fid);
 Npfcall *np_create_rfsync(void);
 Npfcall * np_create_tlock(u32 fid, u8 type, u32 flags, u64 start, u64 length,
@@ -504,6 +629,13 @@ Npfcall *np_create_rrenameat(void);
 Npfcall *np_create_tunlinkat(u32 dirfid, char *name, u32 flags);
 Npfcall *np_create_runlinkat(void);
 
+/* splice.c */
+Npfcall *np_splice_rread(Npconn *conn, int fd, u64 offset, u32 count);
+Npfcall *np_vmsplice_rread(Npconn *conn, struct iovec *iov, int iovcnt);
+int np_splice_twrite(Npfcall *tc, int fd, u64 offset);
+int np_twrite_copyout(Npfcall *tc, u8 *buf);
+int np_pipe_copyout(Npfcall *fc, u8 *buf);
+
 /* fmt.c */
 void np_snprintfcall(char *s, int len, Npfcall *fc);
 
@@ -46,6 +46,7 @@ Npfcall *np_setattr(Npreq *req, Npfcall *tc);
 Npfcall *np_xattrwalk(Npreq *req, Npfcall *tc);
 Npfcall *np_xattrcreate(Npreq *req, Npfcall *tc);
 Npfcall *np_readdir(Npreq *req, Npfcall *tc);
+Npfcall *np_readdirplus(Npreq *req, Npfcall *tc);
 Npfcall *np_fsync(Npreq *req, Npfcall *tc);
 Npfcall *np_lock(Npreq *req, Npfcall *tc);
 Npfcall *np_getlock(Npreq *req, Npfcall *tc);
@@ -53,11 +54,35 @@ Npfcall *np_link(Npreq *req, Npfcall *tc);
 Npfcall *np_mkdir(Npreq *req, Npfcall *tc);
 Npfcall *np_renameat(Npreq *req, Npfcall *tc);
 Npfcall *np_unlinkat(Npreq *req, Npfcall *tc);
+Npfcall *np_copyrange(Npreq *req, Npfcall *tc);
 
 /* srv.c */
 void np_srv_add_req(Npsrv *srv, Npreq *req);
 void np_srv_remove_req(Nptpool *tp, Npreq *req);
+void np_srv_conn_destroyed(Npsrv *srv);
 Npreq *np_req_alloc(Npconn *conn, Npfcall *tc);
 Npreq *np_req_ref(Npreq*);
 void np_req_unref(Npreq*);
 
+/* conn.c */
+int np_conn_read_ready(Npconn *conn);
+void np_conn_write_ready(Npconn *conn);
+void np_conn_shutdown(Npconn *conn);
+int np_conn_reap(Npconn *conn);
+int np_conn_sendq_full(Npconn *conn);
+void np_conn_add_req(Npconn *conn, Npreq *req);
+void np_conn_remove_req(Npconn *conn, Npreq *req);
+Npreq *np_conn_find_req(Npconn *conn, u16 tag);
+
+/* reactor.c */
+int np_reactor_create(Npsrv *srv);
+void np_reactor_destroy(Npsrv *srv);
+int np_reactor_add_conn(Npsrv *srv, Npconn *conn);
+void np_reactor_del_conn(Npsrv *srv, Npconn *conn);
+int np_reactor_want_write(Npsrv *srv, Npconn *conn);
+int np_reactor_resume(Npsrv *srv, Npconn *conn);
+void np_reactor_wake(Npsrv *srv);
+
+/* splice.c */
+Nppipe *np_pipe_get(u32 msize);
+void np_pipe_put(Nppipe *p);
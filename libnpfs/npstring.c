@@ -298,3 +298,54 @@ np_encode_tpools_str (char **s, int *len, Npstats *stats)
 			stats->wcount[10],
 			stats->wcount[11]);
 }
+
+/* Latency histogram for one tpool, request type, and kind ('q' for queue
+ * wait, 's' for service), listing only non-empty bins as bin:count.
+ */
+int
+np_encode_latency_str (char **s, int *len, char *name, int type, char kind,
+		       u64 *bins)
+{
+	int i;
+
+	if (aspf (s, len, "%s %d %c", name, type, kind) < 0)
+		return -1;
+	for (i = 0; i < NPSTATS_LAT_BINS; i++) {
+		if (bins[i] == 0)
+			continue;
+		if (aspf (s, len, " %d:%"PRIu64, i, bins[i]) < 0)
+			return -1;
+	}
+	return aspf (s, len, "\n");
+}
+
+int
+np_decode_latency_str (char *s, char **name, int *type, char *kind,
+		       u64 *bins)
+{
+	int i, n;
+	u64 count;
+
+	*name = NULL;
+	if (sscanf (s, "%ms %d %c%n", name, type, kind, &n) != 3)
+		goto error;
+	memset (bins, 0, sizeof (u64) * NPSTATS_LAT_BINS);
+	for (s += n; ; s += n) {
+		while (*s == ' ' || *s == '\n')
+			s++;
+		if (*s == '\0')
+			break;
+		if (sscanf (s, "%d:%"SCNu64"%n", &i, &count, &n) != 2)
+			goto error;
+		if (i < 0 || i >= NPSTATS_LAT_BINS)
+			goto error;
+		bins[i] = count;
+	}
+	return 0;
+error:
+	if (*name) {
+		free (*name);
+		*name = NULL;
+	}
+	return -1;
+}
@@ -0,0 +1,424 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+/* reactor.c - epoll event loop for polled connections */
+
+/* A fixed pool of reactor threads share one epoll set in place of a read
+ * thread per connection.  Connection fds are registered EPOLLONESHOT, so
+ * only one reactor thread frames input for a given connection at a time.
+ * It drains every complete request, hands them to the tpools, and re-arms.
+ * On EOF the connection is flushed and parked on the zombie list until
+ * its last reference is dropped; np_conn_decref () then wakes the reactor
+ * to destroy it.
+ * Replies are queued on the connection and sent by whichever thread
+ * queues one while no send is in progress.  If the transport would block,
+ * a dup of the output fd is registered EPOLLOUT | EPOLLONESHOT and a
+ * reactor thread resumes sending when it is writable, so worker threads
+ * never wait on a slow client.  The low bit of the event's data.ptr
+ * tells output events from input events.
+ * A connection with more than srv->sendqmax reply bytes queued is not
+ * re-armed for input after it is drained; the thread whose send brings
+ * the queue down re-arms it, so a client that does not read its replies
+ * stops being read instead of occupying worker threads.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+#if HAVE_SYS_EPOLL_H
+
+#define REACTOR_MAXTHREADS	4
+#define REACTOR_MAXEVENTS	8
+#define REACTOR_OUT		((uintptr_t)1)
+
+struct Npreactor {
+	Npsrv		*srv;
+	int		epfd;
+	int		wakefd;	/* zombie may be reaped */
+	int		stopfd;	/* threads should exit */
+	int		nthread;
+	pthread_t	*threads;
+	pthread_mutex_t	lock;	/* protects zombies */
+	Npconn		*zombies;
+};
+
+static void *np_reactor_proc(void *a);
+
+static int
+_addfd (Npreactor *r, int fd, void *ptr, u32 events)
+{
+	struct epoll_event ev;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+	if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		np_uerror (errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+_rearmfd (Npreactor *r, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = ptr;
+	if (epoll_ctl (r->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		np_uerror (errno);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+_nthreads (void)
+{
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > REACTOR_MAXTHREADS)
+		n = REACTOR_MAXTHREADS;
+	return n;
+}
+
+int
+np_reactor_create(Npsrv *srv)
+{
+	Npreactor *r;
+	int err, n = _nthreads ();
+
+	if (!(r = malloc (sizeof (*r)))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	memset (r, 0, sizeof (*r));
+	r->srv = srv;
+	r->epfd = r->wakefd = r->stopfd = -1;
+	pthread_mutex_init (&r->lock, NULL);
+	srv->reactor = r;
+
+	if ((r->epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if ((r->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+	 || (r->stopfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if (_addfd (r, r->wakefd, r, EPOLLIN) < 0)
+		goto error;
+	if (_addfd (r, r->stopfd, NULL, EPOLLIN) < 0)
+		goto error;
+	if (!(r->threads = malloc (n * sizeof (pthread_t)))) {
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	for (r->nthread = 0; r->nthread < n; r->nthread++) {
+		err = pthread_create (&r->threads[r->nthread], NULL,
+				      np_reactor_proc, r);
+		if (err) {
+			np_uerror (err);
+			goto error;
+		}
+	}
+	return 0;
+error:
+	np_reactor_destroy (srv);
+	return -1;
+}
+
+/* Stop reactor threads.  Connections still registered are abandoned,
+ * as they were when each had its own read thread.
+ */
+void
+np_reactor_destroy(Npsrv *srv)
+{
+	Npreactor *r = srv->reactor;
+	u64 val = 1;
+	int i;
+
+	if (!r)
+		return;
+	if (r->nthread > 0) {
+		if (write (r->stopfd, &val, sizeof (val)) < 0)
+			np_logerr (srv, "reactor: write stopfd");
+		for (i = 0; i < r->nthread; i++)
+			pthread_join (r->threads[i], NULL);
+	}
+	if (r->threads)
+		free (r->threads);
+	if (r->stopfd >= 0)
+		(void)close (r->stopfd);
+	if (r->wakefd >= 0)
+		(void)close (r->wakefd);
+	if (r->epfd >= 0)
+		(void)close (r->epfd);
+	pthread_mutex_destroy (&r->lock);
+	free (r);
+	srv->reactor = NULL;
+}
+
+static int
+_setnonblock (int fd)
+{
+	int fl;
+
+	if ((fl = fcntl (fd, F_GETFL)) < 0
+	 || fcntl (fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+		np_uerror (errno);
+		return -1;
+	}
+	return 0;
+}
+
+int
+np_reactor_add_conn(Npsrv *srv, Npconn *conn)
+{
+	Npreactor *r = srv->reactor;
+	int fd = np_trans_pollfd (conn->trans);
+	int ofd = np_trans_pollfdout (conn->trans);
+
+	NP_ASSERT (r != NULL);
+	NP_ASSERT (fd >= 0);
+	if (_setnonblock (fd) < 0)
+		return -1;
+	/* The output fd gets its own epoll registration (epoll keys on the
+	 * fd as well as the open file), armed only while replies are waiting.
+	 */
+	if (ofd >= 0) {
+		if (_setnonblock (ofd) < 0)
+			return -1;
+		if ((conn->sq_fd = fcntl (ofd, F_DUPFD_CLOEXEC, 0)) < 0) {
+			np_uerror (errno);
+			return -1;
+		}
+	}
+	return _addfd (r, fd, conn, EPOLLIN | EPOLLONESHOT);
+}
+
+/* Remove the output registration of a connection being destroyed.
+ */
+void
+np_reactor_del_conn(Npsrv *srv, Npconn *conn)
+{
+	Npreactor *r = srv->reactor;
+
+	if (r)
+		(void)epoll_ctl (r->epfd, EPOLL_CTL_DEL, conn->sq_fd, NULL);
+	(void)close (conn->sq_fd);
+	conn->sq_fd = -1;
+}
+
+/* Arrange for np_conn_write_ready () to be called once conn can be written.
+ */
+int
+np_reactor_want_write(Npsrv *srv, Npconn *conn)
+{
+	Npreactor *r = srv->reactor;
+	struct epoll_event ev;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr = (void *)((uintptr_t)conn | REACTOR_OUT);
+	if (epoll_ctl (r->epfd, EPOLL_CTL_MOD, conn->sq_fd, &ev) < 0) {
+		if (errno != ENOENT
+		 || epoll_ctl (r->epfd, EPOLL_CTL_ADD, conn->sq_fd, &ev) < 0) {
+			np_uerror (errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Re-arm input on a connection left disarmed by np_reactor_input ().
+ */
+int
+np_reactor_resume(Npsrv *srv, Npconn *conn)
+{
+	return _rearmfd (srv->reactor, np_trans_pollfd (conn->trans), conn);
+}
+
+void
+np_reactor_wake(Npsrv *srv)
+{
+	Npreactor *r = srv->reactor;
+	u64 val = 1;
+
+	if (r && write (r->wakefd, &val, sizeof (val)) < 0)
+		np_logerr (srv, "reactor: write wakefd");
+}
+
+/* Destroy zombie connections whose last reference has been dropped.
+ * The scan is done under r->lock so a wakeup that arrives while another
+ * thread is scanning cannot be lost.
+ */
+static void
+np_reactor_reap(Npreactor *r)
+{
+	Npconn *conn, *next, *busy = NULL;
+	u64 val;
+
+	if (read (r->wakefd, &val, sizeof (val)) < 0 && errno != EAGAIN) {
+		np_uerror (errno);
+		np_logerr (r->srv, "reactor: read wakefd");
+	}
+	xpthread_mutex_lock (&r->lock);
+	for (conn = r->zombies; conn != NULL; conn = next) {
+		next = conn->znext;
+		if (!np_conn_reap (conn)) {
+			conn->znext = busy;
+			busy = conn;
+		}
+	}
+	r->zombies = busy;
+	xpthread_mutex_unlock (&r->lock);
+}
+
+static void
+np_reactor_input(Npreactor *r, Npconn *conn)
+{
+	int fd = np_trans_pollfd (conn->trans);
+
+	if (np_conn_read_ready (conn) == 0) {
+		if (np_conn_sendq_full (conn) || _rearmfd (r, fd, conn) == 0)
+			return;
+		np_logerr (r->srv, "epoll_ctl - dropping connection to '%s'",
+			   conn->client_id);
+	}
+	(void)epoll_ctl (r->epfd, EPOLL_CTL_DEL, fd, NULL);
+	np_conn_shutdown (conn);
+
+	xpthread_mutex_lock (&r->lock);
+	conn->znext = r->zombies;
+	r->zombies = conn;
+	xpthread_mutex_unlock (&r->lock);
+
+	np_reactor_reap (r);
+}
+
+static void *
+np_reactor_proc(void *a)
+{
+	Npreactor *r = (Npreactor *)a;
+	struct epoll_event ev[REACTOR_MAXEVENTS];
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait (r->epfd, ev, REACTOR_MAXEVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			np_uerror (errno);
+			np_logerr (r->srv, "reactor: epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr == NULL)
+				goto done;
+			if (ev[i].data.ptr == r)
+				np_reactor_reap (r);
+			else if ((uintptr_t)ev[i].data.ptr & REACTOR_OUT)
+				np_conn_write_ready ((Npconn *)
+				    ((uintptr_t)ev[i].data.ptr & ~REACTOR_OUT));
+			else
+				np_reactor_input (r, ev[i].data.ptr);
+		}
+	}
+done:
+	return NULL;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/* Without epoll every connection gets its own read thread.
+ */
+int
+np_reactor_create(Npsrv *srv)
+{
+	srv->reactor = NULL;
+	return 0;
+}
+
+void
+np_reactor_destroy(Npsrv *srv)
+{
+}
+
+int
+np_reactor_add_conn(Npsrv *srv, Npconn *conn)
+{
+	np_uerror (ENOSYS);
+	return -1;
+}
+
+void
+np_reactor_del_conn(Npsrv *srv, Npconn *conn)
+{
+}
+
+int
+np_reactor_want_write(Npsrv *srv, Npconn *conn)
+{
+	np_uerror (ENOSYS);
+	return -1;
+}
+
+int
+np_reactor_resume(Npsrv *srv, Npconn *conn)
+{
+	np_uerror (ENOSYS);
+	return -1;
+}
+
+void
+np_reactor_wake(Npsrv *srv)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
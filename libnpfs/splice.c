@@ -0,0 +1,367 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+/* splice.c - zero-copy Rread/Twrite payload */
+
+/* On transports that support it, Rread payload is spliced from the backing
+ * file into a pipe, then from the pipe to the transport after the header
+ * has been sent, so the data never passes through user space.
+ * Large Twrite payload may likewise be left in a pipe by the transport,
+ * to be spliced to the backing file by the server's write op.
+ * Pipes are recycled through a small pool once drained.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+#if HAVE_SPLICE
+
+#define PIPE_POOL_MAX	64
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Nppipe *pool = NULL;
+static int pool_count = 0;
+
+/* Best effort: unprivileged callers are limited by
+ * /proc/sys/fs/pipe-max-size.  A smaller pipe only means shorter reads,
+ * and Twrite payload that does not fit is received the usual way.
+ */
+static void
+np_pipe_resize(Nppipe *p, u32 msize)
+{
+	int n;
+
+	(void)fcntl(p->fd[1], F_SETPIPE_SZ, msize);
+	if ((n = fcntl(p->fd[1], F_GETPIPE_SZ)) > 0)
+		p->size = n;
+}
+
+static Nppipe *
+np_pipe_create(u32 msize)
+{
+	Nppipe *p;
+
+	if (!(p = malloc(sizeof(*p)))) {
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	if (pipe2(p->fd, O_CLOEXEC | O_NONBLOCK) < 0) {
+		np_uerror(errno);
+		free(p);
+		return NULL;
+	}
+	p->len = 0;
+	p->size = 0;
+	np_pipe_resize(p, msize);
+	p->next = NULL;
+	return p;
+}
+
+static void
+np_pipe_destroy(Nppipe *p)
+{
+	(void)close(p->fd[0]);
+	(void)close(p->fd[1]);
+	free(p);
+}
+
+Nppipe *
+np_pipe_get(u32 msize)
+{
+	Nppipe *p;
+
+	xpthread_mutex_lock(&pool_lock);
+	if ((p = pool)) {
+		pool = p->next;
+		pool_count--;
+	}
+	xpthread_mutex_unlock(&pool_lock);
+	if (!p)
+		p = np_pipe_create(msize);
+	else if (p->size < msize)
+		np_pipe_resize(p, msize);
+	return p;
+}
+
+/* A pipe that still holds data (reply was never sent, or the send
+ * failed part way) cannot be reused.
+ */
+void
+np_pipe_put(Nppipe *p)
+{
+	if (p->len == 0) {
+		xpthread_mutex_lock(&pool_lock);
+		if (pool_count < PIPE_POOL_MAX) {
+			p->next = pool;
+			pool = p;
+			pool_count++;
+			p = NULL;
+		}
+		xpthread_mutex_unlock(&pool_lock);
+	}
+	if (p)
+		np_pipe_destroy(p);
+}
+
+/* Create an Rread for up to 'count' bytes of 'fd' at 'offset', with the
+ * payload spliced into a pipe.  As with pread, fewer bytes than requested
+ * may be returned, e.g. at EOF or if the pipe fills.
+ * Returns NULL with np_rerror () set if the conn's transport cannot send
+ * pipe payload (EOPNOTSUPP) or the splice fails, e.g. EINVAL if the file
+ * system does not support splice.  The caller may fall back to pread.
+ */
+Npfcall *
+np_splice_rread(Npconn *conn, int fd, u64 offset, u32 count)
+{
+	loff_t off = offset;
+	Nppipe *p = NULL;
+	Npfcall *fc;
+	ssize_t n;
+
+	if (!conn->trans->sendpipe) {
+		np_uerror(EOPNOTSUPP);
+		goto error;
+	}
+	if (!(p = np_pipe_get(conn->msize)))
+		goto error;
+	while (p->len < count) {
+		n = splice(fd, &off, p->fd[1], NULL, count - p->len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EAGAIN && p->len > 0)
+			break; /* pipe is full */
+		if (n < 0) {
+			if (p->len > 0)
+				break;
+			np_uerror(errno);
+			goto error;
+		}
+		if (n == 0)
+			break;
+		p->len += n;
+	}
+	/* At EOF send a plain Rread: an empty pipe would leave the header
+	 * corked with MSG_MORE and nothing following it.
+	 */
+	if (p->len == 0) {
+		np_pipe_put(p);
+		p = NULL;
+		if (!(fc = np_alloc_rread(0))) {
+			np_uerror(ENOMEM);
+			goto error;
+		}
+		return fc;
+	}
+	if (!(fc = np_alloc_rread_pipe(p))) {
+		np_uerror(ENOMEM);
+		goto error;
+	}
+	return fc;
+error:
+	if (p)
+		np_pipe_put(p);
+	return NULL;
+}
+
+/* Create an Rread whose payload is the user memory described by 'iov',
+ * mapped into a pipe with vmsplice rather than copied.  The pipe holds
+ * references to the pages, so the caller may unmap them once this returns,
+ * but must not modify them.  Fewer bytes than requested may be taken if
+ * the pipe fills.  Returns NULL with np_rerror () set as np_splice_rread ().
+ */
+Npfcall *
+np_vmsplice_rread(Npconn *conn, struct iovec *iov, int iovcnt)
+{
+	Nppipe *p = NULL;
+	Npfcall *fc;
+	ssize_t n;
+
+	if (!conn->trans->sendpipe) {
+		np_uerror(EOPNOTSUPP);
+		goto error;
+	}
+	if (!(p = np_pipe_get(conn->msize)))
+		goto error;
+	while (iovcnt > 0) {
+		n = vmsplice(p->fd[1], iov, iovcnt, SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN && p->len > 0)
+			break; /* pipe is full */
+		if (n < 0) {
+			np_uerror(errno);
+			goto error;
+		}
+		if (n == 0)
+			break;
+		p->len += n;
+		while (iovcnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (n > 0) {
+			iov->iov_base = (u8 *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	if (!(fc = np_alloc_rread_pipe(p))) {
+		np_uerror(ENOMEM);
+		goto error;
+	}
+	return fc;
+error:
+	if (p)
+		np_pipe_put(p);
+	return NULL;
+}
+
+/* Splice the Twrite payload held in tc->pipe to 'fd' at 'offset'.
+ * As with pwrite, fewer bytes than requested may be written.
+ * Returns the count, or -1 with np_rerror () set.  If nothing was written,
+ * e.g. EINVAL because the file system does not support splice, the payload
+ * is still available to np_twrite_copyout ().
+ */
+int
+np_splice_twrite(Npfcall *tc, int fd, u64 offset)
+{
+	loff_t off = offset;
+	Nppipe *p = tc->pipe;
+	int len = 0;
+	ssize_t n;
+
+	while (p->len > 0) {
+		n = splice(p->fd[0], NULL, fd, &off, p->len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (len > 0)
+				break;
+			np_uerror(n < 0 ? errno : EIO);
+			return -1;
+		}
+		p->len -= n;
+		len += n;
+	}
+	return len;
+}
+
+/* Copy the Twrite payload held in tc->pipe to 'buf', which must have room
+ * for tc->u.twrite.count bytes, for write ops that cannot splice.
+ */
+int
+np_twrite_copyout(Npfcall *tc, u8 *buf)
+{
+	return np_pipe_copyout(tc, buf);
+}
+
+/* Copy the payload held in fc->pipe to 'buf', which must have room for
+ * all of it, e.g. to embed an Rread in a compound reply.
+ */
+int
+np_pipe_copyout(Npfcall *fc, u8 *buf)
+{
+	Nppipe *p = fc->pipe;
+	int len = 0;
+	ssize_t n;
+
+	while (p->len > 0) {
+		n = read(p->fd[0], buf + len, p->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			np_uerror(n < 0 ? errno : EIO);
+			return -1;
+		}
+		p->len -= n;
+		len += n;
+	}
+	return 0;
+}
+
+#else /* !HAVE_SPLICE */
+
+Nppipe *
+np_pipe_get(u32 msize)
+{
+	np_uerror(EOPNOTSUPP);
+	return NULL;
+}
+
+void
+np_pipe_put(Nppipe *p)
+{
+}
+
+Npfcall *
+np_splice_rread(Npconn *conn, int fd, u64 offset, u32 count)
+{
+	np_uerror(EOPNOTSUPP);
+	return NULL;
+}
+
+Npfcall *
+np_vmsplice_rread(Npconn *conn, struct iovec *iov, int iovcnt)
+{
+	np_uerror(EOPNOTSUPP);
+	return NULL;
+}
+
+int
+np_splice_twrite(Npfcall *tc, int fd, u64 offset)
+{
+	np_uerror(EOPNOTSUPP);
+	return -1;
+}
+
+int
+np_twrite_copyout(Npfcall *tc, u8 *buf)
+{
+	np_uerror(EOPNOTSUPP);
+	return -1;
+}
+
+int
+np_pipe_copyout(Npfcall *fc, u8 *buf)
+{
+	np_uerror(EOPNOTSUPP);
+	return -1;
+}
+
+#endif /* HAVE_SPLICE */
@@ -32,6 +32,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -45,11 +46,31 @@
 static Nptpool *np_tpool_create(Npsrv *srv, char *name);
 static void np_tpool_cleanup (Npsrv *srv);
 static void *np_wthread_proc(void *a);
-static void np_srv_remove_workreq(Nptpool *tp, Npreq *req);
-static void np_srv_add_workreq(Nptpool *tp, Npreq *req);
 
 static char *_ctl_get_conns (char *name, void *a);
 static char *_ctl_get_tpools (char *name, void *a);
+static char *_ctl_get_rbufs (char *name, void *a);
+static char *_ctl_get_latency (char *name, void *a);
+static char *_ctl_get_sched (char *name, void *a);
+
+/* Request types with latency histograms, mapped to their Nplat index + 1.
+ * Tflush is answered on receipt so it is not included.
+ */
+static const u8 lat_index[P9_RWSTAT + 1] = {
+	[P9_TSTATFS] = 1,	[P9_TLOPEN] = 2,	[P9_TLCREATE] = 3,
+	[P9_TSYMLINK] = 4,	[P9_TMKNOD] = 5,	[P9_TRENAME] = 6,
+	[P9_TREADLINK] = 7,	[P9_TGETATTR] = 8,	[P9_TSETATTR] = 9,
+	[P9_TXATTRWALK] = 10,	[P9_TXATTRCREATE] = 11,	[P9_TREADDIR] = 12,
+	[P9_TFSYNC] = 13,	[P9_TLOCK] = 14,	[P9_TGETLOCK] = 15,
+	[P9_TLINK] = 16,	[P9_TMKDIR] = 17,	[P9_TRENAMEAT] = 18,
+	[P9_TUNLINKAT] = 19,	[P9_TVERSION] = 20,	[P9_TAUTH] = 21,
+	[P9_TATTACH] = 22,	[P9_TWALK] = 23,	[P9_TREAD] = 24,
+	[P9_TWRITE] = 25,	[P9_TCLUNK] = 26,	[P9_TREMOVE] = 27,
+	[P9_TREADDIRPLUS] = 28,	[P9_TCOMPOUND] = 29,	[P9_TCOPYRANGE] = 30,
+};
+#if NPSTATS_LAT_OPS != 30
+#error fix lat_index to match NPSTATS_LAT_OPS
+#endif
 
 /* Ugly hack so NP_ASSERT can get to registsered srv->logmsg */
 static Npsrv *np_assert_srv = NULL;
@@ -70,6 +91,8 @@ np_srv_create(int nwthread, int flags)
 
 	srv->msize = 8216;
 	srv->flags = flags;
+	srv->sendqmax = 0;
+	srv->affinitymax = 0;
 
 	if (np_ctl_initialize (srv) < 0)
 		goto error;
@@ -77,12 +100,20 @@ np_srv_create(int nwthread, int flags)
 		goto error;
 	if (!np_ctl_addfile (srv->ctlroot, "tpools", _ctl_get_tpools, srv, 0))
 		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "rbufs", _ctl_get_rbufs, srv, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "latency", _ctl_get_latency, srv, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "sched", _ctl_get_sched, srv, 0))
+		goto error;
 	if (np_usercache_create (srv) < 0)
 		goto error;
 	srv->nwthread = nwthread;
 	if (!(srv->tpool = np_tpool_create (srv, "default")))
 		goto error;
 	np_tpool_incref (srv->tpool);
+	if (np_reactor_create (srv) < 0)
+		goto error;
 	np_assert_srv = srv;
 	return srv;
 error:
@@ -94,6 +125,7 @@ error:
 void
 np_srv_destroy(Npsrv *srv)
 {
+	np_reactor_destroy (srv);
 	np_tpool_decref (srv->tpool);
 	np_tpool_cleanup (srv);
 	np_usercache_destroy (srv);
@@ -135,7 +167,23 @@ np_srv_remove_conn(Npsrv *srv, Npconn *conn)
 		pc = &c->next;
 		c = *pc;
 	}
+	/* conn no longer receives, so its pool stats are final */
+	if (conn->trans) {
+		srv->rbufhit += conn->trans->rbufhit;
+		srv->rbufmiss += conn->trans->rbufmiss;
+	}
+	srv->nflush += conn->nflush;
+	xpthread_mutex_unlock(&srv->lock);
+}
 
+/* Account for a destroyed connection.  This must come after the conn's
+ * fidpool is destroyed, or np_srv_wait_conncount () could return while
+ * fids are still being torn down, racing with server finalization.
+ */
+void
+np_srv_conn_destroyed(Npsrv *srv)
+{
+	xpthread_mutex_lock(&srv->lock);
 	srv->conncount--;
 	xpthread_cond_signal(&srv->conncountcond);
 	xpthread_mutex_unlock(&srv->lock);
@@ -156,29 +204,59 @@ np_srv_wait_conncount(Npsrv *srv, int count)
 	xpthread_mutex_unlock(&srv->lock);
 }
 
+/* Queue a request on its fid's thread pool and link it to its connection
+ * so np_flush () and np_conn_flush () can find it.  Each pool has its own
+ * lock, so unrelated pools and connections do not contend.
+ * Lock order is conn->lock, then tpool->lock.
+ */
 void
 np_srv_add_req(Npsrv *srv, Npreq *req)
 {
+	Npconn *conn = req->conn;
 	Nptpool *tp = NULL;
+	int i;
 
-	/* assert: srv->lock held */
 	if (req->fid)
 		tp = req->fid->tpool;
 	if (!tp)
 		tp = srv->tpool;
+	req->tpool = tp;
+	if (req->fid && req->fid->user)
+		req->uid = req->fid->user->uid;
+
+	xpthread_mutex_lock(&conn->lock);
+	np_conn_add_req(conn, req);
+	xpthread_mutex_lock(&tp->lock);
+	req->next = NULL;
 	req->prev = tp->reqs_last;
 	if (tp->reqs_last)
 		tp->reqs_last->next = req;
 	tp->reqs_last = req;
 	if (!tp->reqs_first)
 		tp->reqs_first = req;
-	xpthread_cond_signal(&tp->reqcond);
+	if (req->uid != P9_NONUNAME) {
+		i = req->uid % NP_UQ_BUCKETS;
+		req->unext = NULL;
+		req->uprev = tp->uq_last[i];
+		if (tp->uq_last[i])
+			tp->uq_last[i]->unext = req;
+		tp->uq_last[i] = req;
+		if (!tp->uq_first[i])
+			tp->uq_first[i] = req;
+	}
+	/* skip the wakeup while every worker is busy */
+	if (tp->nidle > 0)
+		xpthread_cond_signal(&tp->reqcond);
+	xpthread_mutex_unlock(&tp->lock);
+	xpthread_mutex_unlock(&conn->lock);
 }
 
 void
 np_srv_remove_req(Nptpool *tp, Npreq *req)
 {
-	/* assert: srv->lock held */
+	int i;
+
+	/* assert: tp->lock held */
 	if (req->prev)
 		req->prev->next = req->next;
 	if (req->next)
@@ -187,29 +265,52 @@ np_srv_remove_req(Nptpool *tp, Npreq *req)
 		tp->reqs_first = req->next;
 	if (req == tp->reqs_last)
 		tp->reqs_last = req->prev;
+	req->next = req->prev = NULL;
+	if (req->uid != P9_NONUNAME) {
+		i = req->uid % NP_UQ_BUCKETS;
+		if (req->uprev)
+			req->uprev->unext = req->unext;
+		if (req->unext)
+			req->unext->uprev = req->uprev;
+		if (req == tp->uq_first[i])
+			tp->uq_first[i] = req->unext;
+		if (req == tp->uq_last[i])
+			tp->uq_last[i] = req->uprev;
+		req->unext = req->uprev = NULL;
+	}
 }
 
-static void
-np_srv_add_workreq(Nptpool *tp, Npreq *req)
+/* Pick the next request for a worker.  Switching fsuid/fsgid/groups costs
+ * several syscalls, so prefer the oldest request of the user whose
+ * credentials the worker already holds.  A worker takes at most
+ * srv->affinitymax requests ahead of the queue head in a row, which
+ * bounds how long other users can be passed over.
+ */
+static Npreq *
+np_srv_next_req(Nptpool *tp, Npwthread *wt)
 {
-	/* assert: srv->lock held */
-	if (tp->workreqs)
-		tp->workreqs->prev = req;
-	req->next = tp->workreqs;
-	tp->workreqs = req;
-	req->prev = NULL;
-}
+	Npsrv *srv = tp->srv;
+	Npreq *req = tp->reqs_first;
+	Npreq *ureq;
 
-static void
-np_srv_remove_workreq(Nptpool *tp, Npreq *req)
-{
-	/* assert: srv->lock held */
-	if (req->prev)
-		req->prev->next = req->next;
-	else
-		tp->workreqs = req->next;
-	if (req->next)
-		req->next->prev = req->prev;
+	/* assert: tp->lock held */
+	if (!req)
+		return NULL;
+	if (!(srv->flags & SRV_FLAGS_SETFSID) || req->uid == wt->fsuid
+					      || wt->streak >= srv->affinitymax) {
+		wt->streak = 0;
+		return req;
+	}
+	ureq = tp->uq_first[wt->fsuid % NP_UQ_BUCKETS];
+	while (ureq && ureq->uid != wt->fsuid)
+		ureq = ureq->unext;
+	if (!ureq) {
+		wt->streak = 0;
+		return req;
+	}
+	wt->streak++;
+	wt->affinity++;
+	return ureq;
 }
 
 static int
@@ -219,8 +320,9 @@ np_wthread_create(Nptpool *tp)
 	Npwthread *wt;
 
 	/* assert srv->lock held */
-	if (!(wt = malloc(sizeof(*wt)))) {
-		np_uerror (ENOMEM);
+	/* aligned so wt->stats shares no cache line with other threads */
+	if ((err = posix_memalign ((void **)&wt, NP_CACHELINE, sizeof(*wt)))) {
+		np_uerror (err);
 		goto error;
 	}
 	memset (wt, 0, sizeof (*wt));
@@ -248,10 +350,12 @@ np_tpool_destroy(Nptpool *tp)
 	void *retval;
 	int err, i;
 
+	xpthread_mutex_lock(&tp->lock);
 	for(wt = tp->wthreads; wt != NULL; wt = wt->next) {
 		wt->shutdown = 1;
 	}
 	xpthread_cond_broadcast(&tp->reqcond);
+	xpthread_mutex_unlock(&tp->lock);
 	for (i = 0, wt = tp->wthreads; wt != NULL; wt = next, i++) {
 		next = wt->next;
 		if ((err = pthread_join (wt->thread, &retval))) {
@@ -397,11 +501,52 @@ np_tpool_cleanup (Npsrv *srv)
  * The fid refcount is incremented here, then decremented in
  * np_process_request ().
  */
+static Npfcall *np_compound(Npreq *req, Npfcall *tc, Npwthread *wt);
+
+/* Requests that may appear in a Tcompound: file system operations,
+ * but not those that set up the connection or refer to other requests.
+ */
+static int
+np_compound_allowed(u8 type)
+{
+	switch (type) {
+		case P9_TSTATFS:
+		case P9_TLOPEN:
+		case P9_TLCREATE:
+		case P9_TSYMLINK:
+		case P9_TMKNOD:
+		case P9_TRENAME:
+		case P9_TREADLINK:
+		case P9_TGETATTR:
+		case P9_TSETATTR:
+		case P9_TXATTRWALK:
+		case P9_TXATTRCREATE:
+		case P9_TREADDIR:
+		case P9_TREADDIRPLUS:
+		case P9_TFSYNC:
+		case P9_TLOCK:
+		case P9_TGETLOCK:
+		case P9_TLINK:
+		case P9_TMKDIR:
+		case P9_TRENAMEAT:
+		case P9_TUNLINKAT:
+		case P9_TCOPYRANGE:
+		case P9_TWALK:
+		case P9_TREAD:
+		case P9_TWRITE:
+		case P9_TCLUNK:
+		case P9_TREMOVE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
 static void
-np_preprocess_request(Npreq *req)
+np_preprocess_request(Npreq *req, Npfcall *tc)
 {
-	Npfcall *tc = req->tcall;
 	Npconn *conn = req->conn;
+	Npfcall sub;
 
 	switch (tc->type) {
 		case P9_TSTATFS:
@@ -440,6 +585,9 @@ np_preprocess_request(Npreq *req)
 		case P9_TREADDIR:
 			req->fid = np_fid_find (conn, tc->u.treaddir.fid);
 			break;
+		case P9_TREADDIRPLUS:
+			req->fid = np_fid_find (conn, tc->u.treaddirplus.fid);
+			break;
 		case P9_TFSYNC:
 			req->fid = np_fid_find (conn, tc->u.tfsync.fid);
 			break;
@@ -505,6 +653,19 @@ np_preprocess_request(Npreq *req)
 		case P9_TUNLINKAT:
 			req->fid = np_fid_find (conn, tc->u.tunlinkat.dirfid);
 			break;
+		case P9_TCOPYRANGE:
+			req->fid = np_fid_find (conn, tc->u.tcopyrange.srcfid);
+			break;
+		case P9_TCOMPOUND:
+			/* Schedule by the fid of the first request.
+			 */
+			if (tc->u.tcompound.count > 0
+			    && np_deserialize_compound (&sub,
+						tc->u.tcompound.data,
+						tc->u.tcompound.size) > 0
+			    && np_compound_allowed (sub.type))
+				np_preprocess_request (req, &sub);
+			break;
 		default:
 			break;
 	}
@@ -533,11 +694,60 @@ _hbin (u64 val)
 	return j < NPSTATS_RWCOUNT_BINS ? j : NPSTATS_RWCOUNT_BINS - 1;
 }
 
+static u64
+_now_usec (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Log-linear bins: exact below 4us, then four per power of two.
+ */
+static int
+_lat_bin (u64 usec)
+{
+	u32 msb, bin;
+
+	if (usec < 4)
+		return usec;
+	if (usec >= (1ULL << 30))
+		return NPSTATS_LAT_BINS - 1;
+	msb = _floorlog2 ((u32)usec);
+	bin = 4 * (msb - 1) + ((usec >> (msb - 2)) & 3);
+
+	return bin < NPSTATS_LAT_BINS ? bin : NPSTATS_LAT_BINS - 1;
+}
+
+/* Upper bound in usec of values counted in 'bin'.
+ */
+u64
+np_lat_bin_usec (int bin)
+{
+	int msb = bin / 4 + 1;
+
+	if (bin < 4)
+		return bin;
+	return ((u64)(4 + bin % 4 + 1) << (msb - 2)) - 1;
+}
+
+static void
+np_record_latency (Npreq *req, Npwthread *wt, u64 done)
+{
+	int op = lat_index[req->tcall->type] - 1;
+
+	if (op < 0)
+		return;
+	wt->lat.wait[op][_lat_bin (req->dequeued - req->birth)]++;
+	wt->lat.serv[op][_lat_bin (done - req->dequeued)]++;
+}
+
 static Npfcall*
-np_process_request(Npreq *req, Nptpool *tp)
+np_process_request(Npreq *req, Npfcall *tc, Npwthread *wt)
 {
 	Npfcall *rc = NULL;
-	Npfcall *tc = req->tcall;
+	Npstats *stats = &wt->stats;
 	u64 rbytes = 0, wbytes = 0;
 
 	np_uerror(0);
@@ -578,6 +788,9 @@ np_process_request(Npreq *req, Nptpool *tp)
 		case P9_TREADDIR:
 			rc = np_readdir(req, tc);
 			break;
+		case P9_TREADDIRPLUS:
+			rc = np_readdirplus(req, tc);
+			break;
 		case P9_TFSYNC:
 			rc = np_fsync(req, tc);
 			break;
@@ -599,6 +812,9 @@ np_process_request(Npreq *req, Nptpool *tp)
 		case P9_TUNLINKAT:
 			rc = np_unlinkat (req, tc);
 			break;
+		case P9_TCOPYRANGE:
+			rc = np_copyrange (req, tc);
+			break;
 		case P9_TVERSION:
 			rc = np_version(req, tc);
 			break;
@@ -630,24 +846,185 @@ np_process_request(Npreq *req, Nptpool *tp)
 		case P9_TREMOVE:
 			rc = np_remove(req, tc);
 			break;
+		case P9_TCOMPOUND:
+			rc = np_compound(req, tc, wt);
+			break;
 		default:
 			NP_ASSERT (0); /* handled in np_deserialize */
 			break;
 	}
 
-	/* update stats */
-	xpthread_mutex_lock (&tp->srv->lock);
+	/* update this thread's stats */
 	if (rbytes > 0) {
-		tp->stats.rcount[_hbin(rbytes)]++;
-		tp->stats.rbytes += rbytes;
+		stats->rcount[_hbin(rbytes)]++;
+		stats->rbytes += rbytes;
 	}
 	if (wbytes > 0) {
-		tp->stats.wcount[_hbin(wbytes)]++;
-		tp->stats.wbytes += wbytes;
+		stats->wcount[_hbin(wbytes)]++;
+		stats->wbytes += wbytes;
+	}
+	stats->nreqs[tc->type]++;
+
+	return rc;
+}
+
+/* Fix up the fid accounting of request 'tc' that was interrupted
+ * with a signal due to a flush.
+ */
+static void
+np_interrupted_request(Npreq *req, Npfcall *tc)
+{
+	switch (tc->type) {
+		case P9_TCLUNK:
+		case P9_TREMOVE:
+			req->fid = NULL; /* avoid final decrement */
+			break;
+		case P9_TWALK: {
+			u32 ofid = tc->u.twalk.fid;
+			u32 nfid = tc->u.twalk.newfid;
+
+			if (ofid != nfid)
+				np_fid_decref_bynum (req->conn, nfid);
+			break;
+		}
+	}
+}
+
+/* Limit the count of a read-like request to what fits in 'room' bytes
+ * of compound reply.  Returns -1 if not even its header fits.
+ */
+static int
+np_compound_clamp(Npfcall *tc, u32 room)
+{
+	u32 max, *countp;
+
+	switch (tc->type) {
+		case P9_TREAD:
+			countp = &tc->u.tread.count;
+			break;
+		case P9_TREADDIR:
+			countp = &tc->u.treaddir.count;
+			break;
+		case P9_TREADDIRPLUS:
+			countp = &tc->u.treaddirplus.count;
+			break;
+		default:
+			return 0;
 	}
-	tp->stats.nreqs[tc->type]++;
-	xpthread_mutex_unlock (&tp->srv->lock);
+	/* size[4] type[1] tag[2] count[4] */
+	if (room <= 11)
+		return -1;
+	max = room - 11;
+	if (*countp > max)
+		*countp = max;
+	return 0;
+}
 
+/* Execute the requests of a Tcompound in order on this worker,
+ * stopping at the first error, and pack their replies into an Rcompound.
+ * Each request looks up its own fids, so it can use a fid created by
+ * an earlier one.  Requests are validated before any is executed.
+ */
+static Npfcall *
+np_compound(Npreq *req, Npfcall *tc, Npwthread *wt)
+{
+	Npconn *conn = req->conn;
+	char ebuf[STATIC_RLERROR_SIZE];
+	u32 off, used = 0, room, rsize;
+	Npfcall sub, *rc = NULL, *src;
+	Npfid *fid = req->fid;
+	int i, n, ecode = 0;
+	u8 *p;
+
+	if (!(conn->flags & CONN_FLAGS_DIODEXT)) {
+		np_uerror (ENOSYS);
+		return NULL;
+	}
+	for (off = 0, i = 0; i < tc->u.tcompound.count; i++) {
+		n = np_deserialize_compound (&sub, tc->u.tcompound.data + off,
+					     tc->u.tcompound.size - off);
+		if (n == 0 || !np_compound_allowed (sub.type)) {
+			np_uerror (EIO);
+			np_logerr (conn->srv, "compound: invalid request %d", i);
+			return NULL;
+		}
+		off += n;
+	}
+	/* Keep room for the Rlerror of a request that fails.
+	 */
+	rsize = STATIC_RLERROR_SIZE - sizeof (Npfcall);
+	room = conn->msize - P9_COMPOUNDHDRSZ - rsize;
+	if (!(rc = np_create_rcompound (conn->msize - P9_COMPOUNDHDRSZ))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	/* The fid that scheduled the request is looked up again below.
+	 */
+	if (fid) {
+		req->fid = NULL;
+		np_fid_decref (&fid);
+	}
+	for (off = 0, i = 0; i < tc->u.tcompound.count; i++) {
+		off += np_deserialize_compound (&sub,
+					        tc->u.tcompound.data + off,
+					        tc->u.tcompound.size - off);
+		src = NULL;
+		np_uerror (0);
+		if (np_compound_clamp (&sub, room - used) < 0)
+			np_uerror (EMSGSIZE);
+		else {
+			np_preprocess_request (req, &sub);
+			src = np_process_request (req, &sub, wt);
+		}
+		ecode = np_rerror ();
+		if (ecode == EINTR)
+			np_interrupted_request (req, &sub);
+		if (req->fid) {
+			np_fid_decref (&req->fid);
+			req->fid = NULL;
+		}
+		if (ecode == EINTR) {
+			if (src)
+				np_free_fcall (src);
+			np_free_fcall (rc);
+			return NULL;
+		}
+		/* A walk that stops short fails, without creating newfid.
+		 */
+		if (!ecode && src && sub.type == P9_TWALK
+		    && src->u.rwalk.nwqid < sub.u.twalk.nwname) {
+			if (sub.u.twalk.fid != sub.u.twalk.newfid)
+				np_fid_decref_bynum (conn, sub.u.twalk.newfid);
+			ecode = ENOENT;
+		}
+		if (!ecode && (!src || used + src->size > room))
+			ecode = src ? EMSGSIZE : EIO;
+		if (ecode) {
+			if (src)
+				np_free_fcall (src);
+			src = np_create_rlerror_static (ecode, ebuf,
+							sizeof (ebuf));
+		}
+		p = rc->u.rcompound.data + used;
+		if (src->pipe) {
+			n = src->size - src->pipe->len;
+			memcpy (p, src->pkt, n);
+			if (np_pipe_copyout (src, p + n) < 0) {
+				np_free_fcall (src);
+				np_free_fcall (rc);
+				return NULL;
+			}
+		} else
+			memcpy (p, src->pkt, src->size);
+		p[5] = sub.tag;
+		p[6] = sub.tag >> 8;
+		used += src->size;
+		if (ecode)
+			break;
+		np_free_fcall (src);
+	}
+	np_finalize_rcompound (rc, ecode ? i + 1 : i, used);
+	np_uerror (0);
 	return rc;
 }
 
@@ -663,20 +1040,7 @@ np_postprocess_request(Npreq *req, Npfcall *rc)
 	 * fix up the fid accounting and suppress reply.
 	 */
 	if (ecode == EINTR) {
-		switch (tc->type) {
-			case P9_TCLUNK:
-			case P9_TREMOVE:
-				req->fid = NULL; /* avoid final decrement */
-				break;
-			case P9_TWALK: {
-				u32 ofid = tc->u.twalk.fid;
-				u32 nfid = tc->u.twalk.newfid;
-
-				if (ofid != nfid)
-					np_fid_decref_bynum (req->conn, nfid);
-				break;
-			}
-		}
+		np_interrupted_request (req, tc);
 		req->state = REQ_NOREPLY;
 	}
 	/* In case this was Tclunk or Tremove, fid must be discarded
@@ -690,7 +1054,7 @@ np_postprocess_request(Npreq *req, Npfcall *rc)
 	 */
 	if (ecode) {
 		if (rc)
-			free(rc);
+			np_free_fcall(rc);
 		np_req_respond_error(req, ecode);
 	} else
 		np_req_respond(req, rc);
@@ -720,31 +1084,38 @@ np_wthread_proc(void *a)
 	Npreq *req = NULL;
 	Npfcall *rc;
 
-	xpthread_mutex_lock(&tp->srv->lock);
+	xpthread_mutex_lock(&tp->lock);
 	while (!wt->shutdown) {
-		req = tp->reqs_first;
+		req = np_srv_next_req(tp, wt);
 		if (!req) {
-			xpthread_cond_wait(&tp->reqcond, &tp->srv->lock);
+			tp->nidle++;
+			xpthread_cond_wait(&tp->reqcond, &tp->lock);
+			tp->nidle--;
 			continue;
 		}
 		np_srv_remove_req(tp, req);
-		np_srv_add_workreq(tp, req);
 		req->wthread = wt;
-		xpthread_mutex_unlock(&tp->srv->lock);
+		tp->nworking++;
+		xpthread_mutex_unlock(&tp->lock);
 
-		rc = np_process_request(req, tp);
+		req->dequeued = _now_usec ();
+		rc = np_process_request(req, req->tcall, wt);
 		np_postprocess_request (req, rc);
+		np_record_latency (req, wt, _now_usec ());
 
-		xpthread_mutex_lock(&tp->srv->lock);
-		np_srv_remove_workreq(tp, req);
-		xpthread_mutex_unlock(&tp->srv->lock);
+		/* Once unlinked, a Tflush can no longer set req->flushreq.
+		 */
+		xpthread_mutex_lock(&req->conn->lock);
+		np_conn_remove_req(req->conn, req);
+		xpthread_mutex_unlock(&req->conn->lock);
 
 		np_postprocess_flush (req);
 		np_req_unref(req);
 
-		xpthread_mutex_lock(&tp->srv->lock);
+		xpthread_mutex_lock(&tp->lock);
+		tp->nworking--;
 	}
-	xpthread_mutex_unlock (&tp->srv->lock);
+	xpthread_mutex_unlock (&tp->lock);
 
 	return NULL;
 }
@@ -800,13 +1171,20 @@ np_req_alloc(Npconn *conn, Npfcall *tc) {
 	req->flushreq = NULL;
 	req->tcall = tc;
 	req->rcall = NULL;
+	req->tpool = NULL;
 	req->next = NULL;
 	req->prev = NULL;
 	req->wthread = NULL;
+	req->cnext = NULL;
+	req->cprev = NULL;
+	req->uid = P9_NONUNAME;
+	req->unext = NULL;
+	req->uprev = NULL;
 	req->fid = NULL;
-	req->birth = time (NULL);
+	req->birth = _now_usec ();
+	req->dequeued = 0;
 
-	np_preprocess_request (req); /* assigns req->fid */
+	np_preprocess_request (req, tc); /* assigns req->fid */
 
 	return req;
 }
@@ -838,16 +1216,17 @@ np_req_unref(Npreq *req)
 	}
 	if (req->flushreq)
 		np_req_unref(req->flushreq);
+	/* tcall goes back to the conn's receive buffer pool */
+	if (req->tcall) {
+		np_trans_release (req->conn->trans, req->tcall);
+		req->tcall = NULL;
+	}
 	if (req->conn) {
 		np_conn_decref(req->conn);
 		req->conn = NULL;
 	}
-	if (req->tcall) {
-		free (req->tcall);
-		req->tcall = NULL;
-	}
 	if (req->rcall) {
-		free (req->rcall);
+		np_free_fcall (req->rcall);
 		req->rcall = NULL;
 	}
 	pthread_mutex_destroy (&req->lock);
@@ -937,27 +1316,53 @@ error_unlock:
 	return NULL;
 }
 
+static void
+_stats_add (Npstats *dst, Npstats *src)
+{
+	int i;
+
+	for (i = 0; i <= P9_RWSTAT; i++)
+		dst->nreqs[i] += src->nreqs[i];
+	dst->rbytes += src->rbytes;
+	dst->wbytes += src->wbytes;
+	for (i = 0; i < NPSTATS_RWCOUNT_BINS; i++) {
+		dst->rcount[i] += src->rcount[i];
+		dst->wcount[i] += src->wcount[i];
+	}
+}
+
 static char *
 _ctl_get_tpools (char *name, void *a)
 {
 	Npsrv *srv = (Npsrv *)a;
 	Nptpool *tp;
+	Npwthread *wt;
+	Npconn *cc;
 	Npreq *req;
+	Npstats stats;
 	char *s = NULL;
 	int n, len = 0;
 
 	xpthread_mutex_lock(&srv->lock);
 	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
-		tp->stats.name = tp->name;
 		xpthread_mutex_lock (&tp->lock);
-		tp->stats.numfids = tp->refcount;
-		xpthread_mutex_unlock (&tp->lock);
-		tp->stats.numreqs = 0;
+		stats = tp->stats;
+		stats.name = tp->name;
+		stats.numfids = tp->refcount;
+		stats.numreqs = tp->nworking;
 		for (req = tp->reqs_first; req != NULL; req = req->next)
-			tp->stats.numreqs++;
-		for (req = tp->workreqs; req != NULL; req = req->next)
-			tp->stats.numreqs++;
-		n = np_encode_tpools_str (&s, &len, &tp->stats);
+			stats.numreqs++;
+		xpthread_mutex_unlock (&tp->lock);
+		/* wthreads list is fixed for the life of the tpool */
+		for (wt = tp->wthreads; wt != NULL; wt = wt->next)
+			_stats_add (&stats, &wt->stats);
+		/* Tflush is handled on receipt and charged to the default */
+		if (tp == srv->tpool) {
+			stats.nreqs[P9_TFLUSH] += srv->nflush;
+			for (cc = srv->conns; cc != NULL; cc = cc->next)
+				stats.nreqs[P9_TFLUSH] += cc->nflush;
+		}
+		n = np_encode_tpools_str (&s, &len, &stats);
 		if (n < 0) {
 			np_uerror (ENOMEM);
 			goto error_unlock;
@@ -971,3 +1376,119 @@ error_unlock:
 		free(s);
 	return NULL;
 }
+
+static char *
+_ctl_get_latency (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Nptpool *tp;
+	Npwthread *wt;
+	Nplat *lat;
+	char *s = NULL;
+	int len = 0;
+	int i, j, op;
+
+	if (!(lat = malloc (sizeof (*lat)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	xpthread_mutex_lock(&srv->lock);
+	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
+		memset (lat, 0, sizeof (*lat));
+		for (wt = tp->wthreads; wt != NULL; wt = wt->next) {
+			for (i = 0; i < NPSTATS_LAT_OPS; i++) {
+				for (j = 0; j < NPSTATS_LAT_BINS; j++) {
+					lat->wait[i][j] += wt->lat.wait[i][j];
+					lat->serv[i][j] += wt->lat.serv[i][j];
+				}
+			}
+		}
+		for (i = 0; i <= P9_RWSTAT; i++) {
+			if ((op = lat_index[i] - 1) < 0)
+				continue;
+			for (j = 0; j < NPSTATS_LAT_BINS; j++) {
+				if (lat->serv[op][j] > 0)
+					break;
+			}
+			if (j == NPSTATS_LAT_BINS)
+				continue;
+			if (np_encode_latency_str (&s, &len, tp->name, i, 'q',
+						   lat->wait[op]) < 0
+			 || np_encode_latency_str (&s, &len, tp->name, i, 's',
+						   lat->serv[op]) < 0) {
+				np_uerror (ENOMEM);
+				goto error_unlock;
+			}
+		}
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	free (lat);
+	return s;
+error_unlock:
+	xpthread_mutex_unlock(&srv->lock);
+	free (lat);
+	if (s)
+		free(s);
+	return NULL;
+}
+
+/* One line per tpool: name, requests run by workers, credential switches
+ * in np_setfsid (), and requests picked out of order to avoid a switch.
+ */
+static char *
+_ctl_get_sched (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Nptpool *tp;
+	Npwthread *wt;
+	u64 nreqs, credswitch, affinity;
+	char *s = NULL;
+	int i, len = 0;
+
+	xpthread_mutex_lock(&srv->lock);
+	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
+		nreqs = credswitch = affinity = 0;
+		for (wt = tp->wthreads; wt != NULL; wt = wt->next) {
+			for (i = 0; i <= P9_RWSTAT; i++)
+				nreqs += wt->stats.nreqs[i];
+			credswitch += wt->credswitch;
+			affinity += wt->affinity;
+		}
+		if (aspf (&s, &len, "%s %"PRIu64" %"PRIu64" %"PRIu64"\n",
+			  tp->name, nreqs, credswitch, affinity) < 0) {
+			np_uerror (ENOMEM);
+			goto error_unlock;
+		}
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	return s;
+error_unlock:
+	xpthread_mutex_unlock(&srv->lock);
+	if (s)
+		free(s);
+	return NULL;
+}
+
+static char *
+_ctl_get_rbufs (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npconn *cc;
+	u64 hit, miss;
+	char *s = NULL;
+	int len = 0;
+
+	xpthread_mutex_lock(&srv->lock);
+	hit = srv->rbufhit;
+	miss = srv->rbufmiss;
+	for (cc = srv->conns; cc != NULL; cc = cc->next) {
+		hit += cc->trans->rbufhit;
+		miss += cc->trans->rbufmiss;
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	if (aspf (&s, &len, "hit %"PRIu64"\nmiss %"PRIu64"\n", hit, miss) < 0) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	return s;
+}
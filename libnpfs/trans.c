@@ -52,6 +52,14 @@ np_trans_create(void *aux,
 	trans->recv = recv;
 	trans->send = send;
 	trans->destroy = destroy;
+	trans->pollfd = NULL;
+	trans->release = NULL;
+	trans->sendpipe = NULL;
+	trans->splicewrite = 0;
+	trans->sendv = NULL;
+	trans->pollfdout = NULL;
+	trans->rbufhit = 0;
+	trans->rbufmiss = 0;
 
 	return trans;
 }
@@ -67,9 +75,56 @@ np_trans_destroy(Nptrans *trans)
 int
 np_trans_send (Nptrans *trans, Npfcall *fc)
 {
+	if (fc->pipe) {
+		NP_ASSERT (trans->sendpipe != NULL);
+		return trans->sendpipe(fc, trans->aux);
+	}
 	return trans->send(fc, trans->aux);
 }
 
+/* Return the file descriptor a reactor should poll for input on this
+ * transport, or -1 if the transport must be serviced by a blocking thread.
+ */
+int
+np_trans_pollfd (Nptrans *trans)
+{
+	if (!trans->pollfd)
+		return -1;
+	return trans->pollfd(trans->aux);
+}
+
+/* Return the file descriptor a reactor should poll for output, or -1 if
+ * the transport cannot send replies from a queue with np_trans_sendv ().
+ */
+int
+np_trans_pollfdout (Nptrans *trans)
+{
+	if (!trans->sendv || !trans->pollfdout)
+		return -1;
+	return trans->pollfdout(trans->aux);
+}
+
+/* Send replies from 'first' through 'last', linked by fc->next, starting
+ * 'off' bytes into 'first', without blocking.  Returns the number of bytes
+ * sent, or -1 with np_rerror () set (EAGAIN if nothing could be sent).
+ */
+int
+np_trans_sendv (Nptrans *trans, Npfcall *first, Npfcall *last, u32 off)
+{
+	return trans->sendv(first, last, off, trans->aux);
+}
+
+/* Return a received fcall to the transport's buffer pool, if it has one.
+ */
+void
+np_trans_release (Nptrans *trans, Npfcall *fc)
+{
+	if (trans->release)
+		trans->release(fc, trans->aux);
+	else
+		free(fc);
+}
+
 int
 np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 {
@@ -77,12 +132,21 @@ np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 
 	if (trans->recv (&fc, msize, trans->aux) < 0)
 		return -1;
-	if (fc && !np_deserialize(fc)) {
-		free (fc);
-		np_uerror (EPROTO);
-		return -1;
+	if (fc && !np_deserialize(fc))
+		goto error;
+	/* Twrite payload received into a pipe is not in fc->pkt.
+	 */
+	if (fc && fc->pipe) {
+		if (fc->type != P9_TWRITE
+				|| fc->u.twrite.count != fc->pipe->len)
+			goto error;
+		fc->u.twrite.data = NULL;
 	}
 	*fcp = fc;
 	return 0;
+error:
+	np_trans_release (trans, fc);
+	np_uerror (EPROTO);
+	return -1;
 }
 
@@ -116,6 +116,7 @@ np_setfsid (Npreq *req, Npuser *u, u32 gid_override)
 	int i, ret = -1;
 	u32 gid;
 	uid_t authuid;
+	int chg = 0;
 
 	if (np_conn_get_authuser(req->conn, &authuid) < 0)
 		authuid = P9_NONUNAME;
@@ -140,6 +141,7 @@ np_setfsid (Npreq *req, Npuser *u, u32 gid_override)
 		}
 		gid = (gid_override == -1 ? u->gid : gid_override);
 		if (wt->fsgid != gid) {
+			chg = 1;
 			if (! wt->privcap) {
 				/* restore privileged uid */
 				if (fbsd_setthreaduid (0) == -1) {
@@ -161,6 +163,7 @@ np_setfsid (Npreq *req, Npuser *u, u32 gid_override)
 			wt->fsgid = gid;
 		}
 		if (wt->fsuid != u->uid) {
+			chg = 1;
 			/* Set suppl groups first! */
 			/* Suppl groups need to be part of cred for NFS
 			 * forwarding even with DAC_BYPASS.
@@ -199,5 +202,7 @@ np_setfsid (Npreq *req, Npuser *u, u32 gid_override)
 	}
 	ret = 0;
 done:
+	if (chg)
+		wt->credswitch++;
 	return ret;
 }
@@ -210,6 +210,8 @@ np_setfsid (Npreq *req, Npuser *u, u32 gid_override)
 #endif
 	ret = 0;
 done:
+	if (dumpclrd)
+		wt->credswitch++;
 	if (dumpclrd && prctl (PR_SET_DUMPABLE, 1, 0, 0, 0) < 0)
         	np_logerr (srv, "prctl PR_SET_DUMPABLE failed");
 	return ret;
@@ -0,0 +1,170 @@
+/* tnpsrv4.c - test that reads hitting EOF are not delayed over TCP */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "list.h"
+#include "diod_log.h"
+#include "diod_conf.h"
+#include "diod_sock.h"
+
+#include "ops.h"
+
+#define TEST_MSIZE 65536
+#define TEST_COUNT 32768    /* large enough to be spliced */
+#define TEST_FILESIZE 40000
+#define TEST_ITER 10
+#define TEST_MAXMS 100      /* well under the 200ms TCP cork timeout */
+
+/* Connect a pair of TCP sockets over the loopback interface.
+ */
+static void
+_tcp_pair (int *cfd, int *sfd)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof (sin);
+    int lfd;
+
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if ((lfd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+        err_exit ("socket");
+    if (bind (lfd, (struct sockaddr *)&sin, sizeof (sin)) < 0)
+        err_exit ("bind");
+    if (getsockname (lfd, (struct sockaddr *)&sin, &len) < 0)
+        err_exit ("getsockname");
+    if (listen (lfd, 1) < 0)
+        err_exit ("listen");
+    if ((*cfd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+        err_exit ("socket");
+    if (connect (*cfd, (struct sockaddr *)&sin, sizeof (sin)) < 0)
+        err_exit ("connect");
+    if ((*sfd = accept (lfd, NULL, NULL)) < 0)
+        err_exit ("accept");
+    close (lfd);
+}
+
+static double
+_now_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    int cfd, sfd;
+    Npcfid *root, *f;
+    char tmpdir[] = "/tmp/tnpsrv4.XXXXXX";
+    char *buf;
+    double t, worst = 0;
+    u64 off;
+    int i, n, slow = 0;
+
+    diod_log_init (argv[0]);
+    diod_conf_init ();
+    diod_conf_set_auth_required (0);
+
+    if (!mkdtemp (tmpdir))
+        err_exit ("mkdtemp");
+    diod_conf_add_exports (tmpdir);
+
+    _tcp_pair (&cfd, &sfd);
+
+    if (!(srv = np_srv_create (4, 0)))
+        errn_exit (np_rerror (), "np_srv_create");
+    if (diod_init (srv) < 0)
+        errn_exit (np_rerror (), "diod_init");
+    diod_sock_startfd (srv, sfd, sfd, "loopback", 0);
+
+    if (!(root = npc_mount (cfd, cfd, TEST_MSIZE, tmpdir, NULL)))
+        errn_exit (np_rerror (), "npc_mount");
+    msg ("attached");
+
+    if (!(buf = malloc (TEST_COUNT)))
+        msg_exit ("out of memory");
+    memset (buf, 7, TEST_COUNT);
+    if (!(f = npc_create_bypath (root, "foo", 0, 0644, getgid ())))
+        errn_exit (np_rerror (), "npc_create_bypath");
+    if (npc_clunk (f) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    if (npc_put (root, "foo", buf, TEST_FILESIZE) != TEST_FILESIZE)
+        errn_exit (np_rerror (), "npc_put");
+
+    /* read the file sequentially to EOF, as a client with a large
+     * msize would, timing the last, empty, read of each pass */
+    for (i = 0; i < TEST_ITER; i++) {
+        if (!(f = npc_open_bypath (root, "foo", O_RDONLY)))
+            errn_exit (np_rerror (), "npc_open_bypath");
+        off = 0;
+        do {
+            t = _now_ms ();
+            if ((n = npc_pread (f, buf, TEST_COUNT, off)) < 0)
+                errn_exit (np_rerror (), "npc_pread");
+            off += n;
+        } while (n > 0);
+        t = _now_ms () - t;
+        if (t > worst)
+            worst = t;
+        if (t > TEST_MAXMS)
+            slow++;
+        if (off != TEST_FILESIZE)
+            msg ("short read: %d bytes", (int)off);
+        if (npc_clunk (f) < 0)
+            errn_exit (np_rerror (), "npc_clunk");
+    }
+    if (slow > 0)
+        msg ("%d of %d reads at EOF took over %dms (worst %.0fms)",
+             slow, TEST_ITER, TEST_MAXMS, worst);
+    else
+        msg ("reads at EOF were prompt");
+
+    if (npc_remove_bypath (root, "foo") < 0)
+        errn_exit (np_rerror (), "npc_remove_bypath");
+    free (buf);
+
+    npc_umount (root);
+    msg ("detached");
+
+    np_srv_wait_conncount (srv, 1);
+    sleep (1); /* see tnpsrv2.c */
+
+    diod_fini (srv);
+    np_srv_destroy (srv);
+
+    rmdir (tmpdir);
+
+    diod_conf_fini ();
+    diod_log_fini ();
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
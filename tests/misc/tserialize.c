@@ -44,6 +44,9 @@ static void test_tlink (void);          static void test_rlink (void);
 static void test_tmkdir (void);         static void test_rmkdir (void);
 static void test_trenameat (void);      static void test_rrenameat (void);
 static void test_tunlinkat (void);      static void test_runlinkat (void);
+static void test_tcopyrange (void);     static void test_rcopyrange (void);
+static void test_treaddirplus (void);   static void test_rreaddirplus (void);
+static void test_tcompound (void);      static void test_rcompound (void);
 
 static void test_tversion (void);       static void test_rversion (void);
 static void test_tauth (void);          static void test_rauth (void);
@@ -91,6 +94,9 @@ main (int argc, char *argv[])
     test_tmkdir ();     test_rmkdir ();
     test_trenameat ();  test_rrenameat ();
     test_tunlinkat ();  test_runlinkat ();
+    test_tcopyrange (); test_rcopyrange ();
+    test_treaddirplus (); test_rreaddirplus ();
+    test_tcompound ();  test_rcompound ();
 
     test_tversion ();   test_rversion ();
     test_tauth ();      test_rauth ();
@@ -854,6 +860,254 @@ test_runlinkat (void)
     free (fc2);
 }
 
+static void
+test_tcopyrange (void)
+{
+    Npfcall *fc, *fc2;
+
+    if (!(fc = np_create_tcopyrange (1, 2, 3, 4, 5)))
+        msg_exit ("out of memory");
+    fc2 = _rcv_buf (fc, P9_TCOPYRANGE,  __FUNCTION__);
+
+    assert (fc->u.tcopyrange.srcfid == fc2->u.tcopyrange.srcfid);
+    assert (fc->u.tcopyrange.srcoff == fc2->u.tcopyrange.srcoff);
+    assert (fc->u.tcopyrange.dstfid == fc2->u.tcopyrange.dstfid);
+    assert (fc->u.tcopyrange.dstoff == fc2->u.tcopyrange.dstoff);
+    assert (fc->u.tcopyrange.count == fc2->u.tcopyrange.count);
+
+    free (fc);
+    free (fc2);
+}
+
+static void
+test_rcopyrange (void)
+{
+    Npfcall *fc, *fc2;
+
+    if (!(fc = np_create_rcopyrange (1)))
+        msg_exit ("out of memory");
+    fc2 = _rcv_buf (fc, P9_RCOPYRANGE,  __FUNCTION__);
+
+    assert (fc->u.rcopyrange.count == fc2->u.rcopyrange.count);
+
+    free (fc);
+    free (fc2);
+}
+
+static void
+test_treaddirplus (void)
+{
+    Npfcall *fc, *fc2;
+
+    if (!(fc = np_create_treaddirplus (1, 2, 3, 4)))
+        msg_exit ("out of memory");
+    fc2 = _rcv_buf (fc, P9_TREADDIRPLUS,  __FUNCTION__);
+
+    assert (fc->u.treaddirplus.fid == fc2->u.treaddirplus.fid);
+    assert (fc->u.treaddirplus.offset == fc2->u.treaddirplus.offset);
+    assert (fc->u.treaddirplus.count == fc2->u.treaddirplus.count);
+    assert (fc->u.treaddirplus.request_mask
+                                    == fc2->u.treaddirplus.request_mask);
+
+    free (fc);
+    free (fc2);
+}
+
+static void
+test_rreaddirplus (void)
+{
+    Npfcall *fc, *fc2;
+    int i, n = 0, n0 = 0, len = 1024;
+    struct p9_qid qid[2] = { { 1, 2, 3 }, { 4, 5, 6 } }, qid2;
+    char *name[2] = { "abc", "defgh" }, name2[128];
+    struct p9_rgetattr attr[2], attr2;
+    u64 offset;
+    u8 type;
+
+    memset (attr, 0, sizeof (attr));
+    attr[0].valid = P9_STAT_BASIC;
+    attr[0].qid = qid[0];
+    attr[0].mode = S_IFREG | 0644;
+    attr[0].uid = 100;
+    attr[0].gid = 200;
+    attr[0].nlink = 1;
+    attr[0].size = 4096;
+    attr[0].mtime_sec = 1000;
+    attr[0].mtime_nsec = 2000;
+    /* an entry that could not be stat'd carries valid=0 */
+    attr[1].qid = qid[1];
+
+    if (!(fc = np_create_rreaddirplus (len)))
+        msg_exit ("out of memory");
+    for (i = 0; i < 2; i++)
+        n += np_serialize_p9direntplus (&qid[i], 50 * (i + 1), i + 1, name[i],
+                                        &attr[i], fc->u.rreaddirplus.data + n,
+                                        len - n);
+    assert (n < len);
+    np_finalize_rreaddirplus (fc, n);
+    fc2 = _rcv_buf (fc, P9_RREADDIRPLUS,  __FUNCTION__);
+
+    assert (fc->u.rreaddirplus.count == fc2->u.rreaddirplus.count);
+
+    n = 0;
+    for (i = 0; i < 2; i++) {
+        n += np_deserialize_p9direntplus (&qid2, &offset, &type, name2, 128,
+                                          &attr2, fc2->u.rreaddirplus.data + n,
+                                          fc2->u.rreaddirplus.count - n);
+        if (i == 0)
+            n0 = n;
+        assert (qid2.type == qid[i].type);
+        assert (qid2.version == qid[i].version);
+        assert (qid2.path == qid[i].path);
+        assert (offset == 50 * (i + 1));
+        assert (type == i + 1);
+        assert (strcmp (name2, name[i]) == 0);
+        assert (attr2.valid == attr[i].valid);
+        assert (attr2.mode == attr[i].mode);
+        assert (attr2.uid == attr[i].uid);
+        assert (attr2.gid == attr[i].gid);
+        assert (attr2.nlink == attr[i].nlink);
+        assert (attr2.size == attr[i].size);
+        assert (attr2.mtime_sec == attr[i].mtime_sec);
+        assert (attr2.mtime_nsec == attr[i].mtime_nsec);
+        assert (attr2.data_version == attr[i].data_version);
+    }
+    assert (n == fc2->u.rreaddirplus.count);
+
+    /* an entry cut short must not decode */
+    assert (np_deserialize_p9direntplus (&qid2, &offset, &type, name2, 128,
+                                         &attr2, fc2->u.rreaddirplus.data,
+                                         n0 - 1) == 0);
+
+    free (fc);
+    free (fc2);
+}
+
+static void
+test_tcompound (void)
+{
+    Npfcall *fc, *fc2, *tcs[4], sub;
+    char *wnames[2] = { "a", "b" };
+    int i, n, off;
+    u8 *buf;
+
+    if (!(tcs[0] = np_create_twalk (1, 2, 2, wnames)))
+        msg_exit ("out of memory");
+    if (!(tcs[1] = np_create_tlopen (2, O_RDONLY)))
+        msg_exit ("out of memory");
+    if (!(tcs[2] = np_create_tread (2, 100, 200)))
+        msg_exit ("out of memory");
+    if (!(tcs[3] = np_create_tclunk (2)))
+        msg_exit ("out of memory");
+    for (i = 0; i < 4; i++)
+        np_set_tag (tcs[i], i + 1);
+    if (!(fc = np_create_tcompound (tcs, 4)))
+        msg_exit ("out of memory");
+    fc2 = _rcv_buf (fc, P9_TCOMPOUND,  __FUNCTION__);
+
+    assert (fc->u.tcompound.count == fc2->u.tcompound.count);
+    assert (fc->u.tcompound.size == fc2->u.tcompound.size);
+    assert (fc2->u.tcompound.size == fc2->size - P9_COMPOUNDHDRSZ);
+
+    for (off = 0, i = 0; i < fc2->u.tcompound.count; i++) {
+        n = np_deserialize_compound (&sub, fc2->u.tcompound.data + off,
+                                     fc2->u.tcompound.size - off);
+        assert (n == tcs[i]->size);
+        assert (sub.type == tcs[i]->type);
+        assert (sub.tag == i + 1);
+        off += n;
+    }
+    assert (off == fc2->u.tcompound.size);
+
+    /* the sub-requests decode in place, in order */
+    off = tcs[0]->size;
+    assert (np_deserialize_compound (&sub, fc2->u.tcompound.data,
+                                     fc2->u.tcompound.size) == off);
+    assert (sub.u.twalk.fid == 1);
+    assert (sub.u.twalk.newfid == 2);
+    assert (sub.u.twalk.nwname == 2);
+    assert (np_strcmp (&sub.u.twalk.wnames[1], "b") == 0);
+    assert (np_deserialize_compound (&sub, fc2->u.tcompound.data + off,
+                                     fc2->u.tcompound.size - off) > 0);
+    assert (sub.u.tlopen.fid == 2);
+    assert (sub.u.tlopen.flags == O_RDONLY);
+    off += tcs[1]->size;
+    assert (np_deserialize_compound (&sub, fc2->u.tcompound.data + off,
+                                     fc2->u.tcompound.size - off) > 0);
+    assert (sub.u.tread.offset == 100);
+    assert (sub.u.tread.count == 200);
+
+    /* a compound cut short in the last sub-request, or whose count
+     * claims more requests than it holds, stops there */
+    off = fc2->u.tcompound.size - tcs[3]->size;
+    assert (np_deserialize_compound (&sub, fc2->u.tcompound.data + off,
+                                     tcs[3]->size - 1) == 0);
+    assert (np_deserialize_compound (&sub, fc2->u.tcompound.data + off,
+                                     6) == 0);
+    assert (np_deserialize_compound (&sub, fc2->u.tcompound.data
+                                           + fc2->u.tcompound.size, 0) == 0);
+
+    /* a sub-request whose size cuts into its fields is rejected */
+    if (!(buf = malloc (fc2->u.tcompound.size)))
+        msg_exit ("out of memory");
+    memcpy (buf, fc2->u.tcompound.data, fc2->u.tcompound.size);
+    buf[0] = 9;
+    assert (np_deserialize_compound (&sub, buf, fc2->u.tcompound.size) == 0);
+    free (buf);
+
+    for (i = 0; i < 4; i++)
+        free (tcs[i]);
+    free (fc);
+    free (fc2);
+}
+
+static void
+test_rcompound (void)
+{
+    Npfcall *fc, *fc2, *rcs[3], sub;
+    Npqid qid = { 1, 2, 3 };
+    int i, n, off, len = 256;
+
+    if (!(rcs[0] = np_create_rwalk (1, &qid)))
+        msg_exit ("out of memory");
+    if (!(rcs[1] = np_create_rlopen (&qid, 4096)))
+        msg_exit ("out of memory");
+    /* the request that failed ends the compound */
+    if (!(rcs[2] = np_create_rlerror (ENOENT)))
+        msg_exit ("out of memory");
+    if (!(fc = np_create_rcompound (len)))
+        msg_exit ("out of memory");
+    for (off = 0, i = 0; i < 3; i++) {
+        np_set_tag (rcs[i], i + 1);
+        assert (off + rcs[i]->size <= len);
+        memcpy (fc->u.rcompound.data + off, rcs[i]->pkt, rcs[i]->size);
+        off += rcs[i]->size;
+    }
+    np_finalize_rcompound (fc, 3, off);
+    fc2 = _rcv_buf (fc, P9_RCOMPOUND,  __FUNCTION__);
+
+    assert (fc->u.rcompound.count == fc2->u.rcompound.count);
+    assert (fc->u.rcompound.size == fc2->u.rcompound.size);
+    assert (fc2->u.rcompound.size == off);
+
+    for (off = 0, i = 0; i < fc2->u.rcompound.count; i++) {
+        n = np_deserialize_compound (&sub, fc2->u.rcompound.data + off,
+                                     fc2->u.rcompound.size - off);
+        assert (n == rcs[i]->size);
+        assert (sub.type == rcs[i]->type);
+        assert (sub.tag == i + 1);
+        off += n;
+    }
+    assert (off == fc2->u.rcompound.size);
+    assert (sub.type == P9_RLERROR);
+    assert (sub.u.rlerror.ecode == ENOENT);
+
+    for (i = 0; i < 3; i++)
+        free (rcs[i]);
+    free (fc);
+    free (fc2);
+}
+
 static void
 test_tversion (void)
 {
@@ -0,0 +1,96 @@
+/* treaddirplus.c - list a 9p directory with readdirplus */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "diod_log.h"
+#include "diod_auth.h"
+
+#define MAX_NAMES   64
+
+static void
+usage (void)
+{
+    fprintf (stderr, "Usage: treaddirplus aname path\n");
+    exit (1);
+}
+
+static int
+_strcmp (const void *a, const void *b)
+{
+    return strcmp (*(char **)a, *(char **)b);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npcfid *root, *fid;
+    char *aname, *path;
+    char buf[8192], name[PATH_MAX + 1];
+    char *names[MAX_NAMES];
+    struct p9_rgetattr attr;
+    Npqid qid;
+    u64 offset = 0;
+    u8 type;
+    int i, n, pos, len, count = 0;
+
+    diod_log_init (argv[0]);
+
+    if (argc != 3)
+        usage ();
+    aname = argv[1];
+    path = argv[2];
+
+    if (!(root = npc_mount (0, 0, 65536+24, aname, diod_auth)))
+        errn_exit (np_rerror (), "npc_mount");
+    if (!(fid = npc_opendir (root, path)))
+        errn_exit (np_rerror (), "npc_opendir");
+    while ((n = npc_readdirplus (fid, offset, buf, sizeof (buf),
+                                 P9_STAT_BASIC)) > 0) {
+        for (pos = 0; pos < n; pos += len) {
+            len = np_deserialize_p9direntplus (&qid, &offset, &type,
+                                               name, sizeof (name), &attr,
+                                               (u8 *)buf + pos, n - pos);
+            if (len == 0)
+                msg_exit ("malformed entry");
+            if (count == MAX_NAMES)
+                msg_exit ("too many entries");
+            if (!(names[count++] = strdup (name)))
+                msg_exit ("out of memory");
+        }
+    }
+    if (n < 0)
+        errn_exit (np_rerror (), "npc_readdirplus");
+    if (npc_clunk (fid) < 0)
+        errn_exit (np_rerror (), "npc_clunk");
+    npc_umount (root);
+
+    qsort (names, count, sizeof (names[0]), _strcmp);
+    for (i = 0; i < count; i++) {
+        msg ("%s", names[i]);
+        free (names[i]);
+    }
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
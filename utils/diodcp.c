@@ -0,0 +1,291 @@
+/*****************************************************************************
+ *  Copyright (C) 2010-14 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see http://code.google.com/p/diod.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also: http://www.gnu.org/licenses
+ *****************************************************************************/
+
+/* diodcp.c - copy a file on the server without moving the data */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#if HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npclient.h"
+
+#include "list.h"
+#include "diod_log.h"
+#include "diod_sock.h"
+#include "diod_auth.h"
+
+#define OPTIONS "a:s:m:u:t:pv"
+#if HAVE_GETOPT_LONG
+#define GETOPT(ac,av,opt,lopt) getopt_long (ac,av,opt,lopt,NULL)
+static const struct option longopts[] = {
+    {"aname",   required_argument,      0, 'a'},
+    {"server",  required_argument,      0, 's'},
+    {"msize",   required_argument,      0, 'm'},
+    {"uid",     required_argument,      0, 'u'},
+    {"timeout", required_argument,      0, 't'},
+    {"privport",no_argument,            0, 'p'},
+    {"verbose", no_argument,            0, 'v'},
+    {0, 0, 0, 0},
+};
+#else
+#define GETOPT(ac,av,opt,lopt) getopt (ac,av,opt)
+#endif
+
+static int copyfile (int fd, uid_t uid, int msize, char *aname,
+                     char *src, char *dst, int vopt);
+static void sigalarm (int arg);
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+"Usage: diodcp [OPTIONS] [-s HOST[:PORT]] -a aname src dst\n"
+"   -a,--aname NAME       file system\n"
+"   -s,--server HOST:PORT server (default localhost:564)\n"
+"   -m,--msize            msize (default 65536)\n"
+"   -u,--uid              authenticate as uid (default is your euid)\n"
+"   -t,--timeout SECS     give up after specified seconds\n"
+"   -p,--privport         connect from a privileged port (root user only)\n"
+"   -v,--verbose          report how the data was copied\n"
+);
+    exit (1);
+}
+
+int
+main (int argc, char *argv[])
+{
+    char *aname = NULL;
+    char *server = NULL;
+    int msize = 65536;
+    uid_t uid = geteuid ();
+    int topt = 0;
+    int vopt = 0;
+    int flags = 0;
+    int fd, c;
+
+    diod_log_init (argv[0]);
+
+    opterr = 0;
+    while ((c = GETOPT (argc, argv, OPTIONS, longopts)) != -1) {
+        switch (c) {
+            case 'a':   /* --aname NAME */
+                aname = optarg;
+                break;
+            case 's':   /* --server HOST[:PORT] or /path/to/socket */
+                server = optarg;
+                break;
+            case 'm':   /* --msize SIZE */
+                msize = strtoul (optarg, NULL, 10);
+                break;
+            case 'u':   /* --uid UID */
+                uid = strtoul (optarg, NULL, 10);
+                break;
+            case 't':   /* --timeout SECS */
+                topt = strtoul (optarg, NULL, 10);
+                break;
+            case 'p':   /* --privport */
+                flags |= DIOD_SOCK_PRIVPORT;
+                break;
+            case 'v':   /* --verbose */
+                vopt = 1;
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (!aname || argc - optind != 2)
+        usage ();
+
+    if (signal (SIGPIPE, SIG_IGN) == SIG_ERR)
+        err_exit ("signal");
+    if (signal (SIGALRM, sigalarm) == SIG_ERR)
+        err_exit ("signal");
+
+    if (topt > 0)
+        alarm (topt);
+
+    if ((fd = diod_sock_connect (server, flags)) < 0)
+        exit (1);
+
+    if (copyfile (fd, uid, msize, aname, argv[optind], argv[optind + 1],
+                  vopt) < 0)
+        exit (1);
+
+    close (fd);
+
+    diod_log_fini ();
+
+    exit (0);
+}
+
+static void sigalarm (int arg)
+{
+    msg_exit ("timed out");
+}
+
+/* Copy through the client for servers without the copyrange extension.
+ */
+static int
+copy_rw (Npcfid *sfid, Npcfid *dfid, u64 offset)
+{
+    char *buf;
+    int n, m, done;
+    int ret = -1;
+
+    NP_ASSERT (sfid->iounit > 0); /* libnpclient invariant */
+    if (!(buf = malloc (sfid->iounit))) {
+        msg ("out of memory");
+        return -1;
+    }
+    while ((n = npc_pread (sfid, buf, sfid->iounit, offset)) > 0) {
+        for (done = 0; done < n; done += m) {
+            if ((m = npc_pwrite (dfid, buf + done, n - done,
+                                 offset + done)) <= 0) {
+                errn (m < 0 ? np_rerror () : EIO, "write");
+                goto done;
+            }
+        }
+        offset += n;
+    }
+    if (n < 0) {
+        errn (np_rerror (), "read");
+        goto done;
+    }
+    ret = 0;
+done:
+    free (buf);
+    return ret;
+}
+
+static int
+cp9 (Npcfid *root, char *src, char *dst, int vopt)
+{
+    Npcfid *sfid = NULL, *dfid = NULL;
+    struct stat sb, db;
+    u64 offset = 0;
+    ssize_t n;
+    int ret = -1;
+
+    if (!(sfid = npc_open_bypath (root, src, O_RDONLY))) {
+        errn (np_rerror (), "open %s", src);
+        goto done;
+    }
+    if (npc_fstat (sfid, &sb) < 0) {
+        errn (np_rerror (), "stat %s", src);
+        goto done;
+    }
+    /* creating dst truncates it, which would destroy src */
+    if (npc_stat (root, dst, &db) == 0 && db.st_ino == sb.st_ino) {
+        msg ("%s and %s are the same file", src, dst);
+        goto done;
+    }
+    if (!(dfid = npc_create_bypath (root, dst, O_WRONLY | O_TRUNC,
+                                    sb.st_mode & 07777, getegid ()))) {
+        errn (np_rerror (), "create %s", dst);
+        goto done;
+    }
+    while ((n = npc_copy_range (sfid, offset, dfid, offset,
+                                sb.st_size > offset ? sb.st_size - offset
+                                                    : 1)) > 0)
+        offset += n;
+    if (n < 0) {
+        if (offset > 0 || (np_rerror () != ENOSYS
+                                && np_rerror () != EOPNOTSUPP)) {
+            errn (np_rerror (), "copy %s to %s", src, dst);
+            goto done;
+        }
+        if (vopt)
+            msg ("server cannot copy, copying through client");
+        if (copy_rw (sfid, dfid, 0) < 0)
+            goto done;
+    } else if (vopt)
+        msg ("copied %"PRIu64" bytes on server", offset);
+    ret = 0;
+done:
+    if (dfid && npc_clunk (dfid) < 0) {
+        errn (np_rerror (), "clunk %s", dst);
+        ret = -1;
+    }
+    if (sfid && npc_clunk (sfid) < 0)
+        errn (np_rerror (), "clunk %s", src);
+    return ret;
+}
+
+static int
+copyfile (int fd, uid_t uid, int msize, char *aname, char *src, char *dst,
+          int vopt)
+{
+    Npcfsys *fs = NULL;
+    Npcfid *afid = NULL, *root = NULL;
+    int ret = -1;
+
+    if (!(fs = npc_start (fd, fd, msize, 0))) {
+        errn (np_rerror (), "error negotiating protocol with server");
+        goto done;
+    }
+    if (!(afid = npc_auth (fs, aname, uid, diod_auth)) && np_rerror () != 0) {
+        errn (np_rerror (), "error authenticating to server");
+        goto done;
+    }
+    if (!(root = npc_attach (fs, afid, aname, uid))) {
+        errn (np_rerror (), "error attaching to aname='%s'", aname);
+        goto done;
+    }
+    if (cp9 (root, src, dst, vopt) < 0)
+        goto done;
+    ret = 0;
+done:
+    if (root && npc_clunk (root) < 0) {
+        errn (np_rerror (), "error clunking %s", aname);
+        ret = -1;
+    }
+    if (afid && npc_clunk (afid) < 0) {
+        errn (np_rerror (), "error clunking afid");
+        ret = -1;
+    }
+    if (fs)
+        npc_finish (fs);
+    return ret;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
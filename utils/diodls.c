@@ -191,15 +191,34 @@ mode2str (mode_t mode)
 }
 
 static void
-lsfile_l (Npcfid *dir, char *name)
+printfile_l (struct stat *sb, char *name)
 {
-    Npcfid *fid = NULL;
-    struct stat sb;
     struct passwd *pw;
     struct group *gr;
     char uid[16], gid[16];
     char *mtime;
 
+    if (!(pw = getpwuid (sb->st_uid)))
+        snprintf (uid, sizeof (uid), "%d", sb->st_uid);
+    if (!(gr = getgrgid (sb->st_gid)))
+        snprintf (gid, sizeof (gid), "%d", sb->st_gid);
+    mtime = ctime( &sb->st_mtime);
+    printf ("%10s %4lu %s %s %12lu %.*s %s\n",
+            mode2str (sb->st_mode),
+            (unsigned long)sb->st_nlink,
+            pw ? pw->pw_name : uid,
+            gr ? gr->gr_name : gid,
+            (unsigned long)sb->st_size,
+            (int)strlen (mtime) - 13, mtime + 4,
+            name);
+}
+
+static void
+lsfile_l (Npcfid *dir, char *name)
+{
+    Npcfid *fid = NULL;
+    struct stat sb;
+
     if (!(fid = npc_walk (dir, name))) {
         errn (np_rerror (), "npc_walk %s\n", name);
         goto error;
@@ -212,19 +231,7 @@ lsfile_l (Npcfid *dir, char *name)
         errn (np_rerror (), "npc_clunk %s\n", name);
         goto error;
     }
-    if (!(pw = getpwuid (sb.st_uid)))
-        snprintf (uid, sizeof (uid), "%d", sb.st_uid);
-    if (!(gr = getgrgid (sb.st_gid)))
-        snprintf (gid, sizeof (gid), "%d", sb.st_gid);
-    mtime = ctime( &sb.st_mtime);
-    printf ("%10s %4lu %s %s %12lu %.*s %s\n",
-            mode2str (sb.st_mode),
-            (unsigned long)sb.st_nlink,
-            pw ? pw->pw_name : uid,
-            gr ? gr->gr_name : gid,
-            (unsigned long)sb.st_size,
-            (int)strlen (mtime) - 13, mtime + 4,
-            name);
+    printfile_l (&sb, name);
     return;
 error:
     if (fid)
@@ -236,6 +243,8 @@ lsdir (int i, int count, Npcfid *root, int lopt, char *path)
 {
     Npcfid *dir = NULL;
     struct dirent d, *dp;
+    struct stat sb;
+    int err;
 
     if (!(dir = npc_opendir (root, path))) {
         if (np_rerror () == ENOTDIR) {
@@ -251,13 +260,20 @@ lsdir (int i, int count, Npcfid *root, int lopt, char *path)
     if (count > 1)
         printf ("%s:\n", path);
     do {
-        if ((npc_readdir_r (dir, &d, &dp)) > 0) {
-            errn (np_rerror (), "npc_readdir: %s", path);
+        /* readdirplus returns attributes with entries, saving a
+         * walk/getattr/clunk per entry.
+         */
+        if (lopt)
+            err = npc_readdirplus_r (dir, &d, &sb, &dp);
+        else
+            err = npc_readdir_r (dir, &d, &dp);
+        if (err > 0) {
+            errn (err, "npc_readdir: %s", path);
             goto error;
         }
         if (dp) {
             if (lopt)
-                lsfile_l (dir, dp->d_name);
+                printfile_l (&sb, dp->d_name);
             else if (strcmp (dp->d_name, ".") && strcmp (dp->d_name, ".."))
                 printf ("%s\n", dp->d_name);
         }
@@ -105,6 +105,21 @@ typedef struct {
 } TpoolStats;
 static List tpools = NULL;
 
+/* Latency histogram for one tpool, request type, and kind.
+ * The server reports cumulative counts; we keep the change between
+ * the last two polls so percentiles reflect recent activity.
+ */
+typedef struct {
+    Tpoolkey key;
+    int type;
+    char kind;                          /* 'q'ueue wait or 's'ervice */
+    time_t t;
+    int primed;
+    u64 last[NPSTATS_LAT_BINS];
+    u64 delta[NPSTATS_LAT_BINS];
+} LatStats;
+static List lats = NULL;
+
 /* Aname stats.
  * These are derived from tpool data in _update_display_aname ().
  */
@@ -221,6 +236,8 @@ main (int argc, char *argv[])
 
     if (!(tpools = list_create ((ListDelF)_destroy_tpool)))
         err_exit ("out of memory");
+    if (!(lats = list_create ((ListDelF)free)))
+        err_exit ("out of memory");
 
     sigemptyset (&sigs);
     sigaddset (&sigs, SIGPIPE);
@@ -590,6 +607,112 @@ _update_display_server (WINDOW *win)
     wrefresh (win);
 }
 
+static const struct {
+    int type;
+    char *name;
+} latops[] = {
+    { P9_TSTATFS, "statfs" },       { P9_TLOPEN, "lopen" },
+    { P9_TLCREATE, "lcreate" },     { P9_TSYMLINK, "symlink" },
+    { P9_TMKNOD, "mknod" },         { P9_TRENAME, "rename" },
+    { P9_TREADLINK, "readlink" },   { P9_TGETATTR, "getattr" },
+    { P9_TSETATTR, "setattr" },     { P9_TXATTRWALK, "xattrwalk" },
+    { P9_TXATTRCREATE, "xattrcreate" }, { P9_TREADDIR, "readdir" },
+    { P9_TFSYNC, "fsync" },         { P9_TLOCK, "lock" },
+    { P9_TGETLOCK, "getlock" },     { P9_TLINK, "link" },
+    { P9_TMKDIR, "mkdir" },         { P9_TRENAMEAT, "renameat" },
+    { P9_TUNLINKAT, "unlinkat" },   { P9_TVERSION, "version" },
+    { P9_TAUTH, "auth" },           { P9_TATTACH, "attach" },
+    { P9_TWALK, "walk" },           { P9_TREAD, "read" },
+    { P9_TWRITE, "write" },         { P9_TCLUNK, "clunk" },
+    { P9_TREMOVE, "remove" },       { P9_TREADDIRPLUS, "readdirplus" },
+    { P9_TCOMPOUND, "compound" },   { P9_TCOPYRANGE, "copyrange" },
+};
+
+/* Format the upper bound of the bin holding the pct percentile.
+ */
+static char *
+_fmt_pct (char *buf, int len, u64 *bins, double pct)
+{
+    u64 count = 0, sum = 0, want, usec;
+    int i;
+
+    for (i = 0; i < NPSTATS_LAT_BINS; i++)
+        count += bins[i];
+    if (count == 0) {
+        snprintf (buf, len, "-");
+        return buf;
+    }
+    want = (u64)(count * pct + 0.999999);
+    for (i = 0; i < NPSTATS_LAT_BINS - 1; i++) {
+        sum += bins[i];
+        if (sum >= want)
+            break;
+    }
+    usec = np_lat_bin_usec (i);
+    if (usec < 1000)
+        snprintf (buf, len, "%"PRIu64"us", usec);
+    else if (usec < 1000000)
+        snprintf (buf, len, "%.1fms", (double)usec / 1000);
+    else
+        snprintf (buf, len, "%.2fs", (double)usec / 1000000);
+    return buf;
+}
+
+static void
+_update_display_latency (WINDOW *win)
+{
+    ListIterator itr;
+    LatStats *lp;
+    u64 wait[NPSTATS_LAT_BINS], serv[NPSTATS_LAT_BINS], count;
+    char b1[16], b2[16], b3[16], b4[16], b5[16];
+    time_t now = time (NULL);
+    int y = 0;
+    int i, j;
+
+    wclear (win);
+    wmove (win, y++, 0);
+
+    wattron (win, A_REVERSE);
+    wprintw (win,
+             "%-12.12s %8.8s %8.8s %8.8s %8.8s %8.8s %8.8s\n",
+             "op", "reqs", "wait p50", "wait p99",
+             "svc p50", "svc p90", "svc p99");
+    wattroff (win, A_REVERSE);
+
+    xpthread_mutex_lock (&dtop_lock);
+    for (i = 0; i < sizeof (latops) / sizeof (latops[0]); i++) {
+        memset (wait, 0, sizeof (wait));
+        memset (serv, 0, sizeof (serv));
+        if (!(itr = list_iterator_create (lats)))
+            msg_exit ("out of memory");
+        while ((lp = list_next (itr))) {
+            if (lp->type != latops[i].type || now - lp->t >= stale_secs)
+                continue;
+            for (j = 0; j < NPSTATS_LAT_BINS; j++) {
+                if (lp->kind == 'q')
+                    wait[j] += lp->delta[j];
+                else
+                    serv[j] += lp->delta[j];
+            }
+        }
+        list_iterator_destroy (itr);
+        for (count = 0, j = 0; j < NPSTATS_LAT_BINS; j++)
+            count += serv[j];
+        if (count == 0)
+            continue;
+        mvwprintw (win, y++, 0,
+                   "%-12.12s %8"PRIu64" %8s %8s %8s %8s %8s",
+                   latops[i].name, count,
+                   _fmt_pct (b1, sizeof (b1), wait, 0.50),
+                   _fmt_pct (b2, sizeof (b2), wait, 0.99),
+                   _fmt_pct (b3, sizeof (b3), serv, 0.50),
+                   _fmt_pct (b4, sizeof (b4), serv, 0.90),
+                   _fmt_pct (b5, sizeof (b5), serv, 0.99));
+    }
+    xpthread_mutex_unlock (&dtop_lock);
+    wrefresh (win);
+}
+
 static void
 _update_display_help (WINDOW *win)
 {
@@ -603,13 +726,14 @@ _update_display_help (WINDOW *win)
     mvwprintw (win, y++, 2, "t             Tpool server/aname view");
     mvwprintw (win, y++, 2, "s             Diod server view");
     mvwprintw (win, y++, 2, "c             Display I/O size histograms ");
+    mvwprintw (win, y++, 2, "l             Display request latency percentiles");
     mvwprintw (win, y++, 2, "h|?           Display this help screen");
     mvwprintw (win, y++, 2, "q             Quit");
     wrefresh (win);
 }
 
 typedef enum {
-    VIEW_TPOOL, VIEW_SERVER, VIEW_ANAME, VIEW_RWCOUNT, VIEW_HELP
+    VIEW_TPOOL, VIEW_SERVER, VIEW_ANAME, VIEW_RWCOUNT, VIEW_LATENCY, VIEW_HELP
 } view_t;
 
 static void
@@ -649,6 +773,10 @@ _curses_watcher (double update_secs)
                 _update_display_topwin (topwin);
                 _update_display_rwcount (subwin);
                 break;
+            case VIEW_LATENCY:
+                _update_display_topwin (topwin);
+                _update_display_latency (subwin);
+                break;
              case VIEW_HELP:
                 _update_display_help (topwin);
                 break;
@@ -671,6 +799,9 @@ _curses_watcher (double update_secs)
             case 'c': /* rwcount view */
                 view = VIEW_RWCOUNT;
                 break;
+            case 'l': /* latency view */
+                view = VIEW_LATENCY;
+                break;
             case 'h': /* help view */
             case '?':
                 view = VIEW_HELP;
@@ -866,6 +997,73 @@ _read_ctl_tpools (Server *sp)
     return 0;
 }
 
+static int
+_match_lat (LatStats *lp, LatStats *key)
+{
+    if (lp->type == key->type && lp->kind == key->kind
+            && !strcmp (lp->key.host, key->key.host)
+            && !strcmp (lp->key.aname, key->key.aname))
+        return 1;
+    return 0;
+}
+
+static void
+_update_lat (char *host, time_t t, char *s)
+{
+    LatStats key, *lp;
+    u64 bins[NPSTATS_LAT_BINS];
+    char *name;
+    int i;
+
+    if (np_decode_latency_str (s, &name, &key.type, &key.kind, bins) < 0)
+        return;
+    snprintf (key.key.host, sizeof(key.key.host), "%s", host);
+    snprintf (key.key.aname, sizeof(key.key.aname), "%s", name);
+    free (name);
+
+    xpthread_mutex_lock (&dtop_lock);
+    if (!(lp = list_find_first (lats, (ListFindF)_match_lat, &key))) {
+        if (!(lp = malloc (sizeof (*lp))))
+            msg_exit ("out of memory");
+        memset (lp, 0, sizeof (*lp));
+        lp->key = key.key;
+        lp->type = key.type;
+        lp->kind = key.kind;
+        if (!list_append (lats, lp))
+            msg_exit ("out of memory");
+    }
+    for (i = 0; i < NPSTATS_LAT_BINS; i++) {
+        /* a restarted server's counts go backwards */
+        lp->delta[i] = (lp->primed && bins[i] >= lp->last[i])
+                     ? bins[i] - lp->last[i] : 0;
+        lp->last[i] = bins[i];
+    }
+    lp->primed = 1;
+    lp->t = t;
+    xpthread_mutex_unlock (&dtop_lock);
+}
+
+/* Older servers lack ctl:latency, so this is not fatal like the others.
+ */
+static int
+_read_ctl_latency (Server *sp)
+{
+    time_t now;
+    char *buf, *s, *p;
+
+    if ((buf = npc_aget (sp->root, "latency"))) {
+        now = time (NULL);
+        for (s = buf; s && *s; s = p) {
+            p = strchr (s, '\n');
+            if (p)
+                *p++ = '\0';
+            _update_lat (sp->host, now, s);
+        }
+        free (buf);
+    }
+    return 0;
+}
+
 static int
 _read_ctl_meminfo (Server *sp)
 {
@@ -956,7 +1154,8 @@ _reader (void *arg)
             goto skip;
         }
         if (_read_ctl_tpools (sp) < 0 || _read_ctl_meminfo (sp) < 0
-         || _read_ctl_nfsops (sp) < 0 || _read_ctl_connections (sp) < 0) {
+         || _read_ctl_nfsops (sp) < 0 || _read_ctl_connections (sp) < 0
+         || _read_ctl_latency (sp) < 0) {
             (void)npc_umount (sp->root); /* closes fd */
             sp->root = NULL;
             sp->fd = -1;